@@ -0,0 +1,334 @@
+// Benchmarks for the pieces of unix.cpp that sit on the hot path.
+//
+//   clang++ -O2 -o dist/bench bench.cpp -lpthread   (or ./build.sh bench)
+//   ./dist/bench scan [directory] [file count]
+//   ./dist/bench spawn [parent size MB] [runs]
+//   ./dist/bench search [line count] [spill directory]
+//
+// "scan" generates a tree (unless the directory exists already) and times every way we have of
+// scanning it. Run it once as root after `echo 3 > /proc/sys/vm/drop_caches` for cold-cache numbers.
+//
+// "spawn" times restart latency, from calling start_process to the child reaching main(), for every
+// spawn method. the parent touches [parent size MB] of memory first, since that's what fork pays for.
+//
+// "search" feeds made up log lines into the log search index, as fast as it takes them, then times
+// a few kinds of query over all of it. without a spill directory only the newest segments are kept.
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include "src/ignore.cpp"
+#include "src/archive.cpp"
+#include "src/search.cpp"
+#include "src/unix.cpp"
+
+int32_t bench_quiet = 0;
+
+void watcher_log(Logger *logger, const char *message, ...) {
+    if (bench_quiet) return;
+    va_list list;
+    va_start(list, message);
+    vfprintf(stderr, message, list);
+    va_end(list);
+    fprintf(stderr, "\n");
+}
+
+void watcher_log_ex(Logger *logger, int32_t source, int32_t severity, uint32_t generation, const char *message, ...) {
+    if (bench_quiet) return;
+    va_list list;
+    va_start(list, message);
+    vfprintf(stderr, message, list);
+    va_end(list);
+    fprintf(stderr, "\n");
+}
+
+void watcher_log_text(Logger *logger, int32_t source, uint32_t generation, const char *tag, const char *text, size_t length) {
+    if (bench_quiet) return;
+    fprintf(stderr, "%s%.*s\n", tag, (int)length, text);
+}
+
+uint64_t now_ns() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000llu + time.tv_nsec;
+}
+
+int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// 10 files per leaf directory, 10 directories per level.
+void generate_tree(const char *root, int32_t file_count) {
+    mkdir(root, 0755);
+    char path[1024];
+    for (int32_t i = 0; i < file_count; ++i) {
+        int32_t leaf = i / 10;
+        snprintf(path, sizeof(path), "%s/d%d", root, leaf / 100);
+        mkdir(path, 0755);
+        snprintf(path, sizeof(path), "%s/d%d/d%d", root, leaf / 100, (leaf / 10) % 10);
+        mkdir(path, 0755);
+        snprintf(path, sizeof(path), "%s/d%d/d%d/d%d", root, leaf / 100, (leaf / 10) % 10, leaf % 10);
+        mkdir(path, 0755);
+        snprintf(path, sizeof(path), "%s/d%d/d%d/d%d/f%d.c", root, leaf / 100, (leaf / 10) % 10, leaf % 10, i);
+
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd != -1) {
+            write(fd, path, strlen(path));
+            close(fd);
+        }
+    }
+}
+
+#define BENCH_RUNS 5
+
+typedef struct {
+    const char *name;
+    int32_t     backend;
+    int32_t     threads; // -1 = old recursive stat walk.
+} Scan_Variant;
+
+int bench_scan(const char *root, int32_t file_count) {
+    struct stat status;
+    if (stat(root, &status) == -1) {
+        printf("generating %d files under %s...\n", file_count, root);
+        generate_tree(root, file_count);
+    }
+
+    Logger *logger = (Logger *)calloc(1, sizeof(Logger));
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+    Scan_Variant variants[] = {
+        { "stat walk (find_latest_modified_time)", SCAN_BACKEND_SYNC,  -1 },
+        { "getdents64 + statx, 1 thread",          SCAN_BACKEND_SYNC,   1 },
+        { "getdents64 + statx, all cores",         SCAN_BACKEND_SYNC,   0 },
+        { "io_uring statx",                        SCAN_BACKEND_URING,  1 },
+    };
+
+    printf("%-40s %10s %10s %10s\n", "scanner", "entries", "best ms", "median ms");
+    for (size_t v = 0; v < sizeof(variants) / sizeof(variants[0]); ++v) {
+        uint64_t times[BENCH_RUNS];
+        size_t entries = 0;
+        int32_t backend_used = variants[v].backend;
+
+        for (int32_t run = 0; run < BENCH_RUNS; ++run) {
+            uint64_t begin = now_ns();
+            if (variants[v].threads == -1) {
+                find_latest_modified_time(logger, (char *)root);
+            } else {
+                File_Snapshot snapshot = create_snapshot();
+                snapshot_set_scan_threads(&snapshot, variants[v].threads);
+                snapshot_set_scan_backend(&snapshot, variants[v].backend);
+                snapshot_build(&snapshot, logger, root);
+                entries      = snapshot.count;
+                backend_used = snapshot.scan_backend;
+                destroy_snapshot(&snapshot);
+            }
+            times[run] = now_ns() - begin;
+        }
+
+        qsort(times, BENCH_RUNS, sizeof(uint64_t), compare_u64);
+        char entries_text[32] = "-";
+        if (entries) snprintf(entries_text, sizeof(entries_text), "%zu", entries);
+        printf("%-40s %10s %10.2f %10.2f%s\n", variants[v].name, entries_text,
+               times[0] / 1e6, times[BENCH_RUNS / 2] / 1e6,
+               (backend_used != variants[v].backend) ? " (fell back)" : "");
+    }
+    printf("(%ld cores)\n", cores);
+
+    free(logger);
+    return 0;
+}
+
+typedef struct {
+    const char *name;
+    int32_t     method;
+} Spawn_Variant;
+
+int bench_spawn(int32_t parent_mb, int32_t runs) {
+    // stand-in for everything the real parent has mapped. has to be touched, untouched pages cost fork nothing.
+    size_t ballast_size = (size_t)parent_mb * 1024 * 1024;
+    char *ballast = (char *)malloc(ballast_size ? ballast_size : 1);
+    assert(ballast && "failed to allocate");
+    memset(ballast, 1, ballast_size);
+
+    char self[512] = {0};
+    if (readlink("/proc/self/exe", self, sizeof(self) - 1) == -1) {
+        perror("readlink");
+        free(ballast);
+        return 1;
+    }
+
+    // children inherit the write end and send back when they got to main().
+    int fds[2];
+    if (pipe(fds) == -1) {
+        perror("pipe");
+        free(ballast);
+        return 1;
+    }
+    char command[600];
+    snprintf(command, sizeof(command), "%s spawn-child %d", self, fds[1]);
+
+    Spawn_Variant variants[] = {
+        { "fork + execvp",  SPAWN_METHOD_FORK  },
+        { "posix_spawnp",   SPAWN_METHOD_SPAWN },
+    };
+
+    Logger *logger = (Logger *)calloc(1, sizeof(Logger));
+    uint64_t *to_main   = (uint64_t *)malloc(sizeof(uint64_t) * runs);
+    uint64_t *to_return = (uint64_t *)malloc(sizeof(uint64_t) * runs);
+    assert(to_main && to_return && "failed to allocate");
+
+    // start_process says hello on stdout for every child.
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+
+    printf("parent touches %d MB, %d runs each\n", parent_mb, runs);
+    printf("%-20s %14s %14s %14s (ms)\n", "method", "return median", "main best", "main median");
+    for (size_t v = 0; v < sizeof(variants) / sizeof(variants[0]); ++v) {
+        Process_Handle handle = create_process_handle();
+        process_set_spawn_method(&handle, variants[v].method);
+
+        int32_t done = 0;
+        for (; done < runs; ++done) {
+            fflush(stdout);
+            dup2(null_fd, STDOUT_FILENO);
+            bench_quiet = 1;
+
+            uint64_t begin = now_ns();
+            int32_t started = start_process(command, &handle, logger);
+            uint64_t returned = now_ns();
+
+            bench_quiet = 0;
+            fflush(stdout);
+            dup2(saved_stdout, STDOUT_FILENO);
+            if (!started) break;
+
+            // it's running either way, don't leave it behind.
+            uint64_t child_ns = 0;
+            ssize_t got = read(fds[0], &child_ns, sizeof(child_ns));
+            terminate_process(&handle);
+            if (got != sizeof(child_ns)) break;
+
+            to_return[done] = returned - begin;
+            to_main[done]   = child_ns - begin;
+        }
+        destroy_handle(&handle);
+        if (done == 0) {
+            printf("%-20s failed\n", variants[v].name);
+            continue;
+        }
+
+        qsort(to_return, done, sizeof(uint64_t), compare_u64);
+        qsort(to_main,   done, sizeof(uint64_t), compare_u64);
+        printf("%-20s %14.3f %14.3f %14.3f\n", variants[v].name,
+               to_return[done / 2] / 1e6, to_main[0] / 1e6, to_main[done / 2] / 1e6);
+    }
+
+    close(null_fd);
+    close(saved_stdout);
+    close(fds[0]);
+    close(fds[1]);
+    free(to_main);
+    free(to_return);
+    free(logger);
+    free(ballast);
+    return 0;
+}
+
+typedef struct {
+    const char *name;
+    const char *query;
+} Search_Variant;
+
+int bench_search(int32_t line_count, const char *spill_directory) {
+    const char *levels[]  = { "INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR" };
+    const char *methods[] = { "GET", "GET", "POST", "PUT", "DELETE" };
+    const char *paths[]   = { "/api/users", "/api/orders", "/api/cart", "/static/app.js", "/healthz", "/api/search" };
+
+    Logger *logger = (Logger *)calloc(1, sizeof(Logger));
+    Search_Index *index = create_search_index(spill_directory, logger);
+
+    char line[256];
+    uint32_t random = 12345;
+    uint64_t index_ns = 0;
+    for (int32_t i = 0; i < line_count; ++i) {
+        random = random * 1664525u + 1013904223u;
+        uint32_t r = random >> 8;
+        int length;
+        if (i == line_count / 3) {
+            length = snprintf(line, sizeof(line), "ERROR payment gateway timed out for order 777123, giving up after 3 retries");
+        } else {
+            length = snprintf(line, sizeof(line), "%02d:%02d:%02d.%03d %s %s %s/%u took %ums status=%d request_id=%08x",
+                              (i / 3600000) % 24, (i / 60000) % 60, (i / 1000) % 60, i % 1000,
+                              levels[r % 6], methods[(r >> 3) % 5], paths[(r >> 6) % 6], (r >> 9) % 10000,
+                              (r >> 12) % 500, ((r >> 20) % 20) ? 200 : 500, random * 2654435761u);
+        }
+        uint64_t begin = now_ns();
+        search_index_add(index, (uint64_t)i, line, (size_t)length);
+        index_ns += now_ns() - begin;
+    }
+    printf("indexed %d lines in %.1f ms, %.0f lines/s (%s)\n", line_count, index_ns / 1e6, line_count / (index_ns / 1e9),
+           (spill_directory && spill_directory[0]) ? "spilled to disk" : "memory only");
+
+    Search_Variant variants[] = {
+        { "one line",       "timed out for order 777123" },
+        { "rare",           "status=500" },
+        { "common",         "api/users" },
+        { "no match",       "segfault" },
+        { "short (scan)",   "js" },
+    };
+    Search_Hit *hits = (Search_Hit *)malloc(1000 * sizeof(Search_Hit));
+    uint64_t times[BENCH_RUNS];
+    printf("%-16s %-28s %8s %12s (ms)\n", "query", "", "hits", "median");
+    for (size_t v = 0; v < sizeof(variants) / sizeof(variants[0]); ++v) {
+        size_t found = 0;
+        for (int32_t run = 0; run < BENCH_RUNS; ++run) {
+            uint64_t begin = now_ns();
+            found = search_index_find(index, variants[v].query, NULL, NULL, hits, 1000);
+            times[run] = now_ns() - begin;
+        }
+        qsort(times, BENCH_RUNS, sizeof(uint64_t), compare_u64);
+        printf("%-16s %-28s %8zu %12.3f\n", variants[v].name, variants[v].query, found, times[BENCH_RUNS / 2] / 1e6);
+    }
+
+    free(hits);
+    destroy_search_index(index);
+    free(logger);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc >= 2 && strcmp(argv[1], "scan") == 0) {
+        const char *root = (argc >= 3) ? argv[2] : "/tmp/succotash_bench_tree";
+        int32_t file_count = (argc >= 4) ? atoi(argv[3]) : 200000;
+        return bench_scan(root, file_count);
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "spawn") == 0) {
+        int32_t parent_mb = (argc >= 3) ? atoi(argv[2]) : 256;
+        int32_t runs      = (argc >= 4) ? atoi(argv[3]) : 200;
+        return bench_spawn(parent_mb, runs);
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "search") == 0) {
+        int32_t line_count = (argc >= 3) ? atoi(argv[2]) : 1000000;
+        return bench_search(line_count, (argc >= 4) ? argv[3] : NULL);
+    }
+
+    // what bench_spawn starts: report the time we got here and leave.
+    if (argc >= 3 && strcmp(argv[1], "spawn-child") == 0) {
+        uint64_t now = now_ns();
+        write(atoi(argv[2]), &now, sizeof(now));
+        return 0;
+    }
+
+    printf("usage: %s scan [directory] [file count]\n"
+           "       %s spawn [parent size MB] [runs]\n"
+           "       %s search [line count] [spill directory]\n", argv[0], argv[0], argv[0]);
+    return 1;
+}
@@ -2,6 +2,22 @@ if [ ! -d "dist" ]; then
     mkdir dist
 fi
 
+# ==============================
+# benchmarks only: ./build.sh bench
+# ==============================
+if [ "$1" = "bench" ]; then
+    clang++ -fno-caret-diagnostics -O2 -g -o dist/bench bench.cpp -lpthread
+    exit $?
+fi
+
+# ==============================
+# no window, no SDL / GL: ./build.sh headless
+# ==============================
+if [ "$1" = "headless" ]; then
+    clang++ -fno-caret-diagnostics -O2 -g -DSUCCOTASH_HEADLESS -o dist/succotash-headless src/main.cpp -lpthread
+    exit $?
+fi
+
 if [ ! -d "tmpfile" ]; then
     mkdir tmpfile 
 fi
@@ -17,7 +33,7 @@ popd
 # ==============================
 # compiling main file as C++
 # ==============================
-clang++ -fno-caret-diagnostics -g -o dist/FurrySccotash src/main.cpp tmpfile/microui.o tmpfile/template_sdl_microui_opengl3.o `sdl2-config --cflags --libs` -lGL 
+clang++ -fno-caret-diagnostics -g -o dist/FurrySccotash src/main.cpp tmpfile/microui.o tmpfile/template_sdl_microui_opengl3.o `sdl2-config --cflags --libs` -lGL -lpthread 
 
 # ==============================
 # Cleanup
@@ -0,0 +1,462 @@
+// ====================================
+// Log archive.
+//
+// Children's output, kept for good: DIR/output.lza is a string of blocks compressed in the LZ4
+// block format, DIR/output.lzi has one fixed-size entry per block saying which run it belongs to
+// (binding, restart generation, pid, start time) and where it sits. finding a run is a walk over
+// the index, and only that run's blocks ever get decompressed.
+//
+// A run is one generation of one binding: its stages and the process they built, both streams.
+// every run fills its own block, so blocks of runs that overlap (warm standby) end up
+// interleaved in the data file. the index is what puts them back in order.
+
+#include <time.h>
+#include <errno.h>
+#include "main.h"
+
+#define ARCHIVE_MAGIC      0x32424c53 // "SLB2", in front of every block in the data file.
+#define ARCHIVE_BOUND      (ARCHIVE_BLOCK_SIZE + ARCHIVE_BLOCK_SIZE / 255 + 16)
+#define ARCHIVE_HASH_BITS  14
+
+#define LZ4_MIN_MATCH      4
+#define LZ4_LAST_LITERALS  5  // a block always ends in at least this many literals,
+#define LZ4_MATCH_LIMIT    12 // and no match starts this close to its end.
+
+#define ARCHIVE_RECENT_RUNS 64 // ended runs we remember, a later writer of the same generation carries on with them.
+
+typedef struct {
+    uint32_t magic;
+    uint32_t run;
+    uint32_t raw_size;
+    uint32_t stored_size;
+} Archive_Block_Header;
+
+struct Archive_Run {
+    uint32_t run;
+    int32_t  binding;
+    uint32_t generation;
+    int32_t  pid;         // of the first writer.
+    uint64_t started_ns;
+    uint64_t raw_offset;  // of block[0] in everything the run wrote.
+    uint64_t filled_ms;   // when block got its first byte.
+    uint32_t used;
+    int32_t  writers;     // streams appending to it (stdout and stderr of each child), it ends with the last.
+    Archive_Run *next;    // in open_runs.
+    uint8_t  block[ARCHIVE_BLOCK_SIZE];
+};
+
+typedef struct {
+    uint32_t run;
+    int32_t  binding;
+    uint32_t generation;
+    int32_t  pid;
+    uint64_t started_ns;
+    uint64_t raw_size;    // what it wrote until it ended.
+} Archive_Ended_Run;
+
+struct Log_Archive {
+    Logger  *logger;
+    FILE    *data;
+    FILE    *index;
+    uint64_t data_size;
+    uint64_t index_entries; // whole entries in the index, the next one goes right after them.
+    uint32_t next_run;
+    Archive_Run      *open_runs;
+    Archive_Ended_Run ended[ARCHIVE_RECENT_RUNS];
+    uint32_t          ended_next;
+    uint32_t hash_table[1 << ARCHIVE_HASH_BITS];
+    uint8_t  compressed[ARCHIVE_BOUND];
+};
+
+// ====================================
+// LZ4 block format.
+// sequences of: token (literal length << 4 | match length - 4), more literal length bytes while
+// they're 255, the literals, 2 byte little endian offset back, more match length bytes. the
+// last sequence stops after its literals.
+
+uint32_t read_u32(const uint8_t *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+uint32_t lz4_hash(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - ARCHIVE_HASH_BITS);
+}
+
+uint8_t *lz4_put_length(uint8_t *op, size_t length) {
+    for (; length >= 255; length -= 255) *op++ = 255;
+    *op++ = (uint8_t)length;
+    return op;
+}
+
+// Size of the compressed block, 0 if it wouldn't fit in capacity (store it as is then).
+int32_t lz4_compress(const uint8_t *src, int32_t size, uint8_t *dst, int32_t capacity, uint32_t *hash_table) {
+    uint8_t *op  = dst;
+    uint8_t *end = dst + capacity;
+    int32_t anchor = 0;
+    int32_t ip     = 0;
+
+    memset(hash_table, 0, sizeof(uint32_t) << ARCHIVE_HASH_BITS);
+    if (size > LZ4_MATCH_LIMIT) {
+        int32_t match_start_limit = size - LZ4_MATCH_LIMIT;
+        int32_t match_end_limit   = size - LZ4_LAST_LITERALS;
+
+        while (ip < match_start_limit) {
+            uint32_t sequence  = read_u32(src + ip);
+            uint32_t hash      = lz4_hash(sequence);
+            int32_t  candidate = (int32_t)hash_table[hash];
+            hash_table[hash] = (uint32_t)ip;
+
+            if (candidate >= ip || ip - candidate > 65535 || read_u32(src + candidate) != sequence) {
+                // the longer nothing matched, the faster we skip ahead. text rarely gets there.
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            while (ip > anchor && candidate > 0 && src[ip - 1] == src[candidate - 1]) {
+                ip--;
+                candidate--;
+            }
+            int32_t length = LZ4_MIN_MATCH;
+            while (ip + length < match_end_limit && src[ip + length] == src[candidate + length]) length++;
+
+            size_t literals = (size_t)(ip - anchor);
+            if (op + 1 + literals / 255 + 1 + literals + 2 + (length - LZ4_MIN_MATCH) / 255 + 1 > end) return 0;
+
+            uint8_t *token = op++;
+            *token = (uint8_t)(((literals < 15) ? literals : 15) << 4);
+            if (literals >= 15) op = lz4_put_length(op, literals - 15);
+            memcpy(op, src + anchor, literals);
+            op += literals;
+
+            uint16_t offset = (uint16_t)(ip - candidate);
+            *op++ = (uint8_t)(offset & 0xff);
+            *op++ = (uint8_t)(offset >> 8);
+
+            size_t extra = (size_t)(length - LZ4_MIN_MATCH);
+            *token |= (uint8_t)((extra < 15) ? extra : 15);
+            if (extra >= 15) op = lz4_put_length(op, extra - 15);
+
+            ip    += length;
+            anchor = ip;
+        }
+    }
+
+    size_t literals = (size_t)(size - anchor);
+    if (op + 1 + literals / 255 + 1 + literals > end) return 0;
+    *op++ = (uint8_t)(((literals < 15) ? literals : 15) << 4);
+    if (literals >= 15) op = lz4_put_length(op, literals - 15);
+    memcpy(op, src + anchor, literals);
+    op += literals;
+    return (int32_t)(op - dst);
+}
+
+// Size of what came out, -1 if the block is broken.
+int32_t lz4_decompress(const uint8_t *src, int32_t size, uint8_t *dst, int32_t capacity) {
+    const uint8_t *ip = src, *ip_end = src + size;
+    uint8_t       *op = dst, *op_end = dst + capacity;
+
+    while (ip < ip_end) {
+        uint8_t token = *ip++;
+
+        size_t literals = token >> 4;
+        if (literals == 15) {
+            uint8_t more;
+            do {
+                if (ip >= ip_end) return -1;
+                more = *ip++;
+                literals += more;
+            } while (more == 255);
+        }
+        if ((size_t)(ip_end - ip) < literals || (size_t)(op_end - op) < literals) return -1;
+        memcpy(op, ip, literals);
+        ip += literals;
+        op += literals;
+        if (ip == ip_end) break;
+
+        if (ip_end - ip < 2) return -1;
+        size_t offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) return -1;
+
+        size_t length = (token & 15) + LZ4_MIN_MATCH;
+        if ((token & 15) == 15) {
+            uint8_t more;
+            do {
+                if (ip >= ip_end) return -1;
+                more = *ip++;
+                length += more;
+            } while (more == 255);
+        }
+        if ((size_t)(op_end - op) < length) return -1;
+
+        // may overlap what it's writing, that's how runs of the same bytes come out.
+        const uint8_t *match = op - offset;
+        for (size_t i = 0; i < length; ++i) op[i] = match[i];
+        op += length;
+    }
+    return (int32_t)(op - dst);
+}
+
+// ====================================
+// Writing.
+
+uint64_t wall_clock_ns() {
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+Log_Archive *open_log_archive(const char *directory, Logger *logger) {
+    char data_path[640], index_path[640];
+    snprintf(data_path,  sizeof(data_path),  "%s/output.lza", directory);
+    snprintf(index_path, sizeof(index_path), "%s/output.lzi", directory);
+
+    if (!make_directory(directory)) {
+        watcher_log(logger, "failed to create %s: %s", directory, strerror(errno));
+        return NULL;
+    }
+
+    Log_Archive *archive = (Log_Archive *)malloc(sizeof(Log_Archive));
+    assert(archive && "malloc failed");
+    memset(archive, 0, sizeof(*archive));
+    archive->logger = logger;
+
+    archive->data  = fopen(data_path, "ab");
+    archive->index = fopen(index_path, "r+b");
+    if (!archive->index) archive->index = fopen(index_path, "w+b");
+    if (!archive->data || !archive->index) {
+        watcher_log(logger, "failed to open the archive in %s: %s", directory, strerror(errno));
+        close_log_archive(archive);
+        return NULL;
+    }
+
+    // runs that overlapped get their entries in any order, so the next number is past the highest one.
+    // a half written entry at the end (we went down mid-write) gets written over.
+    fseek(archive->index, 0, SEEK_END);
+    long entries = ftell(archive->index) / (long)sizeof(Archive_Entry);
+    fseek(archive->index, 0, SEEK_SET);
+    Archive_Entry batch[256];
+    for (long done = 0; done < entries; ) {
+        size_t want = (entries - done < 256) ? (size_t)(entries - done) : 256;
+        size_t got  = fread(batch, sizeof(Archive_Entry), want, archive->index);
+        for (size_t i = 0; i < got; ++i) {
+            if (batch[i].run >= archive->next_run) archive->next_run = batch[i].run + 1;
+        }
+        if (got < want) break;
+        done += (long)got;
+    }
+    archive->index_entries = (uint64_t)entries;
+    fseek(archive->index, entries * (long)sizeof(Archive_Entry), SEEK_SET);
+
+    fseek(archive->data, 0, SEEK_END);
+    archive->data_size = (uint64_t)ftell(archive->data);
+    return archive;
+}
+
+void close_log_archive(Log_Archive *archive) {
+    if (!archive) return;
+    while (archive->open_runs) {
+        Archive_Run *run = archive->open_runs;
+        run->writers = 1;
+        archive_end_run(archive, run);
+    }
+    if (archive->data)  fclose(archive->data);
+    if (archive->index) fclose(archive->index);
+    free(archive);
+}
+
+// The run of binding's generation: joins it while it's open, carries on with it if it ended
+// lately (stages, then the process they built), a new one otherwise.
+Archive_Run *archive_begin_run(Log_Archive *archive, int32_t binding, uint32_t generation, int32_t pid) {
+    for (Archive_Run *run = archive->open_runs; run; run = run->next) {
+        if (run->binding == binding && run->generation == generation) return archive_share_run(run);
+    }
+
+    Archive_Run *run = (Archive_Run *)malloc(sizeof(Archive_Run));
+    assert(run && "malloc failed");
+    run->run        = archive->next_run;
+    run->binding    = binding;
+    run->generation = generation;
+    run->pid        = pid;
+    run->started_ns = wall_clock_ns();
+    run->raw_offset = 0;
+    run->filled_ms  = 0;
+    run->used       = 0;
+    run->writers    = 1;
+
+    int32_t carried_on = 0;
+    for (uint32_t i = 0; i < ARCHIVE_RECENT_RUNS && !carried_on; ++i) {
+        Archive_Ended_Run *ended = &archive->ended[(archive->ended_next - 1 - i) % ARCHIVE_RECENT_RUNS];
+        if (ended->started_ns && ended->binding == binding && ended->generation == generation) {
+            run->run        = ended->run;
+            run->pid        = ended->pid;
+            run->started_ns = ended->started_ns;
+            run->raw_offset = ended->raw_size;
+            ended->started_ns = 0; // it's open again.
+            carried_on = 1;
+        }
+    }
+    if (!carried_on) archive->next_run++;
+
+    run->next = archive->open_runs;
+    archive->open_runs = run;
+    return run;
+}
+
+Archive_Run *archive_share_run(Archive_Run *run) {
+    run->writers++;
+    return run;
+}
+
+// Block out to the data file, then its entry to the index. a block without an entry is never looked at.
+void archive_flush_run(Log_Archive *archive, Archive_Run *run) {
+    if (run->used == 0) return;
+
+    int32_t stored = lz4_compress(run->block, (int32_t)run->used, archive->compressed, ARCHIVE_BOUND, archive->hash_table);
+    const uint8_t *payload = archive->compressed;
+    if (stored == 0 || (uint32_t)stored >= run->used) {
+        stored  = (int32_t)run->used;
+        payload = run->block;
+    }
+
+    Archive_Block_Header header = { ARCHIVE_MAGIC, run->run, run->used, (uint32_t)stored };
+    Archive_Entry entry = {0};
+    entry.run         = run->run;
+    entry.binding     = run->binding;
+    entry.generation  = run->generation;
+    entry.pid         = run->pid;
+    entry.started_ns  = run->started_ns;
+    entry.data_offset = archive->data_size;
+    entry.raw_offset  = run->raw_offset;
+    entry.raw_size    = run->used;
+    entry.stored_size = (uint32_t)stored;
+
+    if (fwrite(&header, sizeof(header), 1, archive->data) != 1 ||
+        fwrite(payload, 1, (size_t)stored, archive->data) != (size_t)stored ||
+        fflush(archive->data) != 0) {
+        watcher_log(archive->logger, "failed to write the archive: %s", strerror(errno));
+        // whatever made it out is junk nothing points at, the next block's offset is past it.
+        clearerr(archive->data);
+        fseek(archive->data, 0, SEEK_END);
+        archive->data_size = (uint64_t)ftell(archive->data);
+    } else {
+        archive->data_size += sizeof(header) + (uint64_t)stored;
+        if (fwrite(&entry, sizeof(entry), 1, archive->index) != 1 || fflush(archive->index) != 0) {
+            watcher_log(archive->logger, "failed to write the archive index: %s", strerror(errno));
+            // a partial entry would shift every later one, the next gets written over it.
+            clearerr(archive->index);
+            fseek(archive->index, (long)(archive->index_entries * sizeof(Archive_Entry)), SEEK_SET);
+        } else {
+            archive->index_entries++;
+        }
+    }
+
+    run->raw_offset += run->used;
+    run->used = 0;
+}
+
+void archive_append(Log_Archive *archive, Archive_Run *run, const char *data, size_t size, uint64_t now_ms) {
+    while (size > 0) {
+        if (run->used == 0) run->filled_ms = now_ms;
+        size_t take = ARCHIVE_BLOCK_SIZE - run->used;
+        if (take > size) take = size;
+        memcpy(run->block + run->used, data, take);
+        run->used += (uint32_t)take;
+        data += take;
+        size -= take;
+        if (run->used == ARCHIVE_BLOCK_SIZE) archive_flush_run(archive, run);
+    }
+}
+
+// A run that went quiet shouldn't keep its last lines in memory only.
+void archive_flush_idle_run(Log_Archive *archive, Archive_Run *run, uint64_t now_ms) {
+    if (run->used > 0 && now_ms - run->filled_ms >= ARCHIVE_IDLE_FLUSH_MS) archive_flush_run(archive, run);
+}
+
+void archive_end_run(Log_Archive *archive, Archive_Run *run) {
+    if (--run->writers > 0) return;
+    archive_flush_run(archive, run);
+
+    Archive_Ended_Run *ended = &archive->ended[archive->ended_next++ % ARCHIVE_RECENT_RUNS];
+    ended->run        = run->run;
+    ended->binding    = run->binding;
+    ended->generation = run->generation;
+    ended->pid        = run->pid;
+    ended->started_ns = run->started_ns;
+    ended->raw_size   = run->raw_offset;
+
+    for (Archive_Run **link = &archive->open_runs; *link; link = &(*link)->next) {
+        if (*link == run) {
+            *link = run->next;
+            break;
+        }
+    }
+    free(run);
+}
+
+// ====================================
+// Reading.
+
+int32_t open_archive_reader(Archive_Reader *reader, const char *directory) {
+    char data_path[640], index_path[640];
+    snprintf(data_path,  sizeof(data_path),  "%s/output.lza", directory);
+    snprintf(index_path, sizeof(index_path), "%s/output.lzi", directory);
+
+    memset(reader, 0, sizeof(*reader));
+    reader->data    = (const uint8_t *)map_file(data_path, &reader->data_size);
+    reader->entries = (const Archive_Entry *)map_file(index_path, &reader->index_size);
+    if (!reader->data || !reader->entries) {
+        close_archive_reader(reader);
+        return 0;
+    }
+    reader->entry_count = reader->index_size / sizeof(Archive_Entry);
+    return 1;
+}
+
+void close_archive_reader(Archive_Reader *reader) {
+    if (reader->data)    unmap_file((void *)reader->data, reader->data_size);
+    if (reader->entries) unmap_file((void *)reader->entries, reader->index_size);
+    memset(reader, 0, sizeof(*reader));
+}
+
+// Decompresses one block, out needs ARCHIVE_BLOCK_SIZE. -1 if it's not what the index says.
+int32_t archive_read_block(Archive_Reader *reader, const Archive_Entry *entry, uint8_t *out) {
+    Archive_Block_Header header;
+    if (entry->data_offset + sizeof(header) + entry->stored_size > reader->data_size) return -1;
+    if (entry->raw_size > ARCHIVE_BLOCK_SIZE || entry->stored_size > entry->raw_size) return -1;
+
+    memcpy(&header, reader->data + entry->data_offset, sizeof(header));
+    if (header.magic != ARCHIVE_MAGIC || header.run != entry->run || header.raw_size != entry->raw_size) return -1;
+
+    const uint8_t *payload = reader->data + entry->data_offset + sizeof(header);
+    if (entry->stored_size == entry->raw_size) {
+        memcpy(out, payload, entry->raw_size);
+        return (int32_t)entry->raw_size;
+    }
+    int32_t size = lz4_decompress(payload, (int32_t)entry->stored_size, out, ARCHIVE_BLOCK_SIZE);
+    return (size == (int32_t)entry->raw_size) ? size : -1;
+}
+
+// Everything run wrote, in order, block by block. returns the number of blocks, -1 if one is broken.
+int32_t archive_read_run(Archive_Reader *reader, uint32_t run, void (*emit)(void *context, const uint8_t *data, size_t size), void *context) {
+    uint8_t *block = (uint8_t *)malloc(ARCHIVE_BLOCK_SIZE);
+    assert(block && "malloc failed");
+
+    int32_t blocks = 0;
+    for (size_t i = 0; i < reader->entry_count; ++i) {
+        const Archive_Entry *entry = &reader->entries[i];
+        if (entry->run != run) continue;
+
+        int32_t size = archive_read_block(reader, entry, block);
+        if (size < 0) {
+            blocks = -1;
+            break;
+        }
+        emit(context, block, (size_t)size);
+        blocks++;
+    }
+    free(block);
+    return blocks;
+}
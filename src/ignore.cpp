@@ -0,0 +1,497 @@
+// ====================================
+// Ignore rules.
+//
+// gitignore-style patterns, compiled once per watch so nothing gets parsed while scanning.
+// Plain names (node_modules, .git/) and plain extensions (*.o) go into hash tables,
+// everything else turns into a short glob program.
+// Like git, the last pattern that matches decides, and a leading '!' re-includes.
+
+#include "main.h"
+
+#define IGNORE_NEGATE   0x1
+#define IGNORE_DIR_ONLY 0x2
+#define IGNORE_ANCHORED 0x4 // has a '/' in it: matched against the path relative to the root instead of the name.
+
+enum {
+    GLOB_LITERAL,
+    GLOB_ANY,      // ?
+    GLOB_CLASS,    // [a-z], [!0-9]
+    GLOB_STAR,     // *, never crosses a '/'
+    GLOB_SEGMENTS, // **/, zero or more whole directories
+    GLOB_ANYTHING, // trailing /**, everything below
+};
+
+typedef struct {
+    uint8_t  op;
+    uint8_t  negate;  // GLOB_CLASS only.
+    uint16_t length;  // GLOB_LITERAL only.
+    uint32_t offset;  // into bytes: literal text or 32 byte class bitmap.
+} Glob_Op;
+
+typedef struct {
+    uint32_t first_op;
+    uint32_t op_count;
+    uint8_t  flags;
+} Ignore_Pattern;
+
+typedef struct {
+    uint32_t offset;  // key in bytes, 0 is empty.
+    int32_t  pattern;
+} Ignore_Key;
+
+struct Ignore_Rules {
+    Ignore_Pattern *patterns;
+    size_t          pattern_count;
+    size_t          pattern_capacity;
+
+    Glob_Op *ops;
+    size_t   op_count;
+    size_t   op_capacity;
+
+    char  *bytes;
+    size_t bytes_used;
+    size_t bytes_capacity;
+
+    // exact name -> pattern, ".ext" -> pattern.
+    Ignore_Key *names;
+    size_t      names_capacity;
+    size_t      name_count;
+    Ignore_Key *extensions;
+    size_t      extensions_capacity;
+    size_t      extension_count;
+
+    // patterns that are neither, checked newest first.
+    int32_t *globs;
+    size_t   glob_count;
+    size_t   glob_capacity;
+
+    int32_t has_anchored; // scanners only bother building relative paths when this is set.
+};
+
+Ignore_Rules create_ignore_rules() {
+    Ignore_Rules rules = {0};
+    return rules;
+}
+
+void destroy_ignore_rules(Ignore_Rules *rules) {
+    free(rules->patterns);
+    free(rules->ops);
+    free(rules->bytes);
+    free(rules->names);
+    free(rules->extensions);
+    free(rules->globs);
+    *rules = create_ignore_rules();
+}
+
+#define IgnoreGrow(mArray, mCount, mCapacity, mMinimum) do {                              \
+    if ((mCount) >= (mCapacity)) {                                                        \
+        (mCapacity) = (mCapacity) ? (mCapacity) * 2 : (mMinimum);                         \
+        while ((mCount) >= (mCapacity)) (mCapacity) *= 2;                                 \
+        void *new_ptr = realloc((mArray), (mCapacity) * sizeof(*(mArray)));              \
+        assert(new_ptr && "Realloc failed, shouldn't continue.");                        \
+        (mArray) = (decltype(mArray))new_ptr;                                            \
+    }                                                                                     \
+} while(0)
+
+uint32_t ignore_store_bytes(Ignore_Rules *rules, const char *data, size_t length) {
+    if (rules->bytes_used == 0) rules->bytes_used = 1; // keep offset 0 meaning "nothing".
+    size_t needed = rules->bytes_used + length + 1;
+    IgnoreGrow(rules->bytes, needed, rules->bytes_capacity, 1024);
+
+    uint32_t offset = (uint32_t)rules->bytes_used;
+    memcpy(rules->bytes + offset, data, length);
+    rules->bytes[offset + length] = 0;
+    rules->bytes_used += length + 1;
+    return offset;
+}
+
+uint64_t ignore_hash(const char *key, size_t length) {
+    uint64_t hash = 14695981039346656037llu;
+    for (size_t i = 0; i < length; ++i) hash = (hash ^ (uint8_t)key[i]) * 1099511628211llu;
+    return hash;
+}
+
+// returns -1 if the key isn't there.
+int32_t ignore_table_find(Ignore_Rules *rules, Ignore_Key *table, size_t capacity, const char *key, size_t length) {
+    if (!capacity) return -1;
+    size_t mask = capacity - 1;
+    for (size_t slot = ignore_hash(key, length) & mask; table[slot].offset; slot = (slot + 1) & mask) {
+        const char *stored = rules->bytes + table[slot].offset;
+        if (strncmp(stored, key, length) == 0 && stored[length] == 0) return table[slot].pattern;
+    }
+    return -1;
+}
+
+void ignore_table_insert(Ignore_Rules *rules, Ignore_Key **table, size_t *capacity, size_t *count, const char *key, size_t length, int32_t pattern) {
+    if ((*count + 1) * 2 > *capacity) {
+        size_t new_capacity = *capacity ? *capacity * 2 : 64;
+        Ignore_Key *new_table = (Ignore_Key *)calloc(new_capacity, sizeof(Ignore_Key));
+        assert(new_table && "Calloc failed, shouldn't continue.");
+
+        for (size_t i = 0; i < *capacity; ++i) {
+            if (!(*table)[i].offset) continue;
+            const char *stored = rules->bytes + (*table)[i].offset;
+            size_t slot = ignore_hash(stored, strlen(stored)) & (new_capacity - 1);
+            while (new_table[slot].offset) slot = (slot + 1) & (new_capacity - 1);
+            new_table[slot] = (*table)[i];
+        }
+        free(*table);
+        *table    = new_table;
+        *capacity = new_capacity;
+    }
+
+    uint32_t offset = ignore_store_bytes(rules, key, length);
+    size_t slot = ignore_hash(key, length) & (*capacity - 1);
+    while ((*table)[slot].offset) slot = (slot + 1) & (*capacity - 1);
+    (*table)[slot].offset  = offset;
+    (*table)[slot].pattern = pattern;
+    (*count)++;
+}
+
+void ignore_push_op(Ignore_Rules *rules, uint8_t op, uint32_t offset, uint16_t length, uint8_t negate) {
+    IgnoreGrow(rules->ops, rules->op_count, rules->op_capacity, 64);
+    Glob_Op *glob = &rules->ops[rules->op_count++];
+    glob->op     = op;
+    glob->offset = offset;
+    glob->length = length;
+    glob->negate = negate;
+}
+
+// Turn pattern text into glob ops. returns 0 for things we can't make sense of.
+int32_t ignore_compile_glob(Ignore_Rules *rules, const char *pattern, size_t length) {
+    char literal[512];
+    size_t literal_length = 0;
+
+#define FlushLiteral() do { if (literal_length) { ignore_push_op(rules, GLOB_LITERAL, ignore_store_bytes(rules, literal, literal_length), (uint16_t)literal_length, 0); literal_length = 0; } } while(0)
+
+    for (size_t i = 0; i < length; ++i) {
+        char c = pattern[i];
+        if (c == '\\' && i + 1 < length) {
+            if (literal_length + 1 >= sizeof(literal)) return 0;
+            literal[literal_length++] = pattern[++i];
+        } else if (c == '*' && i + 1 < length && pattern[i + 1] == '*') {
+            int32_t at_segment_start = (i == 0 || pattern[i - 1] == '/');
+            if (at_segment_start && i + 2 < length && pattern[i + 2] == '/') {
+                FlushLiteral();
+                ignore_push_op(rules, GLOB_SEGMENTS, 0, 0, 0);
+                i += 2; // eat "*/" too.
+            } else if (at_segment_start && i + 2 == length) {
+                FlushLiteral();
+                ignore_push_op(rules, GLOB_ANYTHING, 0, 0, 0);
+                i += 1;
+            } else {
+                // not a real "**", behaves like two stars.
+                FlushLiteral();
+                ignore_push_op(rules, GLOB_STAR, 0, 0, 0);
+                i += 1;
+            }
+        } else if (c == '*') {
+            FlushLiteral();
+            ignore_push_op(rules, GLOB_STAR, 0, 0, 0);
+        } else if (c == '?') {
+            FlushLiteral();
+            ignore_push_op(rules, GLOB_ANY, 0, 0, 0);
+        } else if (c == '[') {
+            size_t end = i + 1;
+            if (end < length && (pattern[end] == '!' || pattern[end] == '^')) end++;
+            if (end < length && pattern[end] == ']') end++;
+            while (end < length && pattern[end] != ']') end++;
+            if (end >= length) {
+                // no closing bracket, git takes it literally.
+                if (literal_length + 1 >= sizeof(literal)) return 0;
+                literal[literal_length++] = c;
+                continue;
+            }
+
+            FlushLiteral();
+            uint8_t bitmap[32] = {0};
+            size_t j = i + 1;
+            uint8_t negate = 0;
+            if (pattern[j] == '!' || pattern[j] == '^') { negate = 1; j++; }
+            for (size_t first = j; j < end; ++j) {
+                uint8_t from = (uint8_t)pattern[j];
+                uint8_t to   = from;
+                if (j + 2 < end && pattern[j + 1] == '-' && (j != first || pattern[j] != ']')) {
+                    to = (uint8_t)pattern[j + 2];
+                    j += 2;
+                }
+                for (uint32_t ch = from; ch <= to; ++ch) bitmap[ch >> 3] |= (uint8_t)(1 << (ch & 7));
+            }
+            ignore_push_op(rules, GLOB_CLASS, ignore_store_bytes(rules, (const char *)bitmap, sizeof(bitmap)), 0, negate);
+            i = end;
+        } else {
+            if (literal_length + 1 >= sizeof(literal)) return 0;
+            literal[literal_length++] = c;
+        }
+    }
+    FlushLiteral();
+#undef FlushLiteral
+    return 1;
+}
+
+// Add a single pattern, same syntax as one line of .gitignore.
+void ignore_rules_add(Ignore_Rules *rules, const char *line) {
+    size_t length = strlen(line);
+
+    // trailing spaces don't count unless escaped.
+    while (length > 0 && (line[length - 1] == ' ' || line[length - 1] == '\t' || line[length - 1] == '\r')) {
+        if (length >= 2 && line[length - 2] == '\\') break;
+        length--;
+    }
+    if (length == 0 || line[0] == '#') return;
+
+    uint8_t flags = 0;
+    if (line[0] == '!') {
+        flags |= IGNORE_NEGATE;
+        line++; length--;
+    }
+    if (length > 0 && line[length - 1] == '/') {
+        flags |= IGNORE_DIR_ONLY;
+        length--;
+    }
+    if (length > 0 && line[0] == '/') {
+        flags |= IGNORE_ANCHORED;
+        line++; length--;
+    }
+    if (length == 0) return;
+    if (memchr(line, '/', length)) flags |= IGNORE_ANCHORED;
+
+    IgnoreGrow(rules->patterns, rules->pattern_count, rules->pattern_capacity, 32);
+    int32_t index = (int32_t)rules->pattern_count;
+    Ignore_Pattern *pattern = &rules->patterns[index];
+    pattern->flags    = flags;
+    pattern->first_op = (uint32_t)rules->op_count;
+
+    if (!ignore_compile_glob(rules, line, length)) return;
+    pattern->op_count = (uint32_t)(rules->op_count - pattern->first_op);
+    rules->pattern_count++;
+
+    // fast paths. a key only ever points at one pattern, anything sharing it goes through the glob list.
+    Glob_Op *ops = &rules->ops[pattern->first_op];
+    if (!(flags & IGNORE_ANCHORED) && pattern->op_count == 1 && ops[0].op == GLOB_LITERAL &&
+        ignore_table_find(rules, rules->names, rules->names_capacity, rules->bytes + ops[0].offset, ops[0].length) == -1)
+    {
+        ignore_table_insert(rules, &rules->names, &rules->names_capacity, &rules->name_count,
+                            rules->bytes + ops[0].offset, ops[0].length, index);
+        return;
+    }
+
+    if (!(flags & IGNORE_ANCHORED) && pattern->op_count == 2 && ops[0].op == GLOB_STAR && ops[1].op == GLOB_LITERAL) {
+        const char *extension = rules->bytes + ops[1].offset;
+        if (extension[0] == '.' && !strchr(extension + 1, '.') &&
+            ignore_table_find(rules, rules->extensions, rules->extensions_capacity, extension, ops[1].length) == -1)
+        {
+            ignore_table_insert(rules, &rules->extensions, &rules->extensions_capacity, &rules->extension_count,
+                                extension, ops[1].length, index);
+            return;
+        }
+    }
+
+    if (flags & IGNORE_ANCHORED) rules->has_anchored = 1;
+    IgnoreGrow(rules->globs, rules->glob_count, rules->glob_capacity, 32);
+    rules->globs[rules->glob_count++] = index;
+}
+
+// Add a pattern from the .gitignore of directory base (relative to the root, "" is the root itself).
+// like git, it only reaches below base: "x" turns into "/base/**/x", "a/b" and "/a/b" into "/base/a/b".
+void ignore_rules_add_below(Ignore_Rules *rules, const char *base, const char *line) {
+    if (!base[0] || line[0] == 0 || line[0] == '#') {
+        ignore_rules_add(rules, line);
+        return;
+    }
+
+    const char *negate = "";
+    if (line[0] == '!') {
+        negate = "!";
+        line++;
+    }
+    size_t length = strlen(line);
+    while (length > 0 && line[length - 1] == '/') length--; // a trailing slash doesn't anchor it.
+    int32_t anchored = memchr(line, '/', length) != NULL;
+    if (line[0] == '/') line++;
+
+    // the directory name goes in literally, whatever glob characters it has.
+    char escaped[1024];
+    size_t used = 0;
+    for (const char *c = base; *c && used + 2 < sizeof(escaped); ++c) {
+        if (strchr("*?[\\", *c)) escaped[used++] = '\\';
+        escaped[used++] = *c;
+    }
+    escaped[used] = 0;
+
+    char pattern[2048];
+    snprintf(pattern, sizeof(pattern), "%s/%s/%s%s", negate, escaped, anchored ? "" : "**/", line);
+    ignore_rules_add(rules, pattern);
+}
+
+// Add every pattern in text, split on any of the delimiters.
+void ignore_rules_add_list(Ignore_Rules *rules, const char *text, const char *delimiters) {
+    char line[1024];
+    while (*text) {
+        size_t length = strcspn(text, delimiters);
+        if (length > 0 && length < sizeof(line)) {
+            memcpy(line, text, length);
+            line[length] = 0;
+            ignore_rules_add(rules, line);
+        }
+        text += length;
+        if (*text) text++;
+    }
+}
+
+// Patterns of a .gitignore file that sits in directory base, see ignore_rules_add_below.
+// returns 0 if there's no such file, which is fine.
+int32_t ignore_rules_load_file(Ignore_Rules *rules, const char *path, const char *base) {
+    FILE *file = fopen(path, "rb");
+    if (!file) return 0;
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    char *text = (char *)malloc(size + 1);
+    assert(text && "Malloc failed, shouldn't continue.");
+    size_t read_amount = fread(text, 1, size, file);
+    text[read_amount] = 0;
+    fclose(file);
+
+    char *line = text;
+    while (*line) {
+        size_t length = strcspn(line, "\r\n");
+        char *next = line + length;
+        if (*next) *next++ = 0;
+        ignore_rules_add_below(rules, base, line);
+        line = next;
+    }
+    free(text);
+    return 1;
+}
+
+// Backtracking, not a DFA: a star tries every place the rest could start. patterns with several
+// stars against a long path could blow up, so every attempt costs a step out of *steps and
+// once they're used up it's no match (the entry gets watched rather than hidden).
+#define GLOB_MATCH_STEPS (64 * 1024)
+
+int32_t glob_match_steps(Ignore_Rules *rules, Glob_Op *ops, uint32_t op_count, const char *subject, int32_t *steps) {
+    if (--*steps < 0) return 0;
+    while (op_count > 0) {
+        Glob_Op *glob = ops;
+        switch (glob->op) {
+            case GLOB_LITERAL:
+                if (strncmp(subject, rules->bytes + glob->offset, glob->length) != 0) return 0;
+                subject += glob->length;
+                break;
+
+            case GLOB_ANY:
+                if (!*subject || *subject == '/') return 0;
+                subject++;
+                break;
+
+            case GLOB_CLASS: {
+                uint8_t c = (uint8_t)*subject;
+                if (!c || c == '/') return 0;
+                const uint8_t *bitmap = (const uint8_t *)rules->bytes + glob->offset;
+                int32_t in_class = (bitmap[c >> 3] >> (c & 7)) & 1;
+                if (in_class == glob->negate) return 0;
+                subject++;
+            } break;
+
+            case GLOB_STAR:
+                for (const char *cursor = subject; *steps >= 0; ++cursor) {
+                    if (glob_match_steps(rules, ops + 1, op_count - 1, cursor, steps)) return 1;
+                    if (!*cursor || *cursor == '/') return 0;
+                }
+                return 0;
+
+            case GLOB_SEGMENTS:
+                for (const char *cursor = subject; *steps >= 0; ) {
+                    if (glob_match_steps(rules, ops + 1, op_count - 1, cursor, steps)) return 1;
+                    const char *slash = strchr(cursor, '/');
+                    if (!slash) return 0;
+                    cursor = slash + 1;
+                }
+                return 0;
+
+            case GLOB_ANYTHING:
+                return *subject != 0;
+        }
+        ops++;
+        op_count--;
+    }
+    return *subject == 0;
+}
+
+int32_t glob_match(Ignore_Rules *rules, Glob_Op *ops, uint32_t op_count, const char *subject) {
+    int32_t steps = GLOB_MATCH_STEPS;
+    return glob_match_steps(rules, ops, op_count, subject, &steps);
+}
+
+int32_t ignore_pattern_applies(Ignore_Rules *rules, int32_t index, int32_t is_dir) {
+    return !(rules->patterns[index].flags & IGNORE_DIR_ONLY) || is_dir;
+}
+
+// relative_path is the path below the watched root (no leading '/'), name its last component.
+// relative_path is only looked at if rules->has_anchored is set, passing NULL otherwise is fine.
+int32_t ignore_rules_match(Ignore_Rules *rules, const char *relative_path, const char *name, int32_t is_dir) {
+    if (!rules || rules->pattern_count == 0) return 0;
+
+    int32_t best = -1;
+    int32_t hit  = ignore_table_find(rules, rules->names, rules->names_capacity, name, strlen(name));
+    if (hit != -1 && ignore_pattern_applies(rules, hit, is_dir)) best = hit;
+
+    const char *extension = strrchr(name, '.');
+    if (extension) {
+        hit = ignore_table_find(rules, rules->extensions, rules->extensions_capacity, extension, strlen(extension));
+        if (hit > best && ignore_pattern_applies(rules, hit, is_dir)) best = hit;
+    }
+
+    for (size_t i = rules->glob_count; i-- > 0 && rules->globs[i] > best; ) {
+        int32_t index = rules->globs[i];
+        Ignore_Pattern *pattern = &rules->patterns[index];
+        if (!ignore_pattern_applies(rules, index, is_dir)) continue;
+
+        const char *subject = (pattern->flags & IGNORE_ANCHORED) ? relative_path : name;
+        if (subject && glob_match(rules, &rules->ops[pattern->first_op], pattern->op_count, subject)) {
+            best = index;
+            break;
+        }
+    }
+
+    return best != -1 && !(rules->patterns[best].flags & IGNORE_NEGATE);
+}
+
+// Same thing for an entry inside the directory at parent_path ("" for the root).
+// the joined path only gets built when some pattern actually looks at it.
+int32_t ignore_rules_match_child(Ignore_Rules *rules, const char *parent_path, const char *name, int32_t is_dir) {
+    if (!rules || rules->pattern_count == 0) return 0;
+    if (!rules->has_anchored) return ignore_rules_match(rules, NULL, name, is_dir);
+
+    char path[4096];
+    snprintf(path, sizeof(path), parent_path[0] ? "%s/%s" : "%s%s", parent_path, name);
+    return ignore_rules_match(rules, path, name, is_dir);
+}
+
+void ignore_path_set_parent(Ignore_Path *path, const char *parent_path) {
+    size_t length = strlen(parent_path);
+    path->fits = length + 2 <= sizeof(path->path);
+    if (!path->fits) return;
+    memcpy(path->path, parent_path, length);
+    if (length) path->path[length++] = '/';
+    path->parent_length = length;
+}
+
+// Like ignore_rules_match_child, only the name gets copied in per entry. a path that doesn't fit
+// only goes through the patterns that look at the name.
+int32_t ignore_rules_match_in(Ignore_Rules *rules, Ignore_Path *path, const char *name, int32_t is_dir) {
+    if (!rules || rules->pattern_count == 0) return 0;
+    if (!rules->has_anchored) return ignore_rules_match(rules, NULL, name, is_dir);
+
+    size_t name_length = strlen(name);
+    if (!path->fits || path->parent_length + name_length + 1 > sizeof(path->path)) return ignore_rules_match(rules, NULL, name, is_dir);
+    memcpy(path->path + path->parent_length, name, name_length + 1);
+    return ignore_rules_match(rules, path->path, name, is_dir);
+}
+
+int32_t ignore_rules_need_paths(Ignore_Rules *rules) {
+    return rules && rules->has_anchored;
+}
@@ -4,7 +4,11 @@
 #include <inttypes.h>
 #include <stdint.h>
 #include <string.h>
+#include <stdarg.h>
+#include <errno.h>
 
+// -DSUCCOTASH_HEADLESS builds without SDL / OpenGL / microui, see build.sh headless.
+#ifndef SUCCOTASH_HEADLESS
 #ifdef _WIN32 
 #define SDL_MAIN_HANDLED 1 
 #include <SDL.h>
@@ -12,6 +16,7 @@
 #else
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_opengl.h>
+#include <SDL2/SDL_syswm.h>
 #endif
 
 extern "C" {
@@ -28,7 +33,13 @@ extern "C" {
     void r_set_clip_rect(mu_Rect rect);
     void r_clear(mu_Color color);
     void r_present(void);
+    SDL_Window *r_get_window(void);
 }
+#endif
+
+#include "ignore.cpp"
+#include "archive.cpp"
+#include "search.cpp"
 
 #if _WIN32
 /* ======================= */
@@ -39,34 +50,381 @@ extern "C" {
 #include "unix.cpp"
 #endif
 
+// ====================================
+// Bindings.
+//
+// A directory and the command that gets restarted when something in it changes. They all share
+// the one watch and snapshot of Succotash, which sit on the closest directory containing all of
+// them: the tree gets scanned once however many commands care about it, and every change goes
+// to each binding whose directory it's in.
+
+#define BINDING_MAX 32
+#define STAGE_MAX   16
+#define RETIRING_MAX 4 // replaced children still being stopped, per binding.
+
+// One-shot commands (build, test, lint...) that have to pass before the command gets restarted.
+enum { STAGE_WAITING, STAGE_RUNNING, STAGE_PASSED, STAGE_FAILED, STAGE_CANCELLED };
+enum { PIPELINE_IDLE, PIPELINE_NEEDED, PIPELINE_RUNNING, PIPELINE_FAILED, PIPELINE_PASSED };
+
+typedef struct {
+    char    name[32];
+    char    command[512];
+    int32_t after[STAGE_MAX]; // stages that have to pass first, always ones defined before this one.
+    int32_t after_count;
+} Stage;
+
+struct Pipeline {
+    Stage          stages[STAGE_MAX];
+    int32_t        stage_count;
+    int32_t        max_running; // 0 = as many as are ready.
+
+    int32_t        status;      // PIPELINE_*, PASSED only ever gets returned by update_pipeline.
+    int32_t        cancelling;  // stages on their way out, the next run waits for them.
+    int32_t        stage_state[STAGE_MAX];
+    Process_Handle handles[STAGE_MAX];
+    uint64_t       started_ms;
+};
+
+struct Binding {
+    char    directory[512]; // resolved, somewhere inside watch_root.
+    char    command[512];
+    size_t  directory_length;
+    int32_t covers_root;    // directory is watch_root, every change is ours.
+    size_t  changed_count;  // entries in this round's snapshot.changed that are below directory.
+
+    int32_t        process_was_alive;
+    Process_Handle handle;
+    Process_Handle standby;   // replacement waiting at the readiness gate (warm_standby).
+    Process_Handle retiring[RETIRING_MAX]; // the ones it replaced, on their way out.
+    int32_t        standby_pending;
+    uint64_t       standby_started_ms;
+    int32_t        retiring_alive[RETIRING_MAX];
+    int32_t        retiring_next; // the slot that was filled longest ago.
+    Debounce       debounce;
+    Backoff        backoff;
+    Pipeline       pipeline;  // first binding only, empty for the others.
+    uint32_t       generation; // starts of command so far. its output and whatever we say about it carry this.
+};
+
+#define SEARCH_HITS_MAX 1000 // newest matches the log panel shows while searching.
+
+// What the log panel keeps of a record besides the text, which the search index has.
+typedef struct {
+    uint64_t time_ns;
+    uint32_t generation;
+    uint8_t  source;
+    uint8_t  severity;
+} Log_Row_Header;
+
 struct Succotash {
     int32_t running;
-    uint64_t last_modified_time;
-    int32_t  should_process_running;
+    int32_t should_process_running;
+    int32_t headless;         // no window, logs go to stdout.
 
     int32_t folder_is_invalid;
-    char directory[512];
+    int32_t directory_changed;
+    int32_t hash_contents;
+    char directory[512];  // first binding's, the one the GUI edits.
     char command[512];
+    char ignore[512];   // space separated, .gitignore syntax. root .gitignore gets added on top.
+    char watch_root[512];
+    int32_t primary_set;  // directory / command given explicitly (or no --bind at all): bindings[0] is theirs.
+    char    bind_specs[BINDING_MAX][1024]; // "directory=command" from --bind.
+    int32_t bind_spec_count;
+    char    stage_specs[STAGE_MAX][640];   // "name [after a,b]: command" from --stage.
+    int32_t stage_spec_count;
+    int32_t stage_jobs;
+
+    int32_t  scan_threads;
+    int32_t  scan_backend;
+    int32_t  spawn_method;
+    char     stop_signal[16];
+    uint32_t stop_timeout_ms;
+    int32_t  warm_standby;     // start the replacement first, switch over once it says it's ready.
+    uint32_t ready_timeout_ms;
+    char     listen[256];      // addresses we keep listening on for the children, see open_listen_sockets.
+    int      listen_fds[LISTEN_MAX];
+    int32_t  listen_count;
+    uint32_t debounce_ms;
+    uint32_t debounce_max_ms;
+    int32_t  capture_output;   // children's stdout / stderr go to the log instead of ours.
+    char     output_log[512];  // directory every byte of it gets kept in as well, empty = nowhere.
+    char     archive[512];     // same, compressed and indexed by run.
+    char     search_dir[512];  // where the log search index goes once it gets too big for memory, empty = it forgets instead.
+    uint32_t output_log_max_mb;
+    uint32_t output_log_max_age_s;
+    int32_t  output_log_keep;
+    uint32_t restart_backoff_ms;
+    uint32_t restart_backoff_max_ms;
+    uint32_t restart_max;       // exits within restart_window_ms before giving up.
+    uint32_t restart_window_ms;
 
     Logger         logger;
-    Process_Handle handle;
+    Output_Reader *output;
+    Search_Index  *search;         // GUI only, nobody to search with headless.
+    uint64_t       search_next;    // first record it doesn't have yet. the feeder's, see Search_Feeder.
+    uint64_t       search_seen;    // first record the panel didn't look at yet.
+    char           search_query[128];
+    int32_t        search_dirty;   // query or index changed since the hits were found.
+    Search_Hit     search_hits[SEARCH_HITS_MAX];
+    size_t         search_hit_count;
+    Log_Row_Header *log_headers;   // LOG_PANEL_ROWS of them, by record number. GUI only, same as search.
+    int32_t        show_source[LOG_SOURCE_COUNT]; // log panel filter, all of them = no filter.
+    int32_t        filtering;
+    uint64_t      *filtered_rows;  // record numbers that pass the filter, a ring of LOG_PANEL_ROWS. only while filtering.
+    size_t         filtered_start;
+    size_t         filtered_count;
+    Binding        bindings[BINDING_MAX];
+    int32_t        binding_count;
+    int32_t        has_primary;
+    Watch_Handle   watch;
+    File_Snapshot  snapshot;
+    Ignore_Rules   ignore_rules;
+    Event_Loop     loop;
+    uint32_t       watch_start_count; // last start of the watch whose fd went into loop.
 };
 
+#define LOG_PANEL_ROWS   (1024 * 1024) // newest records the log panel goes back to, as far as they're still around.
+#define WINDOW_POLL_MS   16  // no window fd to sleep on, check for input this often instead.
+#define FALLBACK_SCAN_MS 100 // no inotify, walk the tree this often while the process should run.
+
+void init_logger(Logger *logger) {
+    logger->arena = (char *)malloc(LOG_ARENA_SIZE + LOG_LINE_MAX);
+    logger->index = (Log_Slot *)malloc(LOG_INDEX_SIZE * sizeof(Log_Slot));
+    assert(logger->arena && logger->index && "malloc failed");
+    for (size_t i = 0; i < LOG_INDEX_SIZE; ++i) {
+        Log_Slot *slot = &logger->index[i];
+        slot->sequence.store(0, std::memory_order_relaxed);
+        slot->offset.store(0, std::memory_order_relaxed);
+        slot->length.store(0, std::memory_order_relaxed);
+        slot->kind.store(0, std::memory_order_relaxed);
+        slot->time_ns.store(0, std::memory_order_relaxed);
+        slot->generation.store(0, std::memory_order_relaxed);
+    }
+    logger->records = 0;
+    logger->bytes   = 0;
+    logger->started_ns = platform_monotonic_ns();
+}
+
+void destroy_logger(Logger *logger) {
+    free(logger->arena);
+    free(logger->index);
+    logger->arena = NULL;
+    logger->index = NULL;
+}
+
+uint64_t logger_record_count(Logger *logger) {
+    return logger->records.load(std::memory_order_acquire);
+}
+
+// Claims a record and room for length bytes plus the 0. the text goes in at the pointer, then logger_publish.
+char *logger_claim(Logger *logger, size_t length, int32_t source, int32_t severity, uint32_t generation, uint64_t *out_number) {
+    uint64_t number = logger->records.fetch_add(1, std::memory_order_relaxed);
+    uint64_t offset = logger->bytes.fetch_add(length + 1, std::memory_order_relaxed);
+
+    // seqlock: a reader that sees the old number before the fields sees it gone after them.
+    Log_Slot *slot = &logger->index[number % LOG_INDEX_SIZE];
+    slot->sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot->offset.store(offset, std::memory_order_relaxed);
+    slot->length.store((uint32_t)length, std::memory_order_relaxed);
+    slot->kind.store((uint32_t)source | (uint32_t)severity << 8, std::memory_order_relaxed);
+    slot->time_ns.store(platform_monotonic_ns(), std::memory_order_relaxed);
+    slot->generation.store(generation, std::memory_order_relaxed);
+
+    *out_number = number;
+    return logger->arena + offset % LOG_ARENA_SIZE;
+}
+
+void logger_publish(Logger *logger, uint64_t number) {
+    logger->index[number % LOG_INDEX_SIZE].sequence.store(number + 1, std::memory_order_release);
+}
+
+// A record that can't be read anymore: its slot or its bytes went to a newer one. one that's
+// still being written isn't gone, it just isn't there yet.
+int32_t logger_gone(Logger *logger, uint64_t number) {
+    if (logger->records.load(std::memory_order_acquire) - number > LOG_INDEX_SIZE) return 1;
+    Log_Slot *slot = &logger->index[number % LOG_INDEX_SIZE];
+    if (slot->sequence.load(std::memory_order_acquire) != number + 1) return 0;
+    return logger->bytes.load(std::memory_order_relaxed) - slot->offset.load(std::memory_order_relaxed) > LOG_ARENA_SIZE;
+}
+
+// The text gets copied out first and only counts if the record is still there after that, a writer
+// may have taken its slot or bytes over halfway through.
+int32_t logger_read(Logger *logger, uint64_t number, Log_Record *out, char *buffer, size_t capacity) {
+    Log_Slot *slot = &logger->index[number % LOG_INDEX_SIZE];
+    if (slot->sequence.load(std::memory_order_acquire) != number + 1) return 0;
+    uint64_t offset = slot->offset.load(std::memory_order_relaxed);
+    uint32_t length = slot->length.load(std::memory_order_relaxed);
+    uint32_t kind   = slot->kind.load(std::memory_order_relaxed);
+    out->time_ns    = slot->time_ns.load(std::memory_order_relaxed);
+    out->generation = slot->generation.load(std::memory_order_relaxed);
+
+    if (length > capacity - 1) length = (uint32_t)(capacity - 1);
+    if (length > LOG_LINE_MAX - 1) length = LOG_LINE_MAX - 1; // a torn length, caught below.
+    memcpy(buffer, logger->arena + offset % LOG_ARENA_SIZE, length);
+    buffer[length] = 0;
+
+    // slot got taken over while we looked, or the bytes got claimed by a newer record.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot->sequence.load(std::memory_order_relaxed) != number + 1) return 0;
+    if (logger->bytes.load(std::memory_order_relaxed) - offset > LOG_ARENA_SIZE) return 0;
+
+    out->source   = (uint8_t)(kind & 0xff);
+    out->severity = (uint8_t)(kind >> 8);
+    out->text     = buffer;
+    out->length   = length;
+    return 1;
+}
+
+void watcher_log_va(Logger *logger, int32_t source, int32_t severity, uint32_t generation, const char *message, va_list list) {
+    char buffer[LOG_LINE_MAX];
+    int length = vsnprintf(buffer, sizeof(buffer), message, list);
+    if (length < 0) return;
+    if (length > LOG_LINE_MAX - 1) length = LOG_LINE_MAX - 1;
+
+    uint64_t number;
+    char *record = logger_claim(logger, (size_t)length, source, severity, generation, &number);
+    memcpy(record, buffer, (size_t)length + 1);
+    logger_publish(logger, number);
+
+    if (logger->print_to_stdout) {
+        printf("[LOG] %s\n", buffer);
+        fflush(stdout);
+    }
+}
+
 void watcher_log(Logger *logger, const char *message, ...) {
-    size_t new_buffer_index = logger->logs_end;
-    char *buf = logger->logs[new_buffer_index];
-    memset(buf, 0, LOG_BUFFER_LINE_SIZE);
+    va_list list;
+    va_start(list, message);
+    watcher_log_va(logger, LOG_SOURCE_WATCHER, LOG_INFO, 0, message, list);
+    va_end(list);
+}
 
+void watcher_log_ex(Logger *logger, int32_t source, int32_t severity, uint32_t generation, const char *message, ...) {
     va_list list;
     va_start(list, message);
-    vsnprintf(buf, LOG_BUFFER_LINE_SIZE-1, message, list);
-    buf[LOG_BUFFER_LINE_SIZE-1] = 0;
+    watcher_log_va(logger, source, severity, generation, message, list);
     va_end(list);
+}
+
+// Child output, which comes a lot faster than ours: nothing to format, and stdout gets flushed
+// by the output thread once per batch instead of once per line.
+void watcher_log_text(Logger *logger, int32_t source, uint32_t generation, const char *tag, const char *text, size_t length) {
+    size_t tag_length = strlen(tag);
+    if (tag_length > LOG_LINE_MAX - 1) tag_length = LOG_LINE_MAX - 1;
+    if (length > LOG_LINE_MAX - 1 - tag_length) length = LOG_LINE_MAX - 1 - tag_length;
+
+    uint64_t number;
+    char *record = logger_claim(logger, tag_length + length, source, LOG_INFO, generation, &number);
+    memcpy(record, tag, tag_length);
+    memcpy(record + tag_length, text, length);
+    record[tag_length + length] = 0;
+    logger_publish(logger, number);
+
+    if (logger->print_to_stdout) {
+        fputs("[LOG] ", stdout);
+        fwrite(record, 1, tag_length + length, stdout);
+        fputc('\n', stdout);
+    }
+}
+
+Debounce create_debounce(uint32_t quiet_ms, uint32_t max_delay_ms) {
+    Debounce debounce = {0};
+    debounce.quiet_ms     = quiet_ms;
+    debounce.max_delay_ms = (max_delay_ms < quiet_ms) ? quiet_ms : max_delay_ms;
+    return debounce;
+}
+
+void debounce_note_changes(Debounce *debounce, size_t changed_count, uint64_t now_ms) {
+    if (changed_count == 0) return;
+    if (!debounce->pending) {
+        debounce->pending         = 1;
+        debounce->first_change_ms = now_ms;
+        debounce->changed_total   = 0;
+    }
+    debounce->last_change_ms = now_ms;
+    debounce->changed_total += changed_count;
+}
+
+uint64_t debounce_deadline(Debounce *debounce) {
+    if (!debounce->pending) return 0;
+    uint64_t quiet_end = debounce->last_change_ms  + debounce->quiet_ms;
+    uint64_t latest    = debounce->first_change_ms + debounce->max_delay_ms;
+    return (quiet_end < latest) ? quiet_end : latest;
+}
+
+int32_t debounce_should_fire(Debounce *debounce, uint64_t now_ms) {
+    if (!debounce->pending || now_ms < debounce_deadline(debounce)) return 0;
+    debounce->pending = 0;
+    return 1;
+}
+
+void debounce_reset(Debounce *debounce) {
+    debounce->pending       = 0;
+    debounce->changed_total = 0;
+}
 
-    logger->logs_end = (logger->logs_end + 1) % LOG_BUFFER_BUCKET_SIZE;
-    if (logger->logs_end == logger->logs_begin) logger->logs_begin = (logger->logs_begin + 1) % LOG_BUFFER_BUCKET_SIZE;
+Backoff create_backoff(uint32_t base_ms, uint32_t max_ms, uint32_t max_restarts, uint32_t window_ms, uint32_t seed) {
+    Backoff backoff = {0};
+    backoff.base_ms      = base_ms;
+    backoff.max_ms       = (max_ms < base_ms) ? base_ms : max_ms;
+    // the exit max_restarts back has to still be in exits_ms next to the one just noted.
+    backoff.max_restarts = (max_restarts > BACKOFF_HISTORY - 1) ? BACKOFF_HISTORY - 1 : max_restarts;
+    backoff.window_ms    = window_ms;
+    backoff.random       = seed | 1; // xorshift never leaves 0.
+    return backoff;
 }
 
+uint64_t backoff_note_exit(Backoff *backoff, int32_t crashed, uint64_t runtime_ms, uint64_t now_ms) {
+    if (runtime_ms >= BACKOFF_HEALTHY_MS) backoff->crashes = 0;
+    if (!crashed) return 0;
+
+    backoff->exits_ms[backoff->exit_count++ % BACKOFF_HISTORY] = now_ms;
+    if (backoff->max_restarts > 0 && backoff->exit_count > backoff->max_restarts) {
+        uint64_t oldest = backoff->exits_ms[(backoff->exit_count - 1 - backoff->max_restarts) % BACKOFF_HISTORY];
+        if (now_ms - oldest < backoff->window_ms) {
+            backoff->gave_up = 1;
+            return 0;
+        }
+    }
+
+    uint32_t shift = (backoff->crashes < 16) ? backoff->crashes : 16;
+    uint64_t delay = (uint64_t)backoff->base_ms << shift;
+    if (delay > backoff->max_ms) delay = backoff->max_ms;
+    backoff->crashes++;
+
+    backoff->random ^= backoff->random << 13;
+    backoff->random ^= backoff->random >> 17;
+    backoff->random ^= backoff->random << 5;
+    // 75% .. 125%.
+    delay = delay * 3 / 4 + (delay / 2 + 1) * (backoff->random % 1024) / 1024;
+
+    backoff->next_start_ms = now_ms + delay;
+    return delay;
+}
+
+uint64_t backoff_deadline(Backoff *backoff) {
+    if (backoff->gave_up || backoff->crashes == 0) return 0;
+    return backoff->next_start_ms;
+}
+
+int32_t backoff_allows_start(Backoff *backoff, uint64_t now_ms) {
+    if (backoff->gave_up) return 0;
+    return backoff->crashes == 0 || now_ms >= backoff->next_start_ms;
+}
+
+// a change or a start by hand: whatever was broken may be fixed now.
+void backoff_reset(Backoff *backoff) {
+    backoff->crashes    = 0;
+    backoff->gave_up    = 0;
+    backoff->exit_count = 0;
+}
+
+// ====================================
+// GUI.
+#ifndef SUCCOTASH_HEADLESS
+
 char sdlk_to_microui_key(SDL_Keycode sym) {
     switch(sym) {
         case SDLK_LSHIFT:
@@ -142,11 +500,110 @@ void process_event(Succotash *succotash, mu_Context *ctx) {
     }
 }
 
+// ====================================
+// Log panel.
+// One line per row at a fixed height, so the rows in view follow from the scroll offset alone.
+// only those get laid out and drawn, everything else is one rect that makes room for the
+// scrollbar: a frame costs the same for 100 lines as for a million.
+
+// Makes the current panel row_count rows tall. the ones in view are [*out_first, *out_last).
+void log_rows_in_view(mu_Context *ctx, uint64_t row_count, int row_pitch, uint64_t *out_first, uint64_t *out_last) {
+    mu_Container *container = mu_get_current_container(ctx);
+    mu_layout_set_next(ctx, mu_rect(0, 0, 1, (int)(row_count * row_pitch)), 1);
+    mu_layout_next(ctx);
+
+    uint64_t first = (uint64_t)(container->scroll.y > 0 ? container->scroll.y : 0) / row_pitch;
+    uint64_t last  = first + container->body.h / row_pitch + 2;
+    *out_first = (first < row_count) ? first : row_count;
+    *out_last  = (last  < row_count) ? last  : row_count;
+}
+
+// Text goes out as it's stored, cut at the panel's edge instead of wrapped. time in its own column.
+void log_row(mu_Context *ctx, uint64_t row, int row_pitch, const char *time, int text_x, const char *text, size_t length, mu_Color color) {
+    mu_layout_set_next(ctx, mu_rect(0, (int)(row * row_pitch), 1, row_pitch), 1);
+    mu_Rect rect = mu_layout_next(ctx);
+    mu_draw_text(ctx, ctx->style->font, time, -1, mu_vec2(rect.x, rect.y), mu_color(140, 140, 140, 255));
+    mu_draw_text(ctx, ctx->style->font, text, (int)length, mu_vec2(rect.x + text_x, rect.y), color);
+}
+
+mu_Color log_row_color(mu_Context *ctx, Log_Row_Header *header) {
+    if (!header)                                return ctx->style->colors[MU_COLOR_TEXT];
+    if (header->severity == LOG_ERROR)          return mu_color(240, 110, 100, 255);
+    if (header->severity == LOG_WARNING)        return mu_color(230, 200,  90, 255);
+    if (header->source   == LOG_SOURCE_STDERR)  return mu_color(230, 170, 130, 255);
+    return ctx->style->colors[MU_COLOR_TEXT];
+}
+
+// Seconds since we started, formatted once per record for as long as it stays in view.
+#define LOG_TIME_CACHE 256 // more than ever fit in the panel.
+
+const char *log_row_time(Succotash *succotash, uint64_t number, Log_Row_Header *header) {
+    static struct { uint64_t number; char text[24]; } cache[LOG_TIME_CACHE];
+    if (!header || header->time_ns == 0) return "";
+    if (cache[number % LOG_TIME_CACHE].number != number + 1) {
+        uint64_t since = header->time_ns - succotash->logger.started_ns;
+        snprintf(cache[number % LOG_TIME_CACHE].text, sizeof(cache[0].text), "%6" PRIu64 ".%03u",
+                 (uint64_t)(since / 1000000000llu), (uint32_t)(since / 1000000 % 1000));
+        cache[number % LOG_TIME_CACHE].number = number + 1;
+    }
+    return cache[number % LOG_TIME_CACHE].text;
+}
+
+// Record numbers from begin on that pass the filter, from scratch. new ones get added as they come.
+void rebuild_filtered_rows(Succotash *succotash, uint64_t begin) {
+    if (!succotash->filtered_rows) {
+        succotash->filtered_rows = (uint64_t *)malloc(LOG_PANEL_ROWS * sizeof(uint64_t));
+        assert(succotash->filtered_rows && "malloc failed");
+    }
+    succotash->filtered_start = 0;
+    succotash->filtered_count = 0;
+    for (uint64_t number = begin; number < succotash->search_next; ++number) {
+        if (!succotash->show_source[succotash->log_headers[number % LOG_PANEL_ROWS].source]) continue;
+        succotash->filtered_rows[succotash->filtered_count++] = number;
+    }
+}
+
+void add_filtered_row(Succotash *succotash, uint64_t number) {
+    if (succotash->filtered_count == LOG_PANEL_ROWS) {
+        succotash->filtered_start = (succotash->filtered_start + 1) % LOG_PANEL_ROWS;
+        succotash->filtered_count--;
+    }
+    succotash->filtered_rows[(succotash->filtered_start + succotash->filtered_count++) % LOG_PANEL_ROWS] = number;
+}
+
+// New records the feeder got to since last frame, for the filter and the search hits.
+void catch_up_log_panel(Succotash *succotash) {
+    if (succotash->search_seen == succotash->search_next) return;
+    if (succotash->search_next - succotash->search_seen > LOG_PANEL_ROWS) succotash->search_seen = succotash->search_next - LOG_PANEL_ROWS;
+    for (; succotash->search_seen < succotash->search_next; succotash->search_seen++) {
+        uint64_t number = succotash->search_seen;
+        if (succotash->filtering && succotash->show_source[succotash->log_headers[number % LOG_PANEL_ROWS].source]) add_filtered_row(succotash, number);
+    }
+    succotash->search_dirty = 1;
+}
+
+// Header of a record the panel still has, NULL for anything older.
+Log_Row_Header *log_row_header(Succotash *succotash, uint64_t number) {
+    if (!succotash->log_headers || number >= succotash->search_next) return NULL;
+    if (succotash->search_next - number > LOG_PANEL_ROWS) return NULL;
+    return &succotash->log_headers[number % LOG_PANEL_ROWS];
+}
+
+// Search_Keep for the source filter. the panel only has headers of the newest records, older hits stay in.
+int32_t search_hit_shown(void *context, uint64_t number) {
+    Succotash *succotash = (Succotash *)context;
+    Log_Row_Header *header = log_row_header(succotash, number);
+    return !header || succotash->show_source[header->source];
+}
+
 // TODO: cleanup
 void process_gui(Succotash *succotash, mu_Context *ctx) {
     /* process frame */
     mu_begin(ctx);
-    int32_t process_is_running = is_process_running(&succotash->handle); // just for display!
+    int32_t process_is_running = 0; // just for display!
+    for (int32_t i = 0; i < succotash->binding_count; ++i) {
+        process_is_running |= is_process_running(&succotash->bindings[i].handle);
+    }
 
     if (mu_begin_window_ex(ctx, "Base_Window", mu_rect(0, 0, 350, 300), MU_OPT_NOTITLE | MU_OPT_NORESIZE | MU_OPT_NOCLOSE)) {
         int row[] = { 80, 80, 80 };
@@ -169,6 +626,7 @@ void process_gui(Succotash *succotash, mu_Context *ctx) {
         if(mu_button_ex(ctx, "Directory", 0, option)) {
             if(select_new_folder(succotash->directory, sizeof(succotash->directory))) {
                 succotash->folder_is_invalid = 0;
+                succotash->directory_changed = 1;
             } else {
                 watcher_log(&succotash->logger, "Failed to choose a file.");
             }
@@ -176,6 +634,7 @@ void process_gui(Succotash *succotash, mu_Context *ctx) {
 
         if(mu_textbox_ex(ctx, succotash->directory, sizeof(succotash->directory), option) & MU_RES_SUBMIT) {
             succotash->folder_is_invalid = 0;
+            succotash->directory_changed = 1;
         }
 
         if(mu_button_ex(ctx, "Command", 0, option)) {
@@ -183,26 +642,124 @@ void process_gui(Succotash *succotash, mu_Context *ctx) {
         }
         mu_textbox_ex(ctx, succotash->command, sizeof(succotash->command), option);
 
+        mu_label(ctx, "Ignore");
+        if(mu_textbox_ex(ctx, succotash->ignore, sizeof(succotash->ignore), option) & MU_RES_SUBMIT) {
+            succotash->directory_changed = 1;
+        }
+
+        int full_row_checkbox[] = { -1 };
+        mu_layout_row(ctx, 1, full_row_checkbox, 0);
+        if (mu_checkbox(ctx, "Restart only when file content changes", &succotash->hash_contents) & MU_RES_CHANGE) {
+            if (!snapshot_set_content_hashing(&succotash->snapshot, succotash->hash_contents)) {
+                watcher_log(&succotash->logger, "content hashing isn't supported on this platform");
+                succotash->hash_contents = 0;
+            }
+        }
+
         // ============ Status Window ============ 
+        int search_row[] = { 80, -1 };
+        mu_layout_row(ctx, 2, search_row, 0);
+        mu_label(ctx, "Search");
+        int32_t query_changed = 0;
+        if (mu_textbox(ctx, succotash->search_query, sizeof(succotash->search_query)) & MU_RES_CHANGE) {
+            succotash->search_dirty = 1;
+            query_changed = 1;
+        }
+
+        int source_row[] = { 65, 85, 60, 60, -1 };
+        mu_layout_row(ctx, 5, source_row, 0);
+        const char *source_names[LOG_SOURCE_COUNT] = { "Watcher", "Supervisor", "stdout", "stderr", "Unknown" };
+        int32_t filter_changed = 0;
+        for (int32_t i = 0; i < LOG_SOURCE_COUNT; ++i) {
+            filter_changed |= mu_checkbox(ctx, source_names[i], &succotash->show_source[i]) & MU_RES_CHANGE;
+        }
+
+        uint64_t end   = logger_record_count(&succotash->logger);
+        uint64_t begin = (end > LOG_PANEL_ROWS) ? end - LOG_PANEL_ROWS : 0;
+        // further back than the ring goes, the search index still has the text.
+        uint64_t oldest = succotash->search ? search_index_first(succotash->search) : (end > LOG_INDEX_SIZE ? end - LOG_INDEX_SIZE : 0);
+        if (begin < oldest) begin = oldest;
+
+        // with every source shown none of this happens, the rows are just the record numbers.
+        if (filter_changed) {
+            succotash->filtering = 0;
+            for (int32_t i = 0; i < LOG_SOURCE_COUNT; ++i) succotash->filtering |= !succotash->show_source[i];
+            succotash->search_dirty = 1;
+            if (succotash->filtering && succotash->log_headers) rebuild_filtered_rows(succotash, begin);
+        }
+        int32_t filtering = succotash->filtering && succotash->log_headers;
+        while (filtering && succotash->filtered_count > 0 && succotash->filtered_rows[succotash->filtered_start] < begin) {
+            succotash->filtered_start = (succotash->filtered_start + 1) % LOG_PANEL_ROWS;
+            succotash->filtered_count--;
+        }
+
+        int32_t searching = succotash->search && succotash->search_query[0];
+        if (searching && succotash->search_dirty) {
+            succotash->search_dirty = 0;
+            succotash->search_hit_count = search_index_find(succotash->search, succotash->search_query,
+                                                            filtering ? search_hit_shown : NULL, succotash,
+                                                            succotash->search_hits, SEARCH_HITS_MAX);
+        }
+
         int full_row[] = { -1 };
         mu_layout_row(ctx, 1, full_row, -1);
         mu_begin_panel(ctx, "Logs");
-        mu_layout_row(ctx, 1, full_row, r_get_text_height());
-        size_t begin = succotash->logger.logs_begin;
-        size_t end   = succotash->logger.logs_end;
+        int row_pitch = r_get_text_height() + ctx->style->spacing;
+        int text_x    = ctx->text_width(ctx->style->font, "000000.000  ", -1);
+        uint64_t newest = end;
+        if (searching)      newest = succotash->search_hit_count ? succotash->search_hits[0].number + 1 : 0;
+        else if (filtering) newest = succotash->filtered_count ? succotash->filtered_rows[(succotash->filtered_start + succotash->filtered_count - 1) % LOG_PANEL_ROWS] + 1 : 0;
 
-        static size_t static_end = 0;
-        if (succotash->logger.logs_end != static_end) {
-            static_end = succotash->logger.logs_end;
-            mu_Container *container = mu_get_current_container(ctx);
-            container->scroll.y = container->content_size.y;
+        mu_Container *container = mu_get_current_container(ctx);
+        int32_t at_bottom = container->scroll.y + container->body.h >= container->content_size.y - row_pitch;
+
+        uint64_t row_count = searching ? succotash->search_hit_count : filtering ? succotash->filtered_count : end - begin;
+        uint64_t first_row = 0, last_row = 0;
+        log_rows_in_view(ctx, row_count, row_pitch, &first_row, &last_row);
+        for (uint64_t row = first_row; row < last_row; ++row) {
+            uint64_t number = searching ? succotash->search_hits[row_count - 1 - row].number :
+                              filtering ? succotash->filtered_rows[(succotash->filtered_start + row) % LOG_PANEL_ROWS] :
+                              begin + row;
+            Log_Row_Header *header = log_row_header(succotash, number);
+            Log_Row_Header ring_header = {0};
+            uint32_t length = 0;
+            const char *text = NULL;
+            char record_text[LOG_LINE_MAX];
+            if (searching) {
+                // hits are newest first, the panel has the newest at the bottom like the logs.
+                text   = succotash->search_hits[row_count - 1 - row].text;
+                length = (uint32_t)strlen(text);
+            } else if (header) {
+                text = search_index_record(succotash->search, number, &length);
+            } else {
+                // copied out of the arena. one that's still being written shows up next frame.
+                Log_Record record;
+                if (logger_read(&succotash->logger, number, &record, record_text, sizeof(record_text))) {
+                    text   = record.text;
+                    length = record.length;
+                    ring_header.time_ns    = record.time_ns;
+                    ring_header.generation = record.generation;
+                    ring_header.source     = record.source;
+                    ring_header.severity   = record.severity;
+                    header = &ring_header;
+                }
+            }
+            if (text) log_row(ctx, row, row_pitch, log_row_time(succotash, number, header), text_x, text, length, log_row_color(ctx, header));
         }
 
-        for (size_t i = begin; i != end; i = (i + 1) % LOG_BUFFER_BUCKET_SIZE) {
-            char buffer[LOG_BUFFER_LINE_SIZE + 256] = {0};
-            snprintf(buffer, LOG_BUFFER_LINE_SIZE + 256, "[LOG] %s", succotash->logger.logs[i]);
-            mu_text(ctx, buffer);
+        // new lines scroll into view if the bottom was in view already, a new query or filter starts at the bottom.
+        // otherwise what's in view stays put while the oldest lines go. takes effect next frame, this
+        // one got laid out with the old offset.
+        static uint64_t static_newest = 0;
+        static uint64_t static_begin  = 0;
+        if (query_changed || filter_changed || (newest != static_newest && at_bottom)) {
+            container->scroll.y = (int)(row_count * row_pitch);
+        } else if (!searching && !filtering && begin > static_begin) {
+            uint64_t gone = (begin - static_begin) * row_pitch;
+            container->scroll.y = (gone < (uint64_t)container->scroll.y) ? container->scroll.y - (int)gone : 0;
         }
+        static_newest = newest;
+        static_begin  = begin;
 
         mu_end_panel(ctx);
         mu_end_window(ctx);
@@ -211,6 +768,18 @@ void process_gui(Succotash *succotash, mu_Context *ctx) {
     mu_end(ctx);
 }
 
+// fd the window system sends our input over. -1 if SDL doesn't tell (wayland, windows).
+int window_event_fd() {
+#if !defined(_WIN32) && defined(SDL_VIDEO_DRIVER_X11)
+    SDL_SysWMinfo info;
+    SDL_VERSION(&info.version);
+    if (SDL_GetWindowWMInfo(r_get_window(), &info) && info.subsystem == SDL_SYSWM_X11) {
+        return ConnectionNumber(info.info.x11.display);
+    }
+#endif
+    return -1;
+}
+
 void render_gui(Succotash *succotash, mu_Context *ctx) {
     r_clear(mu_color(0, 0, 0, 255));
     mu_Command *cmd = NULL;
@@ -225,97 +794,1396 @@ void render_gui(Succotash *succotash, mu_Context *ctx) {
     r_present();
 }
 
-int main(int argc, char **argv) {
+#endif // SUCCOTASH_HEADLESS
+
+// ====================================
+// Watching and restarting.
+
+int32_t is_path_separator(char c) {
+    return c == '/' || c == '\\';
+}
+
+// Cut watch_root back to the closest directory that has directory in it as well.
+void widen_watch_root(char *root, const char *directory) {
+    size_t i = 0;
+    while (root[i] && root[i] == directory[i]) i++;
+    if (root[i] == 0 && (directory[i] == 0 || is_path_separator(directory[i]))) return; // root contains it already.
+    if (directory[i] == 0 && is_path_separator(root[i])) {
+        root[i] = 0; // directory contains root.
+        return;
+    }
+
+    // mismatch inside a name, back up to the separator before it. "/" stays "/".
+    while (i > 0 && !is_path_separator(root[i - 1])) i--;
+    root[(i > 1) ? i - 1 : i] = 0;
+}
+
+// length of the first `components` components of path.
+size_t path_prefix_length(const char *path, int32_t components) {
+    size_t length = 0;
+    int32_t seen = 0;
+    while (path[length] && !(is_path_separator(path[length]) && ++seen == components)) length++;
+    return length;
+}
+
+// Everything in the watch root that's no binding's business gets ignored, so scanners and the
+// watch never even go there. gitignore's way of keeping just some subtrees: ignore a level
+// ("/*", "/a/*"), then bring back the one directory on the way down ("!/a/", "!/a/b/").
+void add_binding_scope(Succotash *succotash) {
+    const char *relative[BINDING_MAX];
+    int32_t depth[BINDING_MAX];
+    int32_t count = 0, max_depth = 0;
+
+    size_t root_length = strlen(succotash->watch_root);
+    for (int32_t i = 0; i < succotash->binding_count; ++i) {
+        const char *path = succotash->bindings[i].directory + root_length;
+        while (is_path_separator(*path)) path++;
+        if (*path == 0) return; // one of them wants the whole root.
+
+        relative[count] = path;
+        depth[count] = 1;
+        for (const char *c = path; *c; ++c) depth[count] += is_path_separator(*c);
+        if (depth[count] > max_depth) max_depth = depth[count];
+        count++;
+    }
+
+    char pattern[1024];
+    for (int32_t d = 0; d < max_depth; ++d) {
+        for (int32_t pass = 0; pass < 2; ++pass) {
+            // pass 0 ignores level d below each kept prefix, pass 1 brings back the next directory down.
+            int32_t components = d + pass;
+            for (int32_t i = 0; i < count; ++i) {
+                if (depth[i] <= d) continue;
+                size_t length = components ? path_prefix_length(relative[i], components) : 0;
+
+                int32_t duplicate = 0;
+                for (int32_t j = 0; j < i && !duplicate; ++j) {
+                    if (depth[j] <= d) continue;
+                    size_t other = components ? path_prefix_length(relative[j], components) : 0;
+                    duplicate = (other == length && strncmp(relative[i], relative[j], length) == 0);
+                }
+                if (duplicate) continue;
+
+                if (pass == 0) snprintf(pattern, sizeof(pattern), length ? "/%.*s/*" : "/*", (int)length, relative[i]);
+                else           snprintf(pattern, sizeof(pattern), "!/%.*s/", (int)length, relative[i]);
+                ignore_rules_add(&succotash->ignore_rules, pattern);
+            }
+        }
+    }
+}
+
+// (Re-)start watching current directory.
+void watch_directory(Succotash *succotash) {
+    if (succotash->has_primary) {
+        Binding *primary = &succotash->bindings[0];
+        snprintf(primary->directory, sizeof(primary->directory), "%s", succotash->directory);
+        resolve_directory(primary->directory, sizeof(primary->directory));
+    }
+
+    snprintf(succotash->watch_root, sizeof(succotash->watch_root), "%s", succotash->bindings[0].directory);
+    for (int32_t i = 1; i < succotash->binding_count; ++i) {
+        widen_watch_root(succotash->watch_root, succotash->bindings[i].directory);
+    }
+    for (int32_t i = 0; i < succotash->binding_count; ++i) {
+        Binding *binding = &succotash->bindings[i];
+        binding->directory_length = strlen(binding->directory);
+        binding->covers_root      = (strcmp(binding->directory, succotash->watch_root) == 0);
+    }
+    if (succotash->binding_count > 1) {
+        watcher_log(&succotash->logger, "Watching %s for %d commands", succotash->watch_root, succotash->binding_count);
+    }
+
+    destroy_ignore_rules(&succotash->ignore_rules);
+    // scope first, the user's own patterns (node_modules/ etc.) still apply inside it.
+    add_binding_scope(succotash);
+    ignore_rules_add_list(&succotash->ignore_rules, succotash->ignore, " \t,");
+
+    // the root's .gitignore, then each binding's own, which only reaches below its directory.
+    size_t root_length = strlen(succotash->watch_root);
+    for (int32_t i = -1; i < succotash->binding_count; ++i) {
+        const char *directory = (i == -1) ? succotash->watch_root : succotash->bindings[i].directory;
+        if (i >= 0 && succotash->bindings[i].covers_root) continue;
+
+        int32_t seen = 0;
+        for (int32_t j = 0; j < i && !seen; ++j) seen = (strcmp(succotash->bindings[j].directory, directory) == 0);
+        if (seen) continue;
+
+        const char *base = directory + root_length;
+        while (is_path_separator(*base)) base++;
+
+        char gitignore[1024] = {0};
+        snprintf(gitignore, sizeof(gitignore)-1, "%s%s.gitignore", directory, is_path_separator(directory[strlen(directory) - 1]) ? "" : "/");
+        if (ignore_rules_load_file(&succotash->ignore_rules, gitignore, base)) {
+            watcher_log(&succotash->logger, "Using ignore rules from %s", gitignore);
+        }
+    }
+    watch_set_ignore_rules(&succotash->watch, &succotash->ignore_rules);
+    snapshot_set_ignore_rules(&succotash->snapshot, &succotash->ignore_rules);
+
+    start_watching(&succotash->watch, &succotash->logger, succotash->watch_root);
+    succotash->folder_is_invalid = !snapshot_build(&succotash->snapshot, &succotash->logger, succotash->watch_root);
+}
+
+// Bring the snapshot up to date with whatever the watcher saw since last frame.
+// returns amount of changed entries, those are left in snapshot.changed.
+size_t refresh_snapshot(Succotash *succotash) {
+    Watch_Handle  *watch    = &succotash->watch;
+    File_Snapshot *snapshot = &succotash->snapshot;
+
+    const char *dirty[256];
+    size_t dirty_count = take_watch_dirty_paths(watch, dirty, 256);
+
+    if (watch->root_is_gone) {
+        succotash->folder_is_invalid = 1;
+        return 0;
+    }
+
+    if (watch->fallback_to_scan || watch->needs_full_refresh) {
+        watch->needs_full_refresh = 0;
+        if (!snapshot_refresh(snapshot, &succotash->logger)) {
+            succotash->folder_is_invalid = 1;
+            return 0;
+        }
+    } else if (dirty_count > 0) {
+        snapshot_refresh_directories(snapshot, &succotash->logger, dirty, dirty_count);
+    } else {
+        return 0;
+    }
+
+    if (snapshot->unchanged_content_count > 0 && snapshot->changed_count == 0) {
+        watcher_log(&succotash->logger, "%zu file(s) touched without content changes, not restarting.", snapshot->unchanged_content_count);
+    }
+    return snapshot->changed_count;
+}
+
+int32_t binding_has_path(Binding *binding, const char *path) {
+    return strncmp(path, binding->directory, binding->directory_length) == 0 &&
+           (path[binding->directory_length] == 0 || is_path_separator(path[binding->directory_length]));
+}
+
+// Hand this round's changes to the bindings they're in. paths only get put together if some
+// binding doesn't cover the whole root.
+void route_changes(Succotash *succotash, size_t changed_files) {
+    File_Snapshot *snapshot = &succotash->snapshot;
+    int32_t need_paths = 0;
+    for (int32_t i = 0; i < succotash->binding_count; ++i) {
+        Binding *binding = &succotash->bindings[i];
+        binding->changed_count = binding->covers_root ? changed_files : 0;
+        need_paths |= !binding->covers_root;
+    }
+    if (!need_paths || changed_files == 0) return;
+
+    for (size_t c = 0; c < snapshot->changed_count; ++c) {
+        char path[1024];
+        if (!snapshot_path(snapshot, snapshot->changed[c], path, sizeof(path))) continue;
+
+        for (int32_t i = 0; i < succotash->binding_count; ++i) {
+            Binding *binding = &succotash->bindings[i];
+            if (!binding->covers_root && binding_has_path(binding, path)) binding->changed_count++;
+        }
+    }
+}
+
+// How long the main loop may sleep before something it knows about is due. -1 = until woken up.
+int32_t next_wake_timeout(Succotash *succotash, int32_t has_window_fd) {
+    int64_t timeout = -1;
+    uint64_t now_ms = platform_monotonic_ms();
+
+    for (int32_t b = 0; b < succotash->binding_count; ++b) {
+        Binding *binding = &succotash->bindings[b];
+        uint64_t deadlines[] = {
+            // a standby on its way up holds the next restart back, its readiness wakes us.
+            binding->standby_pending ? 0 : debounce_deadline(&binding->debounce),
+            process_stop_deadline(&binding->handle),
+            binding->standby_pending ? binding->standby_started_ms + succotash->ready_timeout_ms : 0,
+            succotash->should_process_running ? backoff_deadline(&binding->backoff) : 0,
+        };
+        for (size_t i = 0; i < sizeof(deadlines) / sizeof(deadlines[0]); ++i) {
+            if (!deadlines[i]) continue;
+            int64_t until = (deadlines[i] > now_ms) ? (int64_t)(deadlines[i] - now_ms) : 0;
+            if (timeout == -1 || timeout > until) timeout = until;
+        }
+        for (int32_t i = 0; i < RETIRING_MAX; ++i) {
+            uint64_t kill_deadline = process_stop_deadline(&binding->retiring[i]);
+            if (!kill_deadline) continue;
+            int64_t until = (kill_deadline > now_ms) ? (int64_t)(kill_deadline - now_ms) : 0;
+            if (timeout == -1 || timeout > until) timeout = until;
+        }
+        for (int32_t i = 0; i < binding->pipeline.stage_count; ++i) {
+            uint64_t kill_deadline = process_stop_deadline(&binding->pipeline.handles[i]);
+            if (!kill_deadline) continue;
+            int64_t until = (kill_deadline > now_ms) ? (int64_t)(kill_deadline - now_ms) : 0;
+            if (timeout == -1 || timeout > until) timeout = until;
+        }
+    }
+    if (succotash->watch.fallback_to_scan && succotash->should_process_running) {
+        if (timeout == -1 || timeout > FALLBACK_SCAN_MS) timeout = FALLBACK_SCAN_MS;
+    }
+
+#ifndef SUCCOTASH_HEADLESS
+    if (!succotash->headless) {
+        if (!has_window_fd) {
+            if (timeout == -1 || timeout > WINDOW_POLL_MS) timeout = WINDOW_POLL_MS;
+        }
+
+        // xlib may have read events off the socket already (while swapping buffers etc.), the fd won't tell about those.
+        SDL_PumpEvents();
+        if (SDL_HasEvents(SDL_FIRSTEVENT, SDL_LASTEVENT)) timeout = 0;
+    }
+#endif
+    return (int32_t)timeout;
+}
+
+// What we do with a binding's process, with the command in front once there's more than one.
+void binding_log(Succotash *succotash, Binding *binding, int32_t severity, const char *message, ...) {
+    char buffer[LOG_LINE_MAX];
+    va_list list;
+    va_start(list, message);
+    vsnprintf(buffer, sizeof(buffer), message, list);
+    va_end(list);
+
+    Logger *logger = &succotash->logger;
+    if (succotash->binding_count > 1) watcher_log_ex(logger, LOG_SOURCE_SUPERVISOR, severity, binding->generation, "[%s] %s", binding->command, buffer);
+    else                              watcher_log_ex(logger, LOG_SOURCE_SUPERVISOR, severity, binding->generation, "%s", buffer);
+}
+
+// The first few of this round's changes that got routed to binding.
+void log_changed_files(Succotash *succotash, Binding *binding) {
+    File_Snapshot *snapshot = &succotash->snapshot;
+    size_t shown = 0;
+
+    for (size_t i = 0; i < snapshot->changed_count && shown < 5; ++i) {
+        char path[1024] = {0};
+        if (!snapshot_path(snapshot, snapshot->changed[i], path, sizeof(path))) continue;
+        if (!binding->covers_root && !binding_has_path(binding, path)) continue;
+        binding_log(succotash, binding, LOG_INFO, "  changed: %s", path);
+        shown++;
+    }
+    if (binding->changed_count > shown) {
+        binding_log(succotash, binding, LOG_INFO, "  ... and %zu more", binding->changed_count - shown);
+    }
+}
+
+// Every start is a new generation, whatever comes out of it carries the number.
+int32_t start_binding_process(Succotash *succotash, Binding *binding, Process_Handle *handle) {
+    binding->generation++;
+    process_set_generation(handle, (int32_t)(binding - succotash->bindings), binding->generation);
+    return start_process(binding->command, handle, &succotash->logger);
+}
+
+void log_process_exit(Succotash *succotash, Binding *binding, Process_Handle *handle) {
+    Process_Exit *exit = &handle->last_exit;
+    int32_t severity = (exit->stopped || (!exit->unknown && !exit->signal && exit->exit_code == 0)) ? LOG_INFO : LOG_WARNING;
+    if (exit->unknown) {
+        binding_log(succotash, binding, severity, "process %d is gone after %" PRIu64 " ms, how it ended is unknown", exit->pid, exit->runtime_ms);
+    } else if (exit->signal) {
+        binding_log(succotash, binding, severity, "process %d killed by signal %d after %" PRIu64 " ms", exit->pid, exit->signal, exit->runtime_ms);
+    } else {
+        binding_log(succotash, binding, severity, "process %d exited with code %d after %" PRIu64 " ms", exit->pid, exit->exit_code, exit->runtime_ms);
+    }
+}
+
+// FNV-1a.
+uint32_t text_hash(const char *text) {
+    uint32_t hash = 2166136261u;
+    for (; *text; ++text) hash = (hash ^ (uint8_t)*text) * 16777619u;
+    return hash;
+}
+
+Process_Handle create_child_handle(Succotash *succotash, Binding *binding) {
+    Process_Handle handle = create_process_handle();
+    process_set_spawn_method(&handle, succotash->spawn_method);
+    process_set_stop_signal(&handle, succotash->stop_signal, succotash->stop_timeout_ms);
+    if (succotash->binding_count > 1) {
+        // a long command gets cut, a hash of all of it keeps two that start the same apart (log files too).
+        char tag[64];
+        if (strlen(binding->command) > 60) snprintf(tag, sizeof(tag), "[%.51s~%08x] ", binding->command, text_hash(binding->command));
+        else                               snprintf(tag, sizeof(tag), "[%s] ", binding->command);
+        process_set_output_reader(&handle, succotash->output, tag);
+    } else {
+        process_set_output_reader(&handle, succotash->output, "");
+    }
+    // a socket can only have one owner that makes sense, that's the first binding.
+    if (binding == &succotash->bindings[0]) {
+        process_set_listen_fds(&handle, succotash->listen_fds, succotash->listen_count);
+    }
+    return handle;
+}
+
+// ====================================
+// Warm standby.
+//
+// The replacement starts while the old one keeps serving. once it writes to SUCCOTASH_READY_FD it
+// becomes the handle and the old one gets stopped in the background (retiring). if it never gets
+// there the old one just stays.
+
+// *slot gets replacement, whatever was in there gets stopped without waiting for it.
+void retire_process(Succotash *succotash, Binding *binding, Process_Handle *slot, Process_Handle replacement) {
+    int32_t free_slot = -1;
+    for (int32_t i = 0; i < RETIRING_MAX && free_slot == -1; ++i) {
+        int32_t r = (binding->retiring_next + i) % RETIRING_MAX;
+        if (!binding->retiring_alive[r] || !is_process_running(&binding->retiring[r])) {
+            if (binding->retiring_alive[r]) log_process_exit(succotash, binding, &binding->retiring[r]);
+            binding->retiring_alive[r] = 0;
+            free_slot = r;
+        }
+    }
+    if (free_slot == -1) {
+        // switch overs coming faster than stop_timeout_ms. the oldest one goes with SIGKILL right
+        // away instead of waiting out its timeout, so the wait below is only for it to be reaped.
+        free_slot = binding->retiring_next;
+        binding_log(succotash, binding, LOG_WARNING, "%d replaced processes still stopping, killing the oldest", RETIRING_MAX);
+        update_process_stop(&binding->retiring[free_slot], UINT64_MAX);
+        terminate_process(&binding->retiring[free_slot]);
+        log_process_exit(succotash, binding, &binding->retiring[free_slot]);
+        binding->retiring_alive[free_slot] = 0;
+    }
+
+    binding->retiring[free_slot] = *slot;
+    *slot = replacement;
+    binding->retiring_alive[free_slot] = is_process_running(&binding->retiring[free_slot]);
+    if (binding->retiring_alive[free_slot]) {
+        request_process_stop(&binding->retiring[free_slot]);
+        binding->retiring_next = (free_slot + 1) % RETIRING_MAX;
+    }
+}
+
+void start_standby(Succotash *succotash, Binding *binding) {
+    process_set_readiness_gate(&binding->standby, 1);
+    if (!start_binding_process(succotash, binding, &binding->standby)) {
+        binding_log(succotash, binding, LOG_WARNING, "couldn't start a replacement, restarting the old way");
+        request_process_stop(&binding->handle);
+        return;
+    }
+
+    binding->standby_pending    = 1;
+    binding->standby_started_ms = platform_monotonic_ms();
+    event_loop_watch_fd(&succotash->loop, process_event_fd(&binding->standby), WAKE_CHILD);
+    event_loop_watch_fd(&succotash->loop, process_ready_fd(&binding->standby), WAKE_READY);
+    binding_log(succotash, binding, LOG_INFO, "waiting for replacement to get ready (up to %u ms)", succotash->ready_timeout_ms);
+}
+
+void cancel_standby(Succotash *succotash, Binding *binding) {
+    retire_process(succotash, binding, &binding->standby, create_child_handle(succotash, binding));
+    binding->standby_pending = 0;
+}
+
+void update_standby(Succotash *succotash, Binding *binding, uint64_t now_ms) {
+    int32_t ready = process_check_ready(&binding->standby);
+    if (ready == 1) {
+        binding_log(succotash, binding, LOG_INFO, "replacement ready after %" PRIu64 " ms, switching over", now_ms - binding->standby_started_ms);
+        retire_process(succotash, binding, &binding->handle, binding->standby);
+        binding->standby           = create_child_handle(succotash, binding);
+        binding->standby_pending   = 0;
+        binding->process_was_alive = 1;
+        return;
+    }
+
+    if (ready == -1 || !is_process_running(&binding->standby)) {
+        if (!is_process_running(&binding->standby)) log_process_exit(succotash, binding, &binding->standby);
+        binding_log(succotash, binding, LOG_WARNING, "replacement never got ready, keeping the old process");
+        cancel_standby(succotash, binding);
+    } else if (now_ms >= binding->standby_started_ms + succotash->ready_timeout_ms) {
+        binding_log(succotash, binding, LOG_WARNING, "replacement not ready after %u ms, keeping the old process", succotash->ready_timeout_ms);
+        cancel_standby(succotash, binding);
+    }
+}
+
+// ====================================
+// Pipeline.
+//
+// On a change the stages run first, while the old process keeps going: a stage starts once
+// everything it's after has passed, at most stage_jobs of them at a time. when all of them pass
+// the process gets restarted as usual. the first one to fail stops the others and the process
+// stays as it is. a change while they run starts them over.
+
+// Stops whatever stages are running, the ones that didn't get to start won't.
+void stop_stages(Pipeline *pipeline) {
+    for (int32_t i = 0; i < pipeline->stage_count; ++i) {
+        if (pipeline->stage_state[i] == STAGE_RUNNING) request_process_stop(&pipeline->handles[i]);
+        if (pipeline->stage_state[i] == STAGE_WAITING) pipeline->stage_state[i] = STAGE_CANCELLED;
+    }
+}
+
+// run_again: a change came in, go once the stages in flight are gone. otherwise (stopped from the
+// GUI) a run that didn't finish has to be redone before the next start.
+void pipeline_cancel(Succotash *succotash, Binding *binding, int32_t run_again) {
+    Pipeline *pipeline = &binding->pipeline;
+    if (pipeline->stage_count == 0) return;
+
+    if (pipeline->status == PIPELINE_RUNNING) {
+        binding_log(succotash, binding, LOG_INFO, "cancelling the pipeline");
+        stop_stages(pipeline);
+        pipeline->status = PIPELINE_NEEDED;
+    }
+    if (run_again) pipeline->status = PIPELINE_NEEDED;
+}
+
+// Stages that finished since last round. same as reap_binding, this goes on whether we're stopped or not.
+void reap_stages(Succotash *succotash, Binding *binding, uint64_t now_ms) {
+    Pipeline *pipeline = &binding->pipeline;
+    pipeline->cancelling = 0;
+
+    for (int32_t i = 0; i < pipeline->stage_count; ++i) {
+        if (pipeline->stage_state[i] != STAGE_RUNNING) continue;
+
+        Process_Handle *handle = &pipeline->handles[i];
+        update_process_stop(handle, now_ms);
+        if (is_process_running(handle)) {
+            pipeline->cancelling |= process_is_stopping(handle);
+            continue;
+        }
+
+        Process_Exit *exit = &handle->last_exit;
+        Stage *stage = &pipeline->stages[i];
+        if (exit->stopped) {
+            pipeline->stage_state[i] = STAGE_CANCELLED;
+        } else if (!exit->unknown && exit->exit_code == 0) {
+            pipeline->stage_state[i] = STAGE_PASSED;
+            binding_log(succotash, binding, LOG_INFO, "stage %s passed after %" PRIu64 " ms", stage->name, exit->runtime_ms);
+        } else {
+            pipeline->stage_state[i] = STAGE_FAILED;
+            if (exit->unknown)     binding_log(succotash, binding, LOG_WARNING, "stage %s is gone, how it ended is unknown", stage->name);
+            else if (exit->signal) binding_log(succotash, binding, LOG_WARNING, "stage %s killed by signal %d", stage->name, exit->signal);
+            else                   binding_log(succotash, binding, LOG_WARNING, "stage %s failed with code %d", stage->name, exit->exit_code);
+
+            // fail fast, nothing after this is going to be used anyway.
+            if (pipeline->status == PIPELINE_RUNNING) {
+                binding_log(succotash, binding, LOG_WARNING, "pipeline failed, keeping the running process as it is");
+                stop_stages(pipeline);
+                pipeline->status = PIPELINE_FAILED;
+            }
+        }
+    }
+
+    for (int32_t i = 0; i < pipeline->stage_count; ++i) {
+        pipeline->cancelling |= (pipeline->stage_state[i] == STAGE_RUNNING);
+    }
+    if (pipeline->status == PIPELINE_RUNNING) pipeline->cancelling = 0;
+}
+
+// Starts a run if one is due and whatever stages are ready. PIPELINE_PASSED for the round the last one passes in.
+int32_t update_pipeline(Succotash *succotash, Binding *binding) {
+    Pipeline *pipeline = &binding->pipeline;
+    if (pipeline->status == PIPELINE_NEEDED && !pipeline->cancelling) {
+        for (int32_t i = 0; i < pipeline->stage_count; ++i) pipeline->stage_state[i] = STAGE_WAITING;
+        pipeline->status     = PIPELINE_RUNNING;
+        pipeline->started_ms = platform_monotonic_ms();
+        binding_log(succotash, binding, LOG_INFO, "running %d stages", pipeline->stage_count);
+    }
+    if (pipeline->status != PIPELINE_RUNNING) return pipeline->status;
+
+    int32_t running = 0, passed = 0;
+    for (int32_t i = 0; i < pipeline->stage_count; ++i) {
+        running += (pipeline->stage_state[i] == STAGE_RUNNING);
+        passed  += (pipeline->stage_state[i] == STAGE_PASSED);
+    }
+
+    if (passed == pipeline->stage_count) {
+        binding_log(succotash, binding, LOG_INFO, "all stages passed after %" PRIu64 " ms", platform_monotonic_ms() - pipeline->started_ms);
+        pipeline->status = PIPELINE_IDLE;
+        return PIPELINE_PASSED;
+    }
+
+    for (int32_t i = 0; i < pipeline->stage_count; ++i) {
+        if (pipeline->max_running > 0 && running >= pipeline->max_running) break;
+        if (pipeline->stage_state[i] != STAGE_WAITING) continue;
+
+        Stage *stage = &pipeline->stages[i];
+        int32_t ready = 1;
+        for (int32_t a = 0; a < stage->after_count; ++a) {
+            ready &= (pipeline->stage_state[stage->after[a]] == STAGE_PASSED);
+        }
+        if (!ready) continue;
+
+        binding_log(succotash, binding, LOG_INFO, "stage %s: %s", stage->name, stage->command);
+        // stage output goes with the generation it's building.
+        process_set_generation(&pipeline->handles[i], (int32_t)(binding - succotash->bindings), binding->generation + 1);
+        if (!start_process(stage->command, &pipeline->handles[i], &succotash->logger)) {
+            binding_log(succotash, binding, LOG_ERROR, "stage %s couldn't start, pipeline failed", stage->name);
+            pipeline->stage_state[i] = STAGE_FAILED;
+            stop_stages(pipeline);
+            pipeline->status = PIPELINE_FAILED;
+            return PIPELINE_FAILED;
+        }
+        event_loop_watch_fd(&succotash->loop, process_event_fd(&pipeline->handles[i]), WAKE_CHILD);
+        pipeline->stage_state[i] = STAGE_RUNNING;
+        running++;
+    }
+    return PIPELINE_RUNNING;
+}
+
+// ====================================
+// Restarting.
+
+// Children that went away on their own or got replaced. returns whether binding's process is alive.
+int32_t reap_binding(Succotash *succotash, Binding *binding, uint64_t now_ms) {
+    // a child that ignored its stop signal for too long gets SIGKILL here.
+    update_process_stop(&binding->handle, now_ms);
+    for (int32_t i = 0; i < RETIRING_MAX; ++i) {
+        update_process_stop(&binding->retiring[i], now_ms);
+        if (binding->retiring_alive[i] && !is_process_running(&binding->retiring[i])) {
+            binding->retiring_alive[i] = 0;
+            log_process_exit(succotash, binding, &binding->retiring[i]);
+        }
+    }
+    if (binding->standby_pending) {
+        update_standby(succotash, binding, now_ms);
+    }
+    reap_stages(succotash, binding, now_ms);
+
+    int32_t process_is_alive = is_process_running(&binding->handle);
+    if (!process_is_alive) { 
+        if (binding->process_was_alive) {
+            Process_Exit *exit = &binding->handle.last_exit;
+            log_process_exit(succotash, binding, &binding->handle);
+
+            uint64_t delay = backoff_note_exit(&binding->backoff, !exit->stopped, exit->runtime_ms, now_ms);
+            if (binding->backoff.gave_up) {
+                binding_log(succotash, binding, LOG_ERROR, "process exited %u times within %u ms. not restarting it until something changes (or stop / start)",
+                            binding->backoff.max_restarts + 1, binding->backoff.window_ms);
+            } else if (delay) {
+                binding_log(succotash, binding, LOG_WARNING, "process exited on its own. restarting in %" PRIu64 " ms", delay);
+            }
+        }
+    }
+    binding->process_was_alive = process_is_alive;
+    return process_is_alive;
+}
+
+void update_binding(Succotash *succotash, Binding *binding, int32_t process_is_alive) {
+    // on its way out already, the start after it sees every change.
+    int32_t process_on_its_way_out = process_is_alive && process_is_stopping(&binding->handle);
+    size_t changed_files = binding->changed_count;
+    Pipeline *pipeline = &binding->pipeline;
+    int32_t has_stages = pipeline->stage_count > 0;
+
+    // Changes only get noted here, the restart waits until the burst is over (see Debounce).
+    uint64_t now_ms = platform_monotonic_ms();
+    if (succotash->should_process_running) {
+        int32_t modification_detected = 0;
+        // with stages a change counts with nothing running too, it's what gets a failed build going again.
+        // so does one while waiting out a crash loop, it might be the fix.
+        int32_t waiting_out_crashes = !process_is_alive && binding->backoff.crashes > 0;
+        int32_t takes_changes = (process_is_alive || has_stages || waiting_out_crashes || binding->backoff.gave_up) && !process_on_its_way_out;
+
+        if (takes_changes && changed_files > 0) {
+            if (!binding->debounce.pending) {
+                binding_log(succotash, binding, LOG_INFO, "File change detected (%zu entries, latest timestamp %" PRIu64 "). waiting for it to settle",
+                            changed_files, succotash->snapshot.latest_modified_time);
+            }
+            debounce_note_changes(&binding->debounce, changed_files, now_ms);
+        }
+
+        // changes while a standby comes up still count, they fire once it's through.
+        if (takes_changes && !binding->standby_pending && debounce_should_fire(&binding->debounce, now_ms)) {
+            binding_log(succotash, binding, LOG_INFO, "%zu entries changed over %" PRIu64 " ms. %s",
+                        binding->debounce.changed_total, now_ms - binding->debounce.first_change_ms,
+                        has_stages ? "running the stages again" : "restarting a process");
+            modification_detected = 1;
+            if (!process_is_alive) backoff_reset(&binding->backoff);
+        }
+
+        // with stages, it's them passing that restarts the process.
+        if (has_stages) {
+            if (modification_detected) pipeline_cancel(succotash, binding, 1);
+            modification_detected = (update_pipeline(succotash, binding) == PIPELINE_PASSED) && process_is_alive;
+        }
+
+        if (process_is_alive) {
+            // the pidfd wakes us once it's gone, the branch below starts the new one.
+            if (modification_detected) {
+                if (succotash->warm_standby) start_standby(succotash, binding);
+                else                         request_process_stop(&binding->handle);
+            }
+        } else if (!binding->standby_pending && pipeline->status == PIPELINE_IDLE && backoff_allows_start(&binding->backoff, now_ms)) {
+            // fresh start sees every change already. with stages the ones since they started haven't been built yet.
+            if (!has_stages) debounce_reset(&binding->debounce);
+            // no round in between might see it alive, it can be gone by the time we look again.
+            binding->process_was_alive = start_binding_process(succotash, binding, &binding->handle);
+            if (binding->process_was_alive) {
+                event_loop_watch_fd(&succotash->loop, process_event_fd(&binding->handle), WAKE_CHILD);
+            } else {
+                // not even started counts as dying right away.
+                uint64_t delay = backoff_note_exit(&binding->backoff, 1, 0, now_ms);
+                if (binding->backoff.gave_up) binding_log(succotash, binding, LOG_ERROR, "process can't be started. giving up until something changes (or stop / start)");
+                else                          binding_log(succotash, binding, LOG_WARNING, "process can't be started. trying again in %" PRIu64 " ms", delay);
+            }
+        }
+    } else {
+        debounce_reset(&binding->debounce);
+        backoff_reset(&binding->backoff);
+        if (binding->standby_pending) cancel_standby(succotash, binding);
+        pipeline_cancel(succotash, binding, 0);
+        if (process_is_alive) {
+            request_process_stop(&binding->handle);
+        }
+    }
+}
+
+// One round of watching / restarting. GUI and headless mode both go through here.
+void update_succotash(Succotash *succotash) {
+    // the GUI edits these for the first binding.
+    if (succotash->has_primary) {
+        snprintf(succotash->bindings[0].command, sizeof(succotash->bindings[0].command), "%s", succotash->command);
+    }
+
+    uint64_t round_ms = platform_monotonic_ms();
+    int32_t process_is_alive[BINDING_MAX];
+    for (int32_t i = 0; i < succotash->binding_count; ++i) {
+        process_is_alive[i] = reap_binding(succotash, &succotash->bindings[i], round_ms);
+    }
+
+    if (succotash->directory_changed) {
+        succotash->directory_changed = 0;
+        watch_directory(succotash);
+    }
+
+    // Always drain the watch, so events from while we were stopped don't pile up in the kernel.
+    // without inotify the refresh is a full walk, so that one only happens while we need it.
+    poll_watch_changes(&succotash->watch, &succotash->logger);
+    if (succotash->watch.start_count != succotash->watch_start_count) {
+        // watch got (re)started, possibly on a new inotify fd.
+        succotash->watch_start_count = succotash->watch.start_count;
+        event_loop_watch_fd(&succotash->loop, watch_event_fd(&succotash->watch), WAKE_WATCH);
+    }
+    size_t changed_files = 0;
+    if (succotash->should_process_running || !succotash->watch.fallback_to_scan) {
+        changed_files = refresh_snapshot(succotash);
+    }
+    route_changes(succotash, changed_files);
+
+    // what changed gets listed once per binding, when it starts waiting for a burst to settle.
+    int32_t burst_starts[BINDING_MAX];
+    for (int32_t i = 0; i < succotash->binding_count; ++i) {
+        Binding *binding = &succotash->bindings[i];
+        burst_starts[i] = process_is_alive[i] && binding->changed_count > 0 && !binding->debounce.pending && !process_is_stopping(&binding->handle);
+    }
+
+    if (succotash->should_process_running && succotash->folder_is_invalid) {
+        watcher_log(&succotash->logger, "Folder %s became invalid. cannot start/restart the process", succotash->watch_root);
+        succotash->should_process_running = 0;
+        return;
+    }
+
+    for (int32_t i = 0; i < succotash->binding_count; ++i) {
+        update_binding(succotash, &succotash->bindings[i], process_is_alive[i]);
+        if (burst_starts[i] && succotash->should_process_running) log_changed_files(succotash, &succotash->bindings[i]);
+    }
+}
+
+// ====================================
+// Settings.
+//
+// Later ones win: defaults, SUCCOTASH_* environment variables, then command line in order
+// (--config files get applied where they show up).
+
+char *trim_whitespace(char *text) {
+    while (*text == ' ' || *text == '\t') text++;
+    size_t length = strlen(text);
+    while (length > 0 && (text[length-1] == ' ' || text[length-1] == '\t' || text[length-1] == '\r' || text[length-1] == '\n')) {
+        text[--length] = 0;
+    }
+    return text;
+}
+
+int32_t parse_flag(const char *value) {
+    return strcmp(value, "1") == 0 || strcmp(value, "true") == 0 || strcmp(value, "yes") == 0 || strcmp(value, "on") == 0;
+}
+
+// "name: command" or "name after a, b: command".
+int32_t pipeline_add_stage(Pipeline *pipeline, char *spec) {
+    if (pipeline->stage_count == STAGE_MAX) {
+        fprintf(stderr, "at most %d stages\n", STAGE_MAX);
+        return 0;
+    }
+    char *colon = strchr(spec, ':');
+    if (!colon) {
+        fprintf(stderr, "stage wants 'NAME [after A,B]: COMMAND', got '%s'\n", spec);
+        return 0;
+    }
+
+    Stage *stage = &pipeline->stages[pipeline->stage_count];
+    memset(stage, 0, sizeof(*stage));
+    char head[256];
+    snprintf(head, sizeof(head), "%.*s", (int)(colon - spec), spec);
+    snprintf(stage->command, sizeof(stage->command), "%s", trim_whitespace(colon + 1));
+
+    char *after = strstr(head, " after ");
+    if (after) *after = 0;
+    snprintf(stage->name, sizeof(stage->name), "%s", trim_whitespace(head));
+    if (!stage->name[0] || !stage->command[0]) {
+        fprintf(stderr, "stage wants 'NAME [after A,B]: COMMAND', got '%s'\n", spec);
+        return 0;
+    }
+
+    if (after) {
+        char *saved = NULL;
+        for (char *name = strtok_r(after + 7, " \t,", &saved); name; name = strtok_r(NULL, " \t,", &saved)) {
+            int32_t found = -1;
+            for (int32_t i = 0; i < pipeline->stage_count; ++i) {
+                if (strcmp(pipeline->stages[i].name, name) == 0) found = i;
+            }
+            // only ones above, so there's no way to make a cycle.
+            if (found == -1) {
+                fprintf(stderr, "stage %s is after %s, which has to be defined before it\n", stage->name, name);
+                return 0;
+            }
+            stage->after[stage->after_count++] = found;
+        }
+    }
+
+    pipeline->stage_count++;
+    return 1;
+}
+
+// returns 0 for keys we don't know.
+int32_t apply_setting(Succotash *succotash, const char *key, const char *value) {
+    if (strcmp(key, "directory") == 0 || strcmp(key, "command") == 0) {
+        if (key[0] == 'd') snprintf(succotash->directory, sizeof(succotash->directory), "%s", value);
+        else               snprintf(succotash->command,   sizeof(succotash->command),   "%s", value);
+        succotash->primary_set = 1;
+    }
+    else if (strcmp(key, "bind") == 0) {
+        if (!strchr(value, '=') || succotash->bind_spec_count == BINDING_MAX - 1) {
+            fprintf(stderr, "bind wants DIRECTORY=COMMAND, at most %d of them\n", BINDING_MAX - 1);
+            return 0;
+        }
+        snprintf(succotash->bind_specs[succotash->bind_spec_count++], sizeof(succotash->bind_specs[0]), "%s", value);
+    }
+    else if (strcmp(key, "ignore") == 0)          snprintf(succotash->ignore,    sizeof(succotash->ignore),    "%s", value);
+    else if (strcmp(key, "headless") == 0)        succotash->headless        = parse_flag(value);
+    else if (strcmp(key, "hash_content") == 0)    succotash->hash_contents   = parse_flag(value);
+    else if (strcmp(key, "scan_threads") == 0)    succotash->scan_threads    = atoi(value);
+    else if (strcmp(key, "scan_backend") == 0)    succotash->scan_backend    = (strcmp(value, "uring") == 0) ? SCAN_BACKEND_URING : SCAN_BACKEND_SYNC;
+    else if (strcmp(key, "debounce_ms") == 0)     succotash->debounce_ms     = (uint32_t)atoi(value);
+    else if (strcmp(key, "debounce_max_ms") == 0) succotash->debounce_max_ms = (uint32_t)atoi(value);
+    else if (strcmp(key, "capture_output") == 0)  succotash->capture_output  = parse_flag(value);
+    else if (strcmp(key, "output_log") == 0)      snprintf(succotash->output_log, sizeof(succotash->output_log), "%s", value);
+    else if (strcmp(key, "archive") == 0)         snprintf(succotash->archive,    sizeof(succotash->archive),    "%s", value);
+    else if (strcmp(key, "search_dir") == 0)      snprintf(succotash->search_dir, sizeof(succotash->search_dir), "%s", value);
+    else if (strcmp(key, "output_log_max_mb") == 0)    succotash->output_log_max_mb    = (uint32_t)atoi(value);
+    else if (strcmp(key, "output_log_max_age_s") == 0) succotash->output_log_max_age_s = (uint32_t)atoi(value);
+    else if (strcmp(key, "output_log_keep") == 0)      succotash->output_log_keep      = atoi(value);
+    else if (strcmp(key, "restart_backoff_ms") == 0)     succotash->restart_backoff_ms     = (uint32_t)atoi(value);
+    else if (strcmp(key, "restart_backoff_max_ms") == 0) succotash->restart_backoff_max_ms = (uint32_t)atoi(value);
+    else if (strcmp(key, "restart_max") == 0)            succotash->restart_max            = (uint32_t)atoi(value);
+    else if (strcmp(key, "restart_window_ms") == 0)      succotash->restart_window_ms      = (uint32_t)atoi(value);
+    else if (strcmp(key, "stop_signal") == 0)     snprintf(succotash->stop_signal, sizeof(succotash->stop_signal), "%s", value);
+    else if (strcmp(key, "stop_timeout_ms") == 0) succotash->stop_timeout_ms = (uint32_t)atoi(value);
+    else if (strcmp(key, "stage") == 0) {
+        if (succotash->stage_spec_count == STAGE_MAX) {
+            fprintf(stderr, "at most %d stages\n", STAGE_MAX);
+            return 0;
+        }
+        snprintf(succotash->stage_specs[succotash->stage_spec_count++], sizeof(succotash->stage_specs[0]), "%s", value);
+    }
+    else if (strcmp(key, "stage_jobs") == 0)      succotash->stage_jobs      = atoi(value);
+    else if (strcmp(key, "listen") == 0)          snprintf(succotash->listen, sizeof(succotash->listen), "%s", value);
+    else if (strcmp(key, "warm_standby") == 0)    succotash->warm_standby    = parse_flag(value);
+    else if (strcmp(key, "ready_timeout_ms") == 0) succotash->ready_timeout_ms = (uint32_t)atoi(value);
+    else if (strcmp(key, "spawn_method") == 0)    succotash->spawn_method    = (strcmp(value, "fork") == 0) ? SPAWN_METHOD_FORK : SPAWN_METHOD_SPAWN;
+    else return 0;
+    return 1;
+}
+
+void apply_environment(Succotash *succotash) {
+    const char *names[][2] = {
+        { "SUCCOTASH_SCAN_THREADS",    "scan_threads"    },
+        { "SUCCOTASH_SCAN_BACKEND",    "scan_backend"    },
+        { "SUCCOTASH_HASH_CONTENT",    "hash_content"    },
+        { "SUCCOTASH_DEBOUNCE_MS",     "debounce_ms"     },
+        { "SUCCOTASH_DEBOUNCE_MAX_MS", "debounce_max_ms" },
+        { "SUCCOTASH_CAPTURE_OUTPUT",  "capture_output"  },
+        { "SUCCOTASH_OUTPUT_LOG",      "output_log"      },
+        { "SUCCOTASH_ARCHIVE",         "archive"         },
+        { "SUCCOTASH_SEARCH_DIR",      "search_dir"      },
+        { "SUCCOTASH_OUTPUT_LOG_MAX_MB",    "output_log_max_mb"    },
+        { "SUCCOTASH_OUTPUT_LOG_MAX_AGE_S", "output_log_max_age_s" },
+        { "SUCCOTASH_OUTPUT_LOG_KEEP",      "output_log_keep"      },
+        { "SUCCOTASH_RESTART_BACKOFF_MS",     "restart_backoff_ms"     },
+        { "SUCCOTASH_RESTART_BACKOFF_MAX_MS", "restart_backoff_max_ms" },
+        { "SUCCOTASH_RESTART_MAX",            "restart_max"            },
+        { "SUCCOTASH_RESTART_WINDOW_MS",      "restart_window_ms"      },
+        { "SUCCOTASH_SPAWN_METHOD",    "spawn_method"    },
+        { "SUCCOTASH_STOP_SIGNAL",     "stop_signal"     },
+        { "SUCCOTASH_STOP_TIMEOUT_MS", "stop_timeout_ms" },
+        { "SUCCOTASH_WARM_STANDBY",    "warm_standby"    },
+        { "SUCCOTASH_LISTEN",          "listen"          },
+        { "SUCCOTASH_READY_TIMEOUT_MS", "ready_timeout_ms" },
+        { "SUCCOTASH_STAGE_JOBS",      "stage_jobs"      },
+    };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+        const char *value = getenv(names[i][0]);
+        if (value) apply_setting(succotash, names[i][1], value);
+    }
+}
+
+// "key = value" per line, same keys as the long options. '#' starts a comment line.
+int32_t load_config_file(Succotash *succotash, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "failed to open config %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    char buffer[1024];
+    int32_t line_number = 0;
+    int32_t result = 1;
+    while (fgets(buffer, sizeof(buffer), file)) {
+        line_number++;
+        char *line = trim_whitespace(buffer);
+        if (line[0] == 0 || line[0] == '#') continue;
+
+        char *equals = strchr(line, '=');
+        if (!equals) {
+            fprintf(stderr, "%s:%d: expected key = value\n", path, line_number);
+            result = 0;
+            continue;
+        }
+        *equals = 0;
+        char *key = trim_whitespace(line);
+        for (char *c = key; *c; ++c) if (*c == '-') *c = '_';
+
+        if (!apply_setting(succotash, key, trim_whitespace(equals + 1))) {
+            fprintf(stderr, "%s:%d: unknown setting '%s'\n", path, line_number, key);
+            result = 0;
+        }
+    }
+
+    fclose(file);
+    return result;
+}
+
+void print_usage(const char *program) {
+    printf("usage: %s [options] [--] [directory [command...]]\n"
+           "       %s archive DIR [RUN | pid=PID | at=UNIX_TIME]   list the runs kept in DIR, or print one\n"
+           "\n"
+           "  --headless              no window, logs go to stdout\n"
+           "  --config FILE           read settings from FILE, one 'key = value' per line\n"
+           "  --directory DIR         folder to watch\n"
+           "  --command CMD           command to (re)start\n"
+           "  --bind DIR=CMD          one more command, restarted for changes below DIR. repeatable,\n"
+           "                          all of them share one watch\n"
+           "  --stage 'NAME [after A,B]: CMD'\n"
+           "                          run CMD on every change before (re)starting the first command,\n"
+           "                          after stages A and B passed. repeatable, the restart only happens if all pass\n"
+           "  --stage-jobs N          at most N stages at once (0 = no limit)\n"
+           "  --ignore PATTERNS       space separated .gitignore patterns\n"
+           "  --hash-content          restart only when file content changed\n"
+           "  --debounce-ms MS        quiet period before restarting\n"
+           "  --debounce-max-ms MS    restart at most this late after the first change\n"
+           "  --restart-backoff-ms MS wait this long before restarting a process that exited on its own,\n"
+           "                          twice that after the next one... (250)\n"
+           "  --restart-backoff-max-ms MS\n"
+           "                          up to this long (30000)\n"
+           "  --restart-max N         give up after N+1 exits within --restart-window-ms, 0 = never, at most 31 (10)\n"
+           "  --restart-window-ms MS  (60000)\n"
+           "  --capture-output 0|1    children's stdout / stderr go to the log (1) or straight to ours\n"
+           "  --output-log DIR        keep all of it in DIR/<command>.log as well\n"
+           "  --output-log-max-mb MB  rotate once it's this big (64)\n"
+           "  --output-log-max-age-s S\n"
+           "                          or this old, 0 = never (0)\n"
+           "  --output-log-keep N     rotated files to keep around, .1 is the newest (5)\n"
+           "  --archive DIR           keep all of it compressed in DIR as well, per run (see archive above)\n"
+           "  --search-dir DIR        where the log search index goes once it outgrows memory, without it\n"
+           "                          only the last ~1M lines can be searched\n"
+           "  --scan-threads N        0 = one per core\n"
+           "  --scan-backend sync|uring\n"
+           "  --spawn-method spawn|fork\n"
+           "  --stop-signal SIGNAL    sent to the process group to stop it (TERM)\n"
+           "  --stop-timeout-ms MS    SIGKILL if it's still there after this long (5000)\n"
+           "  --warm-standby          start the replacement first, switch once it writes to $SUCCOTASH_READY_FD\n"
+           "  --ready-timeout-ms MS   give up on a replacement that isn't ready by then (10000)\n"
+           "  --listen ADDRESSES      keep listening on these across restarts, children get them\n"
+           "                          as fds 3, 4, ... with LISTEN_FDS set. '8080 127.0.0.1:9000 unix:/tmp/app.sock'\n",
+           program, program);
+}
+
+// returns 1 to go on, 0 on bad arguments, -1 if we're done already (--help).
+int32_t parse_arguments(Succotash *succotash, int argc, char **argv) {
+    int32_t positional   = 0;
+    int32_t options_done = 0; // after "--": a directory or command that starts with "-" is just that.
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+
+        if (!options_done && (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0)) {
+            print_usage(argv[0]);
+            return -1;
+        }
+
+        if (!options_done && strcmp(arg, "--") == 0) {
+            options_done = 1;
+            continue;
+        }
+
+        if (!options_done && strncmp(arg, "--", 2) == 0) {
+            char key[64] = {0};
+            const char *equals = strchr(arg, '=');
+            size_t key_length = equals ? (size_t)(equals - arg - 2) : strlen(arg + 2);
+            if (key_length >= sizeof(key)) key_length = sizeof(key) - 1;
+            memcpy(key, arg + 2, key_length);
+            for (char *c = key; *c; ++c) if (*c == '-') *c = '_';
+
+            const char *value = NULL;
+            if (equals) {
+                value = equals + 1;
+            } else if (strcmp(key, "headless") == 0 || strcmp(key, "hash_content") == 0 || strcmp(key, "warm_standby") == 0) {
+                value = "1";
+            } else if (i + 1 < argc) {
+                value = argv[++i];
+            } else {
+                fprintf(stderr, "%s needs a value\n", arg);
+                return 0;
+            }
+
+            if (strcmp(key, "config") == 0) {
+                if (!load_config_file(succotash, value)) return 0;
+            } else if (!apply_setting(succotash, key, value)) {
+                fprintf(stderr, "unknown option %s\n", arg);
+                print_usage(argv[0]);
+                return 0;
+            }
+            continue;
+        }
+
+        // same order either side of "--": directory first, then the command.
+        if (positional == 0) {
+            snprintf(succotash->directory, sizeof(succotash->directory), "%s", argv[i]);
+            succotash->primary_set = 1;
+            positional++;
+            continue;
+        }
+
+        // everything left is the command, start_process splits it on spaces again anyway.
+        succotash->primary_set = 1;
+        succotash->command[0] = 0;
+        for (int j = i; j < argc; ++j) {
+            if (j > i) strncat(succotash->command, " ", sizeof(succotash->command) - strlen(succotash->command) - 1);
+            strncat(succotash->command, argv[j], sizeof(succotash->command) - strlen(succotash->command) - 1);
+        }
+        break;
+    }
+    return 1;
+}
+
+// ====================================
+// Main loops.
+
+// ====================================
+// Archive command.
+//
+//   archive DIR                the runs kept in DIR, one per line.
+//   archive DIR RUN            everything run RUN wrote.
+//   archive DIR pid=PID        same, for the last run with that pid.
+//   archive DIR at=UNIX_TIME   same, for the run that started last before then.
+// only the index gets walked, and only the chosen run's blocks get decompressed.
+
+void write_archive_output(void *context, const uint8_t *data, size_t size) {
+    fwrite(data, 1, size, stdout);
+}
+
+int run_archive_command(int argc, char **argv) {
+    if (argc < 1) {
+        fprintf(stderr, "archive wants DIR [RUN | pid=PID | at=UNIX_TIME]\n");
+        return 1;
+    }
+    Archive_Reader reader;
+    if (!open_archive_reader(&reader, argv[0])) {
+        fprintf(stderr, "no archive in %s\n", argv[0]);
+        return 1;
+    }
+
+    int result = 0;
+    if (argc < 2) {
+        uint32_t first = UINT32_MAX, last = 0;
+        for (size_t i = 0; i < reader.entry_count; ++i) {
+            if (reader.entries[i].run < first) first = reader.entries[i].run;
+            if (reader.entries[i].run > last)  last  = reader.entries[i].run;
+        }
+        size_t run_count = (reader.entry_count > 0) ? (size_t)(last - first) + 1 : 0;
+        const Archive_Entry **firsts = (const Archive_Entry **)calloc(run_count + 1, sizeof(*firsts));
+        uint64_t *raw    = (uint64_t *)calloc(run_count + 1, sizeof(uint64_t));
+        uint64_t *stored = (uint64_t *)calloc(run_count + 1, sizeof(uint64_t));
+        assert(firsts && raw && stored && "calloc failed");
+
+        for (size_t i = 0; i < reader.entry_count; ++i) {
+            const Archive_Entry *entry = &reader.entries[i];
+            size_t slot = entry->run - first;
+            if (!firsts[slot]) firsts[slot] = entry;
+            raw[slot]    += entry->raw_size;
+            stored[slot] += entry->stored_size;
+        }
+
+        printf("%8s %8s %8s %8s  %-19s %12s %12s\n", "run", "binding", "gen", "pid", "started", "bytes", "stored");
+        for (size_t slot = 0; slot < run_count; ++slot) {
+            if (!firsts[slot]) continue; // never wrote anything.
+            time_t started = (time_t)(firsts[slot]->started_ns / 1000000000ull);
+            char when[32] = {0};
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&started));
+            printf("%8u %8d %8u %8d  %-19s %12" PRIu64 " %12" PRIu64 "\n", firsts[slot]->run, firsts[slot]->binding, firsts[slot]->generation,
+                   firsts[slot]->pid, when, raw[slot], stored[slot]);
+        }
+        free(firsts);
+        free(raw);
+        free(stored);
+    } else {
+        const char *which = argv[1];
+        int64_t run = -1;
+        if (strncmp(which, "pid=", 4) == 0) {
+            int32_t pid = atoi(which + 4);
+            for (size_t i = 0; i < reader.entry_count; ++i) {
+                if (reader.entries[i].pid == pid) run = reader.entries[i].run;
+            }
+        } else if (strncmp(which, "at=", 3) == 0) {
+            uint64_t at_ns = strtoull(which + 3, NULL, 10) * 1000000000ull;
+            uint64_t best_ns = 0;
+            for (size_t i = 0; i < reader.entry_count; ++i) {
+                const Archive_Entry *entry = &reader.entries[i];
+                if (entry->started_ns <= at_ns && (run == -1 || entry->started_ns >= best_ns)) {
+                    run     = entry->run;
+                    best_ns = entry->started_ns;
+                }
+            }
+        } else {
+            run = (int64_t)strtoul(which, NULL, 10);
+        }
+
+        int32_t blocks = (run == -1) ? 0 : archive_read_run(&reader, (uint32_t)run, write_archive_output, NULL);
+        fflush(stdout);
+        if (blocks == 0) {
+            fprintf(stderr, "no output for %s in %s\n", which, argv[0]);
+            result = 1;
+        } else if (blocks < 0) {
+            fprintf(stderr, "run %" PRId64 " has a broken block, the output stops there\n", run);
+            result = 1;
+        }
+    }
+    close_archive_reader(&reader);
+    return result;
+}
+
+int run_headless(Succotash *succotash) {
+    if (succotash->folder_is_invalid) {
+        watcher_log(&succotash->logger, "cannot watch %s, giving up.", succotash->watch_root);
+        return 1;
+    }
+
+    succotash->running = 1;
+    succotash->should_process_running = 1;
+    while (!platform_app_should_close() && succotash->running && succotash->should_process_running) {
+        update_succotash(succotash);
+        event_loop_wait(&succotash->loop, next_wake_timeout(succotash, 0));
+    }
+    return succotash->should_process_running ? 0 : 1;
+}
+
+#ifndef SUCCOTASH_HEADLESS
+// ====================================
+// Search feeder.
+//
+// The search index and the log panel's headers get fed on a thread of their own, so they keep up
+// with the ring however long a frame takes (or the window sits minimized). the GUI holds lock
+// while it looks at either of them, the feeder lets go of it every batch.
+
+#define SEARCH_FEED_MS    10   // a drain this often keeps up with the ring many times over.
+#define SEARCH_FEED_BATCH 4096 // records per hold of the lock.
+
+struct Search_Feeder {
+    Succotash  *succotash;
+    SDL_Thread *thread;
+    SDL_mutex  *lock;
+    std::atomic<int32_t> stop;
+};
+
+// Whatever got logged since last time, up to max records. a record that's gone for good before
+// we got to it goes in empty so the numbers stay in order, one still being written waits.
+size_t feed_search_index(Succotash *succotash, size_t max) {
+    uint64_t end = logger_record_count(&succotash->logger);
+    size_t fed = 0;
+    for (; succotash->search_next != end && fed < max; succotash->search_next++, fed++) {
+        uint64_t number = succotash->search_next;
+        Log_Record record;
+        char text[LOG_LINE_MAX];
+        if (!logger_read(&succotash->logger, number, &record, text, sizeof(text))) {
+            if (!logger_gone(&succotash->logger, number)) break;
+            memset(&record, 0, sizeof(record));
+            record.text   = "";
+            record.source = LOG_SOURCE_UNKNOWN;
+        }
+        search_index_add(succotash->search, number, record.text, record.length);
+
+        Log_Row_Header *header = &succotash->log_headers[number % LOG_PANEL_ROWS];
+        header->time_ns    = record.time_ns;
+        header->generation = record.generation;
+        header->source     = record.source;
+        header->severity   = record.severity;
+    }
+    return fed;
+}
+
+int search_feeder_main(void *data) {
+    Search_Feeder *feeder = (Search_Feeder *)data;
+    while (!feeder->stop.load(std::memory_order_acquire)) {
+        size_t fed;
+        do {
+            SDL_LockMutex(feeder->lock);
+            fed = feed_search_index(feeder->succotash, SEARCH_FEED_BATCH);
+            SDL_UnlockMutex(feeder->lock);
+        } while (fed == SEARCH_FEED_BATCH && !feeder->stop.load(std::memory_order_acquire));
+        SDL_Delay(SEARCH_FEED_MS);
+    }
+    return 0;
+}
+
+// NULL without a search index, or if the thread won't start. the panel makes do with the ring then.
+Search_Feeder *start_search_feeder(Succotash *succotash) {
+    if (!succotash->search) return NULL;
+    Search_Feeder *feeder = (Search_Feeder *)malloc(sizeof(Search_Feeder));
+    assert(feeder && "malloc failed");
+    feeder->succotash = succotash;
+    feeder->stop.store(0, std::memory_order_relaxed);
+    feeder->lock   = SDL_CreateMutex();
+    feeder->thread = feeder->lock ? SDL_CreateThread(search_feeder_main, "search feeder", feeder) : NULL;
+    if (!feeder->thread) {
+        watcher_log(&succotash->logger, "failed to start the search feeder, search is off: %s", SDL_GetError());
+        if (feeder->lock) SDL_DestroyMutex(feeder->lock);
+        free(feeder);
+        destroy_search_index(succotash->search);
+        succotash->search = NULL;
+        return NULL;
+    }
+    return feeder;
+}
+
+void stop_search_feeder(Search_Feeder *feeder) {
+    if (!feeder) return;
+    feeder->stop.store(1, std::memory_order_release);
+    SDL_WaitThread(feeder->thread, NULL);
+    SDL_DestroyMutex(feeder->lock);
+    free(feeder);
+}
+
+int run_gui(Succotash *succotash) {
     SDL_Init(SDL_INIT_EVERYTHING);
     r_init();
-    platform_init();
 
     /* init microui */
-    Succotash *succotash = (Succotash *)malloc(sizeof(Succotash));
     mu_Context *ctx = (mu_Context *)malloc(sizeof(mu_Context));
-    memset(succotash, 0, sizeof(Succotash));
-
     mu_init(ctx);
     ctx->text_width = text_width;
     ctx->text_height = text_height;
 
+    int window_fd = window_event_fd();
+    event_loop_watch_fd(&succotash->loop, window_fd, WAKE_WINDOW);
+    Search_Feeder *feeder = start_search_feeder(succotash);
+
     /* main loop */
+    succotash->running = 1;
+    while (!platform_app_should_close() && succotash->running) {
+        uint64_t logs_end = logger_record_count(&succotash->logger);
+        process_event(succotash, ctx);
+        if (feeder) {
+            SDL_LockMutex(feeder->lock);
+            catch_up_log_panel(succotash);
+        }
+        process_gui(succotash, ctx);
+        if (feeder) SDL_UnlockMutex(feeder->lock);
+        update_succotash(succotash);
+        render_gui(succotash, ctx);
+
+        // Nothing to do until the watch, a child, the window or a deadline says otherwise.
+        // new log lines need one more frame for the log panel to scroll down to them.
+        int32_t timeout = next_wake_timeout(succotash, window_fd != -1);
+        if (logger_record_count(&succotash->logger) != logs_end) timeout = 0;
+        // the feeder doesn't wake us, look again once it had the time to get to them.
+        if (feeder && succotash->search_seen != logs_end && (timeout == -1 || timeout > SEARCH_FEED_MS)) timeout = SEARCH_FEED_MS;
+        event_loop_wait(&succotash->loop, timeout);
+    }
+
+    stop_search_feeder(feeder);
+    free(ctx);
+    return 0;
+}
+#endif
+
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "archive") == 0) return run_archive_command(argc - 2, argv + 2);
+
+    Succotash *succotash = (Succotash *)malloc(sizeof(Succotash));
+    memset((void *)succotash, 0, sizeof(Succotash)); // atomics in the logger are fine zeroed.
+    init_logger(&succotash->logger);
+
     strcat(succotash->directory, "./src");
     strcat(succotash->command,   "./test_printing_process.exe");
+    strcat(succotash->ignore,    ".git/ node_modules/ dist/");
+    succotash->debounce_ms     = 200;
+    succotash->debounce_max_ms = 2000;
+    succotash->capture_output  = 1;
+    for (int32_t i = 0; i < LOG_SOURCE_COUNT; ++i) succotash->show_source[i] = 1;
+    succotash->output_log_max_mb = 64;
+    succotash->output_log_keep   = 5;
+    succotash->restart_backoff_ms     = 250;
+    succotash->restart_backoff_max_ms = 30000;
+    succotash->restart_max            = 10;
+    succotash->restart_window_ms      = 60000;
+    succotash->stop_timeout_ms = 5000;
+    succotash->ready_timeout_ms = 10000;
+#ifdef SUCCOTASH_HEADLESS
+    succotash->headless = 1;
+#endif
+
+    apply_environment(succotash);
+    int32_t parsed = parse_arguments(succotash, argc, argv);
+    if (parsed != 1) {
+        free(succotash);
+        return parsed == 0;
+    }
+#ifdef SUCCOTASH_HEADLESS
+    succotash->headless = 1;
+#endif
+
+    platform_init();
+    succotash->logger.print_to_stdout = succotash->headless;
 
     to_full_paths(succotash->directory, sizeof(succotash->directory));
     to_full_paths(succotash->command,   sizeof(succotash->command));
 
-    succotash->handle             = create_process_handle();
-    succotash->last_modified_time = find_latest_modified_time(&succotash->logger, (char *)succotash->directory);
-    succotash->folder_is_invalid  = succotash->last_modified_time == 0;
-    watcher_log(&succotash->logger, "Waiting.");
+    if (succotash->listen[0]) {
+        succotash->listen_count = open_listen_sockets(succotash->listen, succotash->listen_fds, LISTEN_MAX, &succotash->logger);
+        if (succotash->listen_count == -1) {
+            fprintf(stderr, "failed to open listening sockets for %s\n", succotash->listen);
+            free(succotash);
+            return 1;
+        }
+    }
 
-    if (!succotash->handle.valid) {
-        printf("Failed to start a program.\n");
-        return 0;
+    // --bind alone means just those, the default directory / command only come along when asked for.
+    succotash->has_primary = succotash->primary_set || succotash->bind_spec_count == 0;
+    if (succotash->has_primary) succotash->binding_count = 1;
+    for (int32_t i = 0; i < succotash->bind_spec_count; ++i) {
+        Binding *binding = &succotash->bindings[succotash->binding_count++];
+        char *equals = strchr(succotash->bind_specs[i], '=');
+        *equals = 0;
+        snprintf(binding->directory, sizeof(binding->directory), "%s", trim_whitespace(succotash->bind_specs[i]));
+        snprintf(binding->command,   sizeof(binding->command),   "%s", trim_whitespace(equals + 1));
+        if (!resolve_directory(binding->directory, sizeof(binding->directory))) {
+            fprintf(stderr, "cannot watch %s for %s\n", binding->directory, binding->command);
+            free(succotash);
+            return 1;
+        }
     }
 
-    int32_t process_was_alive_previous_frame = 0;
-    succotash->running = 1;
-    while (!platform_app_should_close() && succotash->running) {
-        process_event(succotash, ctx);
-        process_gui(succotash, ctx);
+    // the output thread appends to the archive from its first wake up on, it's there before it starts.
+    Log_Archive *archive = NULL;
+    if (succotash->archive[0]) {
+        if (!succotash->capture_output) fprintf(stderr, "--archive needs --capture-output\n");
+        else                            archive = open_log_archive(succotash->archive, &succotash->logger);
+    }
+    if (succotash->capture_output) succotash->output = create_output_reader(&succotash->logger, archive);
+    if (!succotash->output && archive) {
+        close_log_archive(archive);
+        archive = NULL;
+    }
+    if (succotash->output_log[0]) {
+        if (!succotash->output) {
+            fprintf(stderr, "--output-log needs --capture-output\n");
+        } else if (!output_reader_set_sink(succotash->output, succotash->output_log, (uint64_t)succotash->output_log_max_mb << 20,
+                                           succotash->output_log_max_age_s, succotash->output_log_keep)) {
+            fprintf(stderr, "not keeping child output in %s\n", succotash->output_log);
+        }
+    }
 
-        int32_t process_is_alive = is_process_running(&succotash->handle);
-        if (!process_is_alive) { 
-            if (process_was_alive_previous_frame) {
-                watcher_log(&succotash->logger, "process exited. waiting for restart(press start stop or modify content in watch folder.)");
-            }
+    for (int32_t i = 0; i < succotash->binding_count; ++i) {
+        Binding *binding = &succotash->bindings[i];
+        binding->handle   = create_child_handle(succotash, binding);
+        binding->standby  = create_child_handle(succotash, binding);
+        for (int32_t r = 0; r < RETIRING_MAX; ++r) binding->retiring[r] = create_child_handle(succotash, binding);
+        binding->debounce = create_debounce(succotash->debounce_ms, succotash->debounce_max_ms);
+        binding->backoff  = create_backoff(succotash->restart_backoff_ms, succotash->restart_backoff_max_ms,
+                                           succotash->restart_max, succotash->restart_window_ms,
+                                           (uint32_t)platform_monotonic_ms() * 2654435761u + (uint32_t)i);
+    }
+    Pipeline *pipeline = &succotash->bindings[0].pipeline;
+    for (int32_t i = 0; i < succotash->stage_spec_count; ++i) {
+        if (!pipeline_add_stage(pipeline, succotash->stage_specs[i])) {
+            free(succotash);
+            return 1;
         }
-        //
-        // handle_stdout_for_process(&succotash->handle, NULL);
-        if (succotash->should_process_running) {
-            int32_t modification_detected = 0;
-
-            if (process_is_alive) {
-                uint64_t current_latest_modified_time = find_latest_modified_time(&succotash->logger,
-                                                                                  (char *)succotash->directory);
-
-                if (current_latest_modified_time > succotash->last_modified_time) {
-                    watcher_log(&succotash->logger, "File change detected (timestamp %" PRIu64 "). restarting a process", current_latest_modified_time);
-                    succotash->last_modified_time = current_latest_modified_time;
-                    modification_detected = 1;
-                } else if (current_latest_modified_time == 0) {
-                    succotash->folder_is_invalid = 1;
-                }
-            }
+        // no sockets for these.
+        char tag[64];
+        snprintf(tag, sizeof(tag), "[%s] ", pipeline->stages[i].name);
+        pipeline->handles[i] = create_process_handle();
+        process_set_output_reader(&pipeline->handles[i], succotash->output, tag);
+        process_set_spawn_method(&pipeline->handles[i], succotash->spawn_method);
+        process_set_stop_signal(&pipeline->handles[i], succotash->stop_signal, succotash->stop_timeout_ms);
+    }
+    pipeline->max_running = succotash->stage_jobs;
+    pipeline->status      = pipeline->stage_count ? PIPELINE_NEEDED : PIPELINE_IDLE;
 
-            if (succotash->folder_is_invalid) {
-                watcher_log(&succotash->logger, "Folder %s became invalid. cannot start/restart the process", succotash->directory);
-                succotash->should_process_running = 0;
-                continue;
-            }
+    if (!process_set_stop_signal(&succotash->bindings[0].handle, succotash->stop_signal, succotash->stop_timeout_ms)) {
+        fprintf(stderr, "stop signal %s is unknown or unsupported on this platform, using the default\n", succotash->stop_signal);
+    }
+    if (succotash->warm_standby && !process_set_readiness_gate(&succotash->bindings[0].standby, 1)) {
+        fprintf(stderr, "warm standby isn't supported on this platform, restarting the old way\n");
+        succotash->warm_standby = 0;
+    }
+    succotash->watch    = create_watch_handle();
+    succotash->snapshot = create_snapshot();
+    succotash->ignore_rules = create_ignore_rules();
 
-            if (process_is_alive) {
-                if (modification_detected) {
-                    restart_process(succotash->command, &succotash->handle, &succotash->logger);
-                }
-            } else {
-                start_process(succotash->command, &succotash->handle, &succotash->logger);
-            }
-        } else {
-            if (process_is_alive) {
-                terminate_process(&succotash->handle);
-            }
-        }
+    // scan_threads 0 is the default (one per core), only asking for more than one is worth a word.
+    if (!snapshot_set_scan_threads(&succotash->snapshot, succotash->scan_threads) && succotash->scan_threads > 1) {
+        fprintf(stderr, "--scan-threads isn't supported on this platform, scanning on one thread\n");
+    }
+    if (!snapshot_set_scan_backend(&succotash->snapshot, succotash->scan_backend)) {
+        fprintf(stderr, "--scan-backend uring isn't supported on this platform, scanning the plain way\n");
+    }
+    if (!snapshot_set_content_hashing(&succotash->snapshot, succotash->hash_contents)) {
+        fprintf(stderr, "--hash-content isn't supported on this platform, restarting on every change\n");
+        succotash->hash_contents = 0;
+    }
+    if (!succotash->headless) {
+        succotash->search      = create_search_index(succotash->search_dir, &succotash->logger);
+        succotash->log_headers = (Log_Row_Header *)calloc(LOG_PANEL_ROWS, sizeof(Log_Row_Header));
+        assert(succotash->log_headers && "calloc failed");
+    }
+    succotash->loop     = create_event_loop(&succotash->logger);
+    event_loop_watch_fd(&succotash->loop, output_reader_wake_fd(succotash->output), WAKE_OUTPUT);
+    watch_directory(succotash);
+    watcher_log(&succotash->logger, "Waiting.");
 
-        // NOTE(fuzzy):
-        // Placing render_gui forces renderer to sync to 60hz -- I'm using this 16ms lag to ensure that
-        // handle->pid will be a valid ID once we start the process at the same frame.
-        // otherwise the is_process_running at the top will return false because of ECHILD error, despite the process itself still running.
-        render_gui(succotash, ctx);
-        process_was_alive_previous_frame = process_is_alive;
-    }  
+    if (!succotash->bindings[0].handle.valid) {
+        printf("Failed to start a program.\n");
+        return 0;
+    }
+
+#ifdef SUCCOTASH_HEADLESS
+    int result = run_headless(succotash);
+#else
+    int result = succotash->headless ? run_headless(succotash) : run_gui(succotash);
+#endif
     
     watcher_log(&succotash->logger, "Ending the application.");
-    destroy_handle(&succotash->handle);
-    free(ctx);
+    for (int32_t i = 0; i < succotash->binding_count; ++i) {
+        destroy_handle(&succotash->bindings[i].standby);
+        destroy_handle(&succotash->bindings[i].handle);
+        for (int32_t r = 0; r < RETIRING_MAX; ++r) destroy_handle(&succotash->bindings[i].retiring[r]);
+        for (int32_t s = 0; s < succotash->bindings[i].pipeline.stage_count; ++s) {
+            destroy_handle(&succotash->bindings[i].pipeline.handles[s]);
+        }
+    }
+    destroy_output_reader(succotash->output);
+    close_log_archive(archive);
+    destroy_search_index(succotash->search);
+    free(succotash->log_headers);
+    free(succotash->filtered_rows);
+    close_listen_sockets(succotash->listen_fds, succotash->listen_count);
+    stop_watching(&succotash->watch);
+    destroy_snapshot(&succotash->snapshot);
+    destroy_ignore_rules(&succotash->ignore_rules);
+    destroy_event_loop(&succotash->loop);
+    destroy_logger(&succotash->logger);
     free(succotash);
-    return 0;
+    return result;
 }
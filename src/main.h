@@ -2,6 +2,7 @@
 #define MAIN_H
 #include <stdlib.h>
 #include <stdint.h>
+#include <atomic>
 
 // ====================================
 // Shared.
@@ -9,33 +10,158 @@
 typedef struct Succotash Succotash;
 typedef struct Logger Logger;
 
-#define LOG_BUFFER_LINE_SIZE   2048
-#define LOG_BUFFER_BUCKET_SIZE 256
+// Log ring. records of any length sit back to back in one byte arena, an index of slots says
+// where. any thread appends without locks: one fetch_add claims the record's number, another its
+// bytes, and the slot gets published once they're copied in. readers copy a record out and keep
+// it if its slot still has its number and nobody claimed its bytes again after the copy.
+// the slot is the record's header: when, who said it and how bad it is, only the text goes in the arena.
+#define LOG_LINE_MAX   2048              // longer records get cut.
+#define LOG_ARENA_SIZE (4 * 1024 * 1024)
+#define LOG_INDEX_SIZE (64 * 1024)       // records the index keeps, power of two.
+
+// unknown: a record that was gone before anyone read it, all that's left is its number.
+enum { LOG_SOURCE_WATCHER, LOG_SOURCE_SUPERVISOR, LOG_SOURCE_STDOUT, LOG_SOURCE_STDERR, LOG_SOURCE_UNKNOWN, LOG_SOURCE_COUNT };
+enum { LOG_DEBUG, LOG_INFO, LOG_WARNING, LOG_ERROR };
+
+typedef struct {
+    std::atomic<uint64_t> sequence;   // record number + 1 once it's published, 0 while being (re)written.
+    std::atomic<uint64_t> offset;     // into the arena, counting every byte ever claimed.
+    std::atomic<uint32_t> length;     // without the terminating 0.
+    std::atomic<uint32_t> kind;       // source | severity << 8.
+    std::atomic<uint64_t> time_ns;    // platform_monotonic_ns when it got claimed.
+    std::atomic<uint32_t> generation; // restart generation of the process it's about, 0 = none in particular.
+} Log_Slot;
+
+typedef struct {
+    const char *text; // the buffer given to logger_read, 0 terminated.
+    uint32_t    length;
+    uint8_t     source;   // LOG_SOURCE_*
+    uint8_t     severity; // LOG_DEBUG...
+    uint32_t    generation;
+    uint64_t    time_ns;
+} Log_Record;
 
 typedef struct Logger {
-    char   logs[LOG_BUFFER_LINE_SIZE][LOG_BUFFER_BUCKET_SIZE];
-    size_t logs_begin;
-    size_t logs_end;
+    char     *arena; // LOG_ARENA_SIZE, plus LOG_LINE_MAX of slack so no record has to wrap around.
+    Log_Slot *index;
+    std::atomic<uint64_t> records; // claimed so far.
+    std::atomic<uint64_t> bytes;   // same.
+    uint64_t started_ns;     // time_ns of the logger itself, records show up relative to it.
+    int32_t print_to_stdout; // headless mode, there's no log panel to look at.
 } Logger;
 
-void watcher_log(Logger *logger, const char *message, ...);
+void        init_logger(Logger *logger);
+void        destroy_logger(Logger *logger);
+uint64_t    logger_record_count(Logger *logger); // some of the last ones may still be on their way.
+// 0 if it isn't there (yet or anymore). text longer than capacity - 1 gets cut, LOG_LINE_MAX always fits.
+int32_t     logger_read(Logger *logger, uint64_t number, Log_Record *out, char *buffer, size_t capacity);
+int32_t     logger_gone(Logger *logger, uint64_t number); // logger_read won't ever find it.
+
+void watcher_log(Logger *logger, const char *message, ...); // LOG_SOURCE_WATCHER, LOG_INFO.
+void watcher_log_ex(Logger *logger, int32_t source, int32_t severity, uint32_t generation, const char *message, ...);
+void watcher_log_text(Logger *logger, int32_t source, uint32_t generation, const char *tag, const char *text, size_t length); // no formatting, no flush.
 
 int32_t platform_app_should_close();
 void platform_init();
+uint64_t platform_monotonic_ms(); // never goes backwards, unrelated to wall clock.
+uint64_t platform_monotonic_ns(); // same clock.
+uint32_t platform_process_id();
+int32_t  platform_process_alive(uint32_t pid); // whoever's it is.
+
+// Collapses a burst of changes into one restart.
+// fires once nothing changed for quiet_ms, or max_delay_ms after the first change at the latest.
+typedef struct {
+    uint32_t quiet_ms;
+    uint32_t max_delay_ms;
+
+    int32_t  pending;
+    uint64_t first_change_ms;
+    uint64_t last_change_ms;
+    size_t   changed_total; // entries changed over the whole burst.
+} Debounce;
+
+Debounce create_debounce(uint32_t quiet_ms, uint32_t max_delay_ms);
+void     debounce_note_changes(Debounce *debounce, size_t changed_count, uint64_t now_ms);
+uint64_t debounce_deadline(Debounce *debounce); // 0 if nothing is pending.
+int32_t  debounce_should_fire(Debounce *debounce, uint64_t now_ms); // resets when it fires.
+void     debounce_reset(Debounce *debounce);
+
+// Keeps a process that keeps dying on its own from getting restarted in a tight loop.
+// every exit in a row doubles the wait before the next start (base_ms up to max_ms, give or take
+// a quarter so bindings with the same broken dependency don't come back in lockstep). one that
+// stayed up for BACKOFF_HEALTHY_MS starts over from base_ms. more than max_restarts exits inside
+// window_ms and it gives up until something changes or it gets started by hand.
+#define BACKOFF_HISTORY    32
+#define BACKOFF_HEALTHY_MS 10000
+
+typedef struct {
+    uint32_t base_ms;
+    uint32_t max_ms;
+    uint32_t max_restarts; // 0 = never give up.
+    uint32_t window_ms;
+
+    uint32_t crashes;        // in a row, 0 = nothing to wait for.
+    uint64_t next_start_ms;
+    int32_t  gave_up;
+    uint64_t exits_ms[BACKOFF_HISTORY]; // most recent exits, oldest gets overwritten.
+    uint32_t exit_count;
+    uint32_t random;
+} Backoff;
+
+Backoff  create_backoff(uint32_t base_ms, uint32_t max_ms, uint32_t max_restarts, uint32_t window_ms, uint32_t seed);
+uint64_t backoff_note_exit(Backoff *backoff, int32_t crashed, uint64_t runtime_ms, uint64_t now_ms); // the wait, 0 if none.
+uint64_t backoff_deadline(Backoff *backoff); // 0 if a start can happen whenever, or never (gave_up).
+int32_t  backoff_allows_start(Backoff *backoff, uint64_t now_ms);
+void     backoff_reset(Backoff *backoff);
 
 // ====================================
 // Process handling.
 
 struct Process_Handle;
 struct Logger;
+
+// What became of a child, recorded when it gets reaped.
+typedef struct {
+    int32_t  pid;
+    int32_t  exit_code;  // -1 if it didn't exit on its own.
+    int32_t  signal;     // signal that killed it, 0 if none.
+    uint64_t runtime_ms;
+    int32_t  stopped;    // 1 if it went because we asked it to.
+    int32_t  unknown;    // 1 if waitid couldn't tell (reaped behind our back), exit_code / signal mean nothing.
+} Process_Exit;
+
 Process_Handle create_process_handle();
+
+#define SPAWN_METHOD_SPAWN 0 // posix_spawnp (vfork-style, doesn't copy our page tables).
+#define SPAWN_METHOD_FORK  1 // fork + execvp.
+void process_set_spawn_method(Process_Handle *handle, int32_t method);
 char *separate_command_to_executable_and_args(const char *in, char *out_arg_list[], size_t arg_capacity);
 
 int32_t start_process(const char *command, Process_Handle *handle, Logger *logger);
 int32_t restart_process(const char *command, Process_Handle *handle, Logger *logger);
-void terminate_process(Process_Handle *handle); // try to terminate the process whether it's alive or not.
+void terminate_process(Process_Handle *handle); // try to terminate the process whether it's alive or not. blocks until it's gone.
+
+// Stopping without blocking: stop signal first, SIGKILL once the timeout is over.
+int32_t  process_set_stop_signal(Process_Handle *handle, const char *signal_name, uint32_t timeout_ms); // "TERM", "SIGINT", "15"... 0 if unknown.
+void     request_process_stop(Process_Handle *handle);  // no-op if it's stopping already.
+int32_t  process_is_stopping(Process_Handle *handle);
+uint64_t process_stop_deadline(Process_Handle *handle); // when update_process_stop will SIGKILL. 0 if it won't.
+void     update_process_stop(Process_Handle *handle, uint64_t now_ms);
 
-int  is_process_running(Process_Handle *handle);
+// Listening sockets we hold on to across restarts. every child gets them as fds 3, 4, ... with
+// LISTEN_FDS / LISTEN_PID set, the way systemd socket activation does it.
+#define LISTEN_MAX 16
+int32_t open_listen_sockets(const char *addresses, int *fds, int32_t capacity, Logger *logger); // count, -1 if any of them failed.
+void    close_listen_sockets(int *fds, int32_t count);
+void    process_set_listen_fds(Process_Handle *handle, const int *fds, int32_t count);
+
+// Readiness gate: the child gets SUCCOTASH_READY_FD and writes anything to it once it's up.
+int32_t process_set_readiness_gate(Process_Handle *handle, int32_t enabled); // 0 if the platform can't.
+int     process_ready_fd(Process_Handle *handle);    // readable once the child said something (or is gone).
+int32_t process_check_ready(Process_Handle *handle); // 1 ready, 0 not yet, -1 never going to be.
+
+int  is_process_running(Process_Handle *handle);  // reaps the child and fills in last_exit once it's gone.
+int  process_event_fd(Process_Handle *handle);    // becomes readable when the child exits. -1 if there's nothing to wait on.
 void sleep_ms(int ms);
 
 
@@ -44,19 +170,184 @@ int create_pipe(Process_Handle *handle);
 void close_pipe(Process_Handle *handle);
 
 // ====================================
-// Threading.
-/*
-typedef struct Thread_Handle Thread_Handle;
-Thread_Handle start_stdout_thread(Process_Handle *handle, Logger *logger);
-void handle_stdout_task(void *ptr);
-*/
+// Child output.
+// One thread reads what the children write to stdout / stderr and logs it line by line, so a
+// chatty child never waits on a full pipe and never on us. every batch wakes the main loop
+// with WAKE_OUTPUT.
+
+struct Output_Reader;
+struct Log_Archive;
+Output_Reader *create_output_reader(Logger *logger, Log_Archive *archive); // archive may be NULL. NULL if it can't, children keep our stdout then.
+void           destroy_output_reader(Output_Reader *reader);
+int            output_reader_wake_fd(Output_Reader *reader);
+// Every byte the children write also goes to directory/<tag>.log, moved there in the kernel.
+// rotated once it's max_bytes big or max_age_s old (0 = never), older ones stay around as .1, .2... up to keep.
+int32_t        output_reader_set_sink(Output_Reader *reader, const char *directory, uint64_t max_bytes, uint32_t max_age_s, int32_t keep);
+void           output_reader_add(Output_Reader *reader, int out_fd, int err_fd, const char *tag, int32_t pid, int32_t binding, uint32_t generation); // takes both over.
+void           process_set_output_reader(Process_Handle *handle, Output_Reader *reader, const char *tag); // tag goes in front of every line.
+void           process_set_generation(Process_Handle *handle, int32_t binding, uint32_t generation); // goes with its output from the next start on.
+
+// ====================================
+// Log archive (archive.cpp).
+// Every run's output block compressed into DIR/output.lza, with an index of fixed-size entries
+// in DIR/output.lzi to find a run's blocks by. a run is one generation of one binding, and their
+// numbers count up across our own restarts as well.
+
+#define ARCHIVE_BLOCK_SIZE    (64 * 1024)
+#define ARCHIVE_IDLE_FLUSH_MS 1000 // a run that went quiet gets its partial block written after this long.
+
+typedef struct {
+    uint32_t run;          // counts up across everything the archive ever got.
+    int32_t  binding;      // index in the bindings, 0 is the primary command.
+    uint32_t generation;   // of the binding, see process_set_generation.
+    int32_t  pid;          // of the run's first process.
+    uint64_t started_ns;   // wall clock, unix epoch.
+    uint64_t data_offset;  // of the block in output.lza.
+    uint64_t raw_offset;   // of its first byte in everything the run wrote.
+    uint32_t raw_size;
+    uint32_t stored_size;  // == raw_size: didn't compress, it's there as is.
+} Archive_Entry;
+
+struct Log_Archive;
+struct Archive_Run;
+Log_Archive *open_log_archive(const char *directory, Logger *logger); // NULL if it can't.
+void         close_log_archive(Log_Archive *archive);
+// the rest is for one thread only (the output thread).
+Archive_Run *archive_begin_run(Log_Archive *archive, int32_t binding, uint32_t generation, int32_t pid); // ends once per begin.
+void         archive_append(Log_Archive *archive, Archive_Run *run, const char *data, size_t size, uint64_t now_ms);
+void         archive_flush_idle_run(Log_Archive *archive, Archive_Run *run, uint64_t now_ms);
+Archive_Run *archive_share_run(Archive_Run *run); // one more stream writing to it, it needs one more end.
+void         archive_end_run(Log_Archive *archive, Archive_Run *run); // frees run once the last writer ended it.
+
+typedef struct {
+    const uint8_t       *data;
+    size_t               data_size;
+    const Archive_Entry *entries;
+    size_t               index_size;
+    size_t               entry_count;
+} Archive_Reader;
+
+int32_t open_archive_reader(Archive_Reader *reader, const char *directory); // maps both files.
+void    close_archive_reader(Archive_Reader *reader);
+int32_t archive_read_block(Archive_Reader *reader, const Archive_Entry *entry, uint8_t *out); // out holds ARCHIVE_BLOCK_SIZE.
+int32_t archive_read_run(Archive_Reader *reader, uint32_t run, void (*emit)(void *context, const uint8_t *data, size_t size), void *context);
+
+int32_t lz4_compress(const uint8_t *src, int32_t size, uint8_t *dst, int32_t capacity, uint32_t *hash_table);
+int32_t lz4_decompress(const uint8_t *src, int32_t size, uint8_t *dst, int32_t capacity);
+
+// ====================================
+// Log search (search.cpp).
+// Trigram index over log records, kept up to date as they come in. the newest records are in
+// memory, older ones get spilled to a directory (up to SEARCH_SPILL_SEGMENTS worth, without one
+// only SEARCH_MEMORY_SEGMENTS worth of them are kept). ASCII case insensitive.
+// one thread at a time: the GUI feeds it from its own thread and searches under the same lock.
+
+#define SEARCH_SEGMENT_RECORDS (64 * 1024)
+#define SEARCH_MEMORY_SEGMENTS 16
+#define SEARCH_SPILL_SEGMENTS  1024 // 64M records.
+
+typedef struct {
+    uint64_t    number; // record number.
+    const char *text;   // good until the next search_index_add.
+} Search_Hit;
+
+// 0 = leave the record out of the hits. it doesn't count against capacity then.
+typedef int32_t (*Search_Keep)(void *context, uint64_t number);
+
+struct Search_Index;
+Search_Index *create_search_index(const char *spill_directory, Logger *logger); // directory can be NULL.
+void          destroy_search_index(Search_Index *index);
+void          search_index_add(Search_Index *index, uint64_t number, const char *text, size_t length); // numbers in order.
+size_t        search_index_find(Search_Index *index, const char *query, Search_Keep keep, void *context, Search_Hit *hits, size_t capacity); // newest first, keep can be NULL.
+uint64_t      search_index_first(Search_Index *index);
+const char   *search_index_record(Search_Index *index, uint64_t number, uint32_t *out_length); // NULL if it doesn't have it, good until the next add.
 
 // ====================================
 // Files.
 
+void *map_file(const char *path, size_t *out_size); // read only. NULL if it can't (or it's empty).
+void  unmap_file(void *data, size_t size);
+int32_t make_directory(const char *path); // 1 if it's there now, whoever made it.
+int32_t list_directory(const char *path, void (*visit)(void *context, const char *name), void *context); // 0 if it can't be read.
+
 uint64_t find_latest_modified_time(Logger *logger, char *path);
 int32_t select_new_folder(char *folder_buffer, size_t folder_buffer_size);
 int32_t select_file(char *file_buffer, size_t file_buffer_size);
 int32_t to_full_paths(char *path_buffer, size_t path_buffer_size);
+int32_t resolve_directory(char *path_buffer, size_t path_buffer_size); // absolute, no symlinks or "..". 0 if it's not there.
+
+// ====================================
+// Ignore rules.
+
+struct Ignore_Rules;
+Ignore_Rules create_ignore_rules();
+void    destroy_ignore_rules(Ignore_Rules *rules);
+void    ignore_rules_add(Ignore_Rules *rules, const char *pattern); // one .gitignore line.
+void    ignore_rules_add_list(Ignore_Rules *rules, const char *text, const char *delimiters);
+void    ignore_rules_add_below(Ignore_Rules *rules, const char *base, const char *pattern); // from base/.gitignore, base relative to the root.
+int32_t ignore_rules_load_file(Ignore_Rules *rules, const char *path, const char *base);
+int32_t ignore_rules_match(Ignore_Rules *rules, const char *relative_path, const char *name, int32_t is_dir);
+int32_t ignore_rules_match_child(Ignore_Rules *rules, const char *parent_path, const char *name, int32_t is_dir);
+int32_t ignore_rules_need_paths(Ignore_Rules *rules);
+
+// Relative paths of the entries of one directory: the directory's part gets put together once,
+// each entry only copies its name in behind it.
+typedef struct {
+    char    path[4096];
+    size_t  parent_length; // with the '/', 0 for the root.
+    int32_t fits;
+} Ignore_Path;
+void    ignore_path_set_parent(Ignore_Path *path, const char *parent_path); // "" for the root.
+int32_t ignore_rules_match_in(Ignore_Rules *rules, Ignore_Path *path, const char *name, int32_t is_dir);
+
+// ====================================
+// Snapshot.
+
+#define SCAN_BACKEND_SYNC  0 // getdents64 + statx, over scan threads if there's more than one.
+#define SCAN_BACKEND_URING 1 // batched statx over io_uring, falls back to SYNC when the kernel can't.
+
+struct File_Snapshot;
+File_Snapshot create_snapshot();
+void    destroy_snapshot(File_Snapshot *snapshot);
+// the setters return 0 if the platform can't do what's asked, nothing changes then (windows).
+int32_t snapshot_set_scan_threads(File_Snapshot *snapshot, int32_t thread_count); // 0 = one per core.
+int32_t snapshot_set_scan_backend(File_Snapshot *snapshot, int32_t backend);
+void    snapshot_set_ignore_rules(File_Snapshot *snapshot, Ignore_Rules *rules); // rules stay owned by the caller.
+int32_t snapshot_set_content_hashing(File_Snapshot *snapshot, int32_t enabled);   // only count files whose content changed.
+int32_t snapshot_build(File_Snapshot *snapshot, Logger *logger, const char *root);
+int32_t snapshot_refresh(File_Snapshot *snapshot, Logger *logger); // returns 0 if root is gone.
+void    snapshot_refresh_directories(File_Snapshot *snapshot, Logger *logger, const char **dirpaths, size_t dirpath_count);
+int32_t snapshot_path(File_Snapshot *snapshot, int32_t index, char *buffer, size_t buffer_size);
+
+// ====================================
+// Watching.
+
+struct Watch_Handle;
+Watch_Handle create_watch_handle();
+void    watch_set_ignore_rules(Watch_Handle *watch, Ignore_Rules *rules); // takes effect on next start_watching.
+int32_t start_watching(Watch_Handle *watch, Logger *logger, const char *path);
+int32_t poll_watch_changes(Watch_Handle *watch, Logger *logger); // non-blocking. returns amount of changes since last call.
+size_t  take_watch_dirty_paths(Watch_Handle *watch, const char **out_paths, size_t out_capacity);
+void    stop_watching(Watch_Handle *watch);
+int     watch_event_fd(Watch_Handle *watch); // -1 if there's nothing to wait on. changes whenever start_count does.
+
+// ====================================
+// Event loop.
+// Main loop sleeps in here until one of the registered fds has something, a child exits,
+// a signal arrives or the timeout runs out.
+
+#define WAKE_TIMEOUT 0x0
+#define WAKE_WATCH   0x1  // file watch has events.
+#define WAKE_CHILD   0x2  // some child exited.
+#define WAKE_WINDOW  0x4  // window system has input for us.
+#define WAKE_OUTPUT  0x8  // child wrote something.
+#define WAKE_SIGNAL  0x10 // interrupted, check platform_app_should_close().
+#define WAKE_READY   0x20 // a standby child passed its readiness gate.
+
+struct Event_Loop;
+Event_Loop create_event_loop(Logger *logger);
+void     destroy_event_loop(Event_Loop *loop);
+int32_t  event_loop_watch_fd(Event_Loop *loop, int fd, uint32_t wake_reason);
+uint32_t event_loop_wait(Event_Loop *loop, int32_t timeout_ms); // -1 waits forever. returns WAKE_* bits.
 
 #endif
@@ -0,0 +1,462 @@
+// ====================================
+// Log search.
+//
+// Trigram index over log records, by record number. the newest records go into a segment that
+// keeps growing: every trigram has a list of the records it's in, and the text gets copied in
+// (the log ring forgets it long before the index does). every SEARCH_SEGMENT_RECORDS records the
+// segment gets frozen into one block sorted by trigram, which goes to disk when there's a
+// directory for it and stays in memory otherwise. spilled files are named after our pid, so
+// whatever a run that died left behind gets cleaned up by the next one.
+//
+// A query looks up the trigrams of what's searched for in every segment, walks the shortest list
+// and checks the others by binary search, then looks at the text of whatever is left. ASCII
+// case insensitive, anything shorter than a trigram is a plain scan.
+
+#include <errno.h>
+#include "main.h"
+
+#define SEARCH_MAGIC 0x31495253 // "SRI1"
+
+typedef struct {
+    uint32_t  key;   // 3 lowercased bytes | 1 << 24, 0 = empty slot.
+    uint32_t  count;
+    uint32_t  capacity;
+    uint32_t *records; // relative to the segment's first record, ascending.
+} Trigram_List;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t record_count;
+    uint64_t record_base;
+    uint32_t trigram_count;
+    uint32_t text_size;
+    uint32_t postings_offset; // uint32_t records, one run per trigram.
+    uint32_t offsets_offset;  // record_count + 1 uint32_t offsets into the text.
+    uint32_t text_offset;
+    uint32_t size;
+} Frozen_Header;
+
+typedef struct {
+    uint32_t key;
+    uint32_t first; // into the postings.
+    uint32_t count;
+} Frozen_Trigram;   // sorted by key, right after the header.
+
+typedef struct {
+    uint8_t *data;
+    size_t   size;
+    int32_t  mapped;    // data is map_file's, path is where.
+    char     path[640];
+} Frozen_Segment;
+
+struct Search_Index {
+    Logger  *logger;
+    char     directory[512]; // empty = frozen segments stay in memory.
+    uint32_t pid;            // the two name the spilled files, so two of us can share a directory.
+    uint64_t session;
+    uint32_t spill_count;
+
+    // growing segment.
+    uint64_t      record_base;
+    uint32_t      record_count;
+    uint32_t      offsets[SEARCH_SEGMENT_RECORDS + 1];
+    char         *text;
+    size_t        text_size;
+    size_t        text_capacity;
+    Trigram_List *table;
+    uint32_t      table_capacity; // power of two.
+    uint32_t      trigram_count;
+
+    Frozen_Segment *frozen; // oldest first.
+    size_t          frozen_count;
+    size_t          frozen_capacity;
+};
+
+char fold_case(char c) {
+    return (c >= 'A' && c <= 'Z') ? (char)(c - 'A' + 'a') : c;
+}
+
+uint32_t trigram_key(const char *text) {
+    return (1u << 24) | ((uint32_t)(uint8_t)fold_case(text[0]) << 16) | ((uint32_t)(uint8_t)fold_case(text[1]) << 8) | (uint32_t)(uint8_t)fold_case(text[2]);
+}
+
+uint32_t trigram_slot(uint32_t key, uint32_t capacity) {
+    return (key * 2654435761u) & (capacity - 1);
+}
+
+// needle is lowercase already.
+int32_t contains_folded(const char *text, size_t text_length, const char *needle, size_t needle_length) {
+    if (needle_length > text_length) return 0;
+    for (size_t i = 0; i + needle_length <= text_length; ++i) {
+        size_t j = 0;
+        while (j < needle_length && fold_case(text[i + j]) == needle[j]) j++;
+        if (j == needle_length) return 1;
+    }
+    return 0;
+}
+
+// ====================================
+// Growing segment.
+
+Trigram_List *find_trigram(Search_Index *index, uint32_t key) {
+    uint32_t slot = trigram_slot(key, index->table_capacity);
+    while (index->table[slot].key && index->table[slot].key != key) slot = (slot + 1) & (index->table_capacity - 1);
+    return &index->table[slot];
+}
+
+void grow_trigram_table(Search_Index *index) {
+    Trigram_List *old = index->table;
+    uint32_t old_capacity = index->table_capacity;
+
+    index->table_capacity = old_capacity ? old_capacity * 2 : 4096;
+    index->table = (Trigram_List *)calloc(index->table_capacity, sizeof(Trigram_List));
+    assert(index->table && "calloc failed");
+    for (uint32_t i = 0; i < old_capacity; ++i) {
+        if (old[i].key) *find_trigram(index, old[i].key) = old[i];
+    }
+    free(old);
+}
+
+void reset_growing_segment(Search_Index *index) {
+    for (uint32_t i = 0; i < index->table_capacity; ++i) free(index->table[i].records);
+    memset(index->table, 0, index->table_capacity * sizeof(Trigram_List));
+    index->trigram_count = 0;
+    index->record_base  += index->record_count;
+    index->record_count  = 0;
+    index->text_size     = 0;
+    index->offsets[0]    = 0;
+}
+
+int compare_trigram_lists(const void *a, const void *b) {
+    uint32_t x = (*(const Trigram_List **)a)->key, y = (*(const Trigram_List **)b)->key;
+    return (x > y) - (x < y);
+}
+
+void release_frozen_segment(Frozen_Segment *segment) {
+    if (segment->mapped) {
+        unmap_file(segment->data, segment->size);
+        remove(segment->path);
+    } else {
+        free(segment->data);
+    }
+}
+
+void add_frozen_segment(Search_Index *index, Frozen_Segment segment) {
+    size_t limit = index->directory[0] ? SEARCH_SPILL_SEGMENTS : SEARCH_MEMORY_SEGMENTS;
+    if (index->frozen_count == limit) {
+        release_frozen_segment(&index->frozen[0]);
+        memmove(index->frozen, index->frozen + 1, (index->frozen_count - 1) * sizeof(Frozen_Segment));
+        index->frozen_count--;
+    }
+    if (index->frozen_count == index->frozen_capacity) {
+        index->frozen_capacity = index->frozen_capacity ? index->frozen_capacity * 2 : 16;
+        index->frozen = (Frozen_Segment *)realloc(index->frozen, index->frozen_capacity * sizeof(Frozen_Segment));
+        assert(index->frozen && "realloc failed");
+    }
+    index->frozen[index->frozen_count++] = segment;
+}
+
+// The growing segment as one block sorted by trigram, then to disk if there's a directory.
+void freeze_segment(Search_Index *index) {
+    if (index->record_count == 0) return;
+
+    Trigram_List **lists = (Trigram_List **)malloc((index->trigram_count + 1) * sizeof(Trigram_List *));
+    assert(lists && "malloc failed");
+    uint32_t list_count = 0;
+    uint64_t posting_count = 0;
+    for (uint32_t i = 0; i < index->table_capacity; ++i) {
+        if (!index->table[i].key) continue;
+        lists[list_count++] = &index->table[i];
+        posting_count += index->table[i].count;
+    }
+    qsort(lists, list_count, sizeof(Trigram_List *), compare_trigram_lists);
+
+    Frozen_Header header = {0};
+    header.magic           = SEARCH_MAGIC;
+    header.record_count    = index->record_count;
+    header.record_base     = index->record_base;
+    header.trigram_count   = list_count;
+    header.text_size       = (uint32_t)index->text_size;
+    header.postings_offset = (uint32_t)(sizeof(Frozen_Header) + list_count * sizeof(Frozen_Trigram));
+    header.offsets_offset  = (uint32_t)(header.postings_offset + posting_count * sizeof(uint32_t));
+    header.text_offset     = (uint32_t)(header.offsets_offset + (index->record_count + 1) * sizeof(uint32_t));
+    header.size            = (uint32_t)(header.text_offset + index->text_size);
+
+    uint8_t *data = (uint8_t *)malloc(header.size);
+    assert(data && "malloc failed");
+    memcpy(data, &header, sizeof(header));
+    Frozen_Trigram *trigrams = (Frozen_Trigram *)(data + sizeof(Frozen_Header));
+    uint32_t       *postings = (uint32_t *)(data + header.postings_offset);
+    uint32_t first = 0;
+    for (uint32_t i = 0; i < list_count; ++i) {
+        trigrams[i].key   = lists[i]->key;
+        trigrams[i].first = first;
+        trigrams[i].count = lists[i]->count;
+        memcpy(postings + first, lists[i]->records, lists[i]->count * sizeof(uint32_t));
+        first += lists[i]->count;
+    }
+    memcpy(data + header.offsets_offset, index->offsets, (index->record_count + 1) * sizeof(uint32_t));
+    memcpy(data + header.text_offset, index->text, index->text_size);
+    free(lists);
+
+    Frozen_Segment segment = {0};
+    segment.data = data;
+    segment.size = header.size;
+    if (index->directory[0]) {
+        snprintf(segment.path, sizeof(segment.path), "%s/search-%u-%llu-%u.tri", index->directory, index->pid,
+                 (unsigned long long)index->session, index->spill_count++);
+        FILE *file = fopen(segment.path, "wb");
+        int32_t written = file && fwrite(data, 1, header.size, file) == header.size;
+        if (file) fclose(file);
+
+        size_t mapped_size = 0;
+        uint8_t *mapped = written ? (uint8_t *)map_file(segment.path, &mapped_size) : NULL;
+        if (mapped && mapped_size == header.size) {
+            free(data);
+            segment.data   = mapped;
+            segment.mapped = 1;
+        } else {
+            // stays in memory then, better than losing it.
+            watcher_log(index->logger, "failed to spill the search index to %s: %s", segment.path, strerror(errno));
+            if (mapped) unmap_file(mapped, mapped_size);
+            remove(segment.path);
+        }
+    }
+    add_frozen_segment(index, segment);
+    reset_growing_segment(index);
+}
+
+// A file some earlier run of ours spilled and never got to remove: its pid is gone, or it's
+// ours now and the session isn't.
+void remove_stale_search_file(void *context, const char *name) {
+    Search_Index *index = (Search_Index *)context;
+    unsigned pid = 0, count = 0;
+    unsigned long long session = 0;
+    if (sscanf(name, "search-%u-%llu-%u.tri", &pid, &session, &count) != 3) return;
+    if (pid == index->pid ? session == index->session : platform_process_alive(pid)) return;
+
+    char path[640];
+    snprintf(path, sizeof(path), "%s/%s", index->directory, name);
+    remove(path);
+}
+
+Search_Index *create_search_index(const char *spill_directory, Logger *logger) {
+    Search_Index *index = (Search_Index *)malloc(sizeof(Search_Index));
+    assert(index && "malloc failed");
+    memset(index, 0, sizeof(*index));
+    index->logger = logger;
+    if (spill_directory && spill_directory[0]) {
+        if (make_directory(spill_directory)) snprintf(index->directory, sizeof(index->directory), "%s", spill_directory);
+        else watcher_log(logger, "failed to create %s, the search index stays in memory: %s", spill_directory, strerror(errno));
+    }
+    index->pid     = platform_process_id();
+    index->session = platform_monotonic_ms();
+    if (index->directory[0]) list_directory(index->directory, remove_stale_search_file, index);
+    grow_trigram_table(index);
+    return index;
+}
+
+// The spilled files are a cache, they go with us.
+void destroy_search_index(Search_Index *index) {
+    if (!index) return;
+    for (size_t i = 0; i < index->frozen_count; ++i) release_frozen_segment(&index->frozen[i]);
+    for (uint32_t i = 0; i < index->table_capacity; ++i) free(index->table[i].records);
+    free(index->table);
+    free(index->frozen);
+    free(index->text);
+    free(index);
+}
+
+// number has to be the one after the last one added (the first one can be anything).
+void search_index_add(Search_Index *index, uint64_t number, const char *text, size_t length) {
+    if (index->record_count == 0 && index->text_size == 0) index->record_base = number;
+    if (index->record_count == SEARCH_SEGMENT_RECORDS || index->text_size + length + 1 > UINT32_MAX / 2) {
+        freeze_segment(index);
+        index->record_base = number;
+    }
+
+    if (index->text_size + length + 1 > index->text_capacity) {
+        index->text_capacity = (index->text_capacity ? index->text_capacity * 2 : 1 << 20) + length;
+        index->text = (char *)realloc(index->text, index->text_capacity);
+        assert(index->text && "realloc failed");
+    }
+    memcpy(index->text + index->text_size, text, length);
+    index->text[index->text_size + length] = 0;
+    index->text_size += length + 1;
+
+    uint32_t record = index->record_count++;
+    index->offsets[index->record_count] = (uint32_t)index->text_size;
+
+    for (size_t i = 0; i + 3 <= length; ++i) {
+        Trigram_List *list = find_trigram(index, trigram_key(text + i));
+        // the same trigram twice in a line: it's in there already.
+        if (list->key && list->records[list->count - 1] == record) continue;
+
+        if (!list->key) {
+            if ((index->trigram_count + 1) * 2 > index->table_capacity) {
+                grow_trigram_table(index);
+                list = find_trigram(index, trigram_key(text + i));
+            }
+            list->key = trigram_key(text + i);
+            index->trigram_count++;
+        }
+        if (list->count == list->capacity) {
+            list->capacity = list->capacity ? list->capacity * 2 : 4;
+            list->records  = (uint32_t *)realloc(list->records, list->capacity * sizeof(uint32_t));
+            assert(list->records && "realloc failed");
+        }
+        list->records[list->count++] = record;
+    }
+}
+
+// Oldest record it still has. everything from there up to the last one added is in.
+uint64_t search_index_first(Search_Index *index) {
+    if (index->frozen_count) return ((const Frozen_Header *)index->frozen[0].data)->record_base;
+    return index->record_base;
+}
+
+// Its own copy, so it's there long after the log ring dropped it.
+const char *search_index_record(Search_Index *index, uint64_t number, uint32_t *out_length) {
+    const uint32_t *offsets = NULL;
+    const char *text = NULL;
+    uint64_t relative = 0;
+    if (number >= index->record_base && number - index->record_base < index->record_count) {
+        offsets  = index->offsets;
+        text     = index->text;
+        relative = number - index->record_base;
+    } else {
+        // last segment starting at or before it.
+        size_t low = 0, high = index->frozen_count;
+        while (low < high) {
+            size_t middle = low + (high - low) / 2;
+            if (((const Frozen_Header *)index->frozen[middle].data)->record_base <= number) low = middle + 1;
+            else                                                                           high = middle;
+        }
+        if (low == 0) return NULL;
+        const uint8_t *data = index->frozen[low - 1].data;
+        const Frozen_Header *header = (const Frozen_Header *)data;
+        if (number - header->record_base >= header->record_count) return NULL;
+        offsets  = (const uint32_t *)(data + header->offsets_offset);
+        text     = (const char *)(data + header->text_offset);
+        relative = number - header->record_base;
+    }
+    if (out_length) *out_length = offsets[relative + 1] - offsets[relative] - 1;
+    return text + offsets[relative];
+}
+
+// ====================================
+// Searching.
+
+typedef struct {
+    const uint32_t *records;
+    uint32_t        count;
+} Posting_List;
+
+typedef struct {
+    uint64_t        record_base;
+    uint32_t        record_count;
+    const uint32_t *offsets;
+    const char     *text;
+} Segment_View;
+
+int32_t posting_contains(Posting_List *list, uint32_t record) {
+    uint32_t low = 0, high = list->count;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (list->records[middle] < record) low = middle + 1;
+        else                                high = middle;
+    }
+    return low < list->count && list->records[low] == record;
+}
+
+int compare_posting_lists(const void *a, const void *b) {
+    uint32_t x = ((const Posting_List *)a)->count, y = ((const Posting_List *)b)->count;
+    return (x > y) - (x < y);
+}
+
+// Hits in one segment, newest first. lists == NULL: no trigrams to go by, every record is a candidate.
+size_t search_segment(Segment_View *view, Posting_List *lists, size_t list_count, const char *needle, size_t needle_length,
+                      Search_Keep keep, void *context, Search_Hit *hits, size_t capacity) {
+    size_t found = 0;
+    if (lists) qsort(lists, list_count, sizeof(Posting_List), compare_posting_lists);
+
+    uint32_t candidate_count = lists ? lists[0].count : view->record_count;
+    for (uint32_t c = candidate_count; c-- > 0 && found < capacity;) {
+        uint32_t record = lists ? lists[0].records[c] : c;
+        int32_t in_all = 1;
+        for (size_t l = 1; l < list_count && in_all; ++l) in_all = posting_contains(&lists[l], record);
+        if (!in_all) continue;
+        if (keep && !keep(context, view->record_base + record)) continue;
+
+        const char *text = view->text + view->offsets[record];
+        size_t length = view->offsets[record + 1] - view->offsets[record] - 1;
+        if (!contains_folded(text, length, needle, needle_length)) continue;
+
+        hits[found].number = view->record_base + record;
+        hits[found].text   = text;
+        found++;
+    }
+    return found;
+}
+
+size_t search_index_find(Search_Index *index, const char *query, Search_Keep keep, void *context, Search_Hit *hits, size_t capacity) {
+    char needle[256];
+    size_t needle_length = strlen(query);
+    if (needle_length == 0) return 0;
+    if (needle_length > sizeof(needle) - 1) needle_length = sizeof(needle) - 1;
+    for (size_t i = 0; i < needle_length; ++i) needle[i] = fold_case(query[i]);
+    needle[needle_length] = 0;
+
+    // a trigram that shows up twice in the query only has to be looked up once.
+    uint32_t keys[256];
+    size_t key_count = 0;
+    for (size_t i = 0; i + 3 <= needle_length; ++i) {
+        uint32_t key = trigram_key(needle + i);
+        size_t k = 0;
+        while (k < key_count && keys[k] != key) k++;
+        if (k == key_count) keys[key_count++] = key;
+    }
+    Posting_List lists[256];
+    size_t found = 0;
+
+    // growing segment first, it has the newest records.
+    Segment_View view = { index->record_base, index->record_count, index->offsets, index->text };
+    int32_t possible = 1;
+    for (size_t k = 0; k < key_count && possible; ++k) {
+        Trigram_List *list = find_trigram(index, keys[k]);
+        lists[k].records = list->records;
+        lists[k].count   = list->count;
+        possible = list->key != 0;
+    }
+    if (possible && index->record_count > 0) {
+        found += search_segment(&view, key_count ? lists : NULL, key_count, needle, needle_length, keep, context, hits + found, capacity - found);
+    }
+
+    for (size_t s = index->frozen_count; s-- > 0 && found < capacity;) {
+        const uint8_t *data = index->frozen[s].data;
+        const Frozen_Header *header = (const Frozen_Header *)data;
+        const Frozen_Trigram *trigrams = (const Frozen_Trigram *)(data + sizeof(Frozen_Header));
+        const uint32_t *postings = (const uint32_t *)(data + header->postings_offset);
+
+        possible = 1;
+        for (size_t k = 0; k < key_count && possible; ++k) {
+            uint32_t low = 0, high = header->trigram_count;
+            while (low < high) {
+                uint32_t middle = low + (high - low) / 2;
+                if (trigrams[middle].key < keys[k]) low = middle + 1;
+                else                                high = middle;
+            }
+            possible = low < header->trigram_count && trigrams[low].key == keys[k];
+            if (possible) {
+                lists[k].records = postings + trigrams[low].first;
+                lists[k].count   = trigrams[low].count;
+            }
+        }
+        if (!possible) continue;
+
+        Segment_View frozen_view = { header->record_base, header->record_count,
+                                     (const uint32_t *)(data + header->offsets_offset), (const char *)(data + header->text_offset) };
+        found += search_segment(&frozen_view, key_count ? lists : NULL, key_count, needle, needle_length, keep, context, hits + found, capacity - found);
+    }
+    return found;
+}
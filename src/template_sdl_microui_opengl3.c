@@ -269,6 +269,9 @@ static int buf_idx;
 
 static SDL_Window *window;
 
+SDL_Window *r_get_window(void) {
+    return window;
+}
 
 void r_init(void) {
     /* init SDL window */
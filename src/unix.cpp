@@ -4,21 +4,64 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <stdio.h>
+#include <ctype.h>
 #include <errno.h>
 #include <dirent.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <spawn.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <linux/io_uring.h>
+#include <sched.h>
+#include <time.h>
+#include <atomic>
 
 #include "main.h"
 
 struct Process_Handle {
     int32_t valid; // todo: unused
     pid_t child_pid;
-    int reading_pipe[2];
+    int reading_pipe[2]; // child's stdout.
+    int error_pipe[2];   // child's stderr.
+
+    int          pidfd;      // readable once child_pid exits. -1 on kernels without pidfd_open (< 5.3).
+    uint64_t     started_ms;
+    Process_Exit last_exit;
+
+    int32_t      spawn_method; // SPAWN_METHOD_*
+
+    int32_t      stop_signal;      // what the child gets first when we stop it.
+    uint32_t     stop_timeout_ms;  // how long it gets to go away on its own before SIGKILL.
+    int32_t      stopping;
+    int32_t      kill_sent;
+    uint64_t     stop_requested_ms;
+
+    int32_t      ready_gate; // child gets SUCCOTASH_READY_FD and tells us when it can take over.
+    int          ready_fd;   // our end of that, -1 once it said so (or can't anymore).
+
+    int          listen_fds[LISTEN_MAX]; // ours, the child gets them as 3, 4, ... (LISTEN_FDS).
+    int32_t      listen_count;
+
+    Output_Reader *output;         // reads the child's stdout / stderr. NULL = they're ours.
+    char           output_tag[64]; // in front of every line of it.
+    int32_t        binding;        // whose output it is, for the archive.
+    uint32_t       generation;     // goes with every line of it, see process_set_generation.
 };
 
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
 volatile sig_atomic_t force_stop = 0;
 
 void handle_signal(int signal) {
@@ -53,10 +96,31 @@ void platform_init() {
 Process_Handle create_process_handle() {
     Process_Handle handle = {0};
     handle.child_pid = -1;
+    handle.pidfd     = -1;
+    handle.reading_pipe[0] = handle.reading_pipe[1] = -1;
+    handle.error_pipe[0]   = handle.error_pipe[1]   = -1;
     handle.valid     = 1;
+    handle.spawn_method = SPAWN_METHOD_SPAWN;
+    handle.stop_signal     = SIGTERM;
+    handle.stop_timeout_ms = 5000;
+    handle.ready_fd        = -1;
     return handle;
 }
 
+void process_set_spawn_method(Process_Handle *handle, int32_t method) {
+    handle->spawn_method = method;
+}
+
+void process_set_output_reader(Process_Handle *handle, Output_Reader *reader, const char *tag) {
+    handle->output = reader;
+    snprintf(handle->output_tag, sizeof(handle->output_tag), "%s", tag ? tag : "");
+}
+
+void process_set_generation(Process_Handle *handle, int32_t binding, uint32_t generation) {
+    handle->binding    = binding;
+    handle->generation = generation;
+}
+
 void destroy_handle(Process_Handle *handle) {
     terminate_process(handle);
     close_pipe(handle);
@@ -80,14 +144,172 @@ char *separate_command_to_executable_and_args(const char *in, char **out_arg_lis
     return executable_command;
 }
 
-int32_t start_process(const char *command, Process_Handle *handle, Logger *logger) {
-    // Create Argument list.  if (!create_pipe(handle)) {
-    //     watcher_log(logger, "Failed to create a pipe.");
-    //     return 0;
-    // }
+// ====================================
+// Readiness gate.
+//
+// The child finds the write end of a pipe in SUCCOTASH_READY_FD and writes anything to it
+// ("READY=1\n" say) once it's done with its startup. EOF before that means it never will.
 
-    char *arg_list[32] = {0};
-    char *exec_command = separate_command_to_executable_and_args(command, arg_list, 32);
+int32_t process_set_readiness_gate(Process_Handle *handle, int32_t enabled) {
+    handle->ready_gate = enabled;
+    return 1;
+}
+
+void close_ready_pipe(Process_Handle *handle) {
+    if (handle->ready_fd != -1) close(handle->ready_fd);
+    handle->ready_fd = -1;
+}
+
+// returns the write end, which is the only one the child inherits.
+// kept at min_fd or above, below that is where the listening sockets go.
+int open_ready_pipe(Process_Handle *handle, int min_fd) {
+    close_ready_pipe(handle);
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC | O_NONBLOCK) == -1) return -1;
+    if (fds[1] < min_fd) {
+        int moved = fcntl(fds[1], F_DUPFD_CLOEXEC, min_fd);
+        close(fds[1]);
+        if (moved == -1) {
+            close(fds[0]);
+            return -1;
+        }
+        fds[1] = moved;
+    }
+    int write_flags = fcntl(fds[1], F_GETFL);
+    fcntl(fds[1], F_SETFL, write_flags & ~O_NONBLOCK);
+    fcntl(fds[1], F_SETFD, 0);
+
+    handle->ready_fd = fds[0];
+    return fds[1];
+}
+
+int32_t has_variable_name(const char *variable, const char *name) {
+    size_t length = strlen(name);
+    return strncmp(variable, name, length) == 0 && variable[length] == '=';
+}
+
+// environ plus SUCCOTASH_READY_FD (ready_fd != -1) and LISTEN_FDS/LISTEN_PID (listening sockets),
+// in one allocation. one free() does it. LISTEN_PID is left blank for the child to fill into *pid_slot.
+char **build_child_environment(Process_Handle *handle, int ready_fd, char **pid_slot) {
+    const char *ours[] = { "SUCCOTASH_READY_FD", "LISTEN_FDS", "LISTEN_PID", "LISTEN_FDNAMES" };
+    const size_t variable_size = 32;
+    size_t count = 0;
+    while (environ[count]) count++;
+
+    char **environment = (char **)malloc(sizeof(char *) * (count + 4) + variable_size * 3);
+    assert(environment && "failed to allocate");
+    char *variables = (char *)(environment + count + 4);
+
+    size_t used = 0;
+    for (size_t i = 0; i < count; ++i) {
+        // ours win over the ones we got from a succotash (or systemd) above us.
+        int32_t skip = 0;
+        for (size_t j = 0; j < sizeof(ours) / sizeof(ours[0]); ++j) skip |= has_variable_name(environ[i], ours[j]);
+        if (!skip) environment[used++] = environ[i];
+    }
+
+    if (ready_fd != -1) {
+        snprintf(variables, variable_size, "SUCCOTASH_READY_FD=%d", ready_fd);
+        environment[used++] = variables;
+        variables += variable_size;
+    }
+    if (handle->listen_count > 0) {
+        snprintf(variables, variable_size, "LISTEN_FDS=%d", handle->listen_count);
+        environment[used++] = variables;
+        variables += variable_size;
+
+        snprintf(variables, variable_size, "LISTEN_PID=");
+        environment[used++] = variables;
+        *pid_slot = variables + strlen(variables);
+    }
+    environment[used] = NULL;
+    return environment;
+}
+
+int process_ready_fd(Process_Handle *handle) {
+    return handle->ready_fd;
+}
+
+int32_t process_check_ready(Process_Handle *handle) {
+    if (handle->ready_fd == -1) return -1;
+
+    char buffer[64];
+    ssize_t result = read(handle->ready_fd, buffer, sizeof(buffer));
+    if (result == -1 && (errno == EAGAIN || errno == EINTR)) return 0;
+
+    close_ready_pipe(handle);
+    return (result > 0) ? 1 : -1;
+}
+
+void track_started_process(Process_Handle *handle, pid_t pid, Logger *logger) {
+    handle->child_pid  = pid;
+    handle->started_ms = platform_monotonic_ms();
+
+    // pid can't be reused before we reap it, so opening the pidfd after fork/spawn is race free.
+    handle->pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+    printf("running a process: pid = %d\n", pid);
+    watcher_log_ex(logger, LOG_SOURCE_SUPERVISOR, LOG_INFO, handle->generation, "started a new process: pid = %d", handle->child_pid);
+}
+
+// posix_spawnp is clone(CLONE_VM|CLONE_VFORK) + exec in glibc, so unlike fork() none of our
+// address space (GL context, ui command list, logger) gets its page tables copied.
+// process group is set before exec too, and a missing executable comes back as an error here
+// instead of as a child that exits with 1.
+int32_t spawn_process(char *exec_command, char **arg_list, char **environment, Process_Handle *handle, Logger *logger) {
+    posix_spawnattr_t attributes;
+    posix_spawnattr_init(&attributes);
+
+    // fork path inherits these from us as well, but the child shouldn't start with anything blocked.
+    sigset_t no_signals;
+    sigemptyset(&no_signals);
+    posix_spawnattr_setsigmask(&attributes, &no_signals);
+    posix_spawnattr_setpgroup(&attributes, 0);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK);
+
+    posix_spawn_file_actions_t file_actions;
+    posix_spawn_file_actions_init(&file_actions);
+    if (handle->reading_pipe[1] != -1) {
+        posix_spawn_file_actions_adddup2(&file_actions, handle->reading_pipe[1], STDOUT_FILENO);
+        posix_spawn_file_actions_adddup2(&file_actions, handle->error_pipe[1],   STDERR_FILENO);
+    }
+
+    pid_t pid = -1;
+    int err = posix_spawnp(&pid, exec_command, &file_actions, &attributes, (char *const *)arg_list, environment);
+    posix_spawn_file_actions_destroy(&file_actions);
+    posix_spawnattr_destroy(&attributes);
+
+    if (err != 0) {
+        watcher_log_ex(logger, LOG_SOURCE_SUPERVISOR, LOG_ERROR, handle->generation, "Failed to start %s: %s", exec_command, strerror(err));
+        free(exec_command);
+        return 0;
+    }
+
+    track_started_process(handle, pid, logger);
+    free(exec_command);
+    return 1;
+}
+
+// Runs in the child between fork and exec, so only async-signal-safe calls in here.
+// listening sockets end up at 3, 4, ... and LISTEN_PID gets our pid.
+void hand_over_listen_fds(Process_Handle *handle, char *pid_slot) {
+    int32_t count = handle->listen_count;
+    int moved[LISTEN_MAX];
+    // out of the way first, one of them might sit where another one has to go.
+    for (int32_t i = 0; i < count; ++i) moved[i] = fcntl(handle->listen_fds[i], F_DUPFD_CLOEXEC, 3 + count);
+    // dup2 clears close-on-exec, the moved copies go away with the exec.
+    for (int32_t i = 0; i < count; ++i) dup2(moved[i], 3 + i);
+
+    if (pid_slot) {
+        char digits[16];
+        int32_t length = 0;
+        for (pid_t pid = getpid(); pid > 0; pid /= 10) digits[length++] = '0' + (pid % 10);
+        for (int32_t i = 0; i < length; ++i) pid_slot[i] = digits[length - 1 - i];
+        pid_slot[length] = 0;
+    }
+}
+
+int32_t fork_process(char *exec_command, char **arg_list, char **environment, char *pid_slot, Process_Handle *handle, Logger *logger) {
     pid_t pid = fork();
     int err = errno;
 
@@ -95,24 +317,26 @@ int32_t start_process(const char *command, Process_Handle *handle, Logger *logge
         case -1:
         {
             close_pipe(handle);
-            watcher_log(logger, "Failed to create a fork: %d.", err);
+            watcher_log_ex(logger, LOG_SOURCE_SUPERVISOR, LOG_ERROR, handle->generation, "Failed to create a fork: %d.", err);
             free(exec_command);
             return 0;
         } break;
 
         case 0:
         {
-            // close(handle->reading_pipe[0]);
-            // handle->reading_pipe[0] = 0;
-
-            // dup2(handle->reading_pipe[1], STDOUT_FILENO);
+            // before the sockets move in, the pipe might sit where one of them goes.
+            if (handle->reading_pipe[1] != -1) {
+                dup2(handle->reading_pipe[1], STDOUT_FILENO);
+                dup2(handle->error_pipe[1],   STDERR_FILENO);
+            }
             int process_group_set_result = setpgid(0, 0);
             int pgerr = errno;
             if (process_group_set_result == -1) {
                 fprintf(stderr, "Failed to set setpgid: %s\n", strerror(pgerr));
                 exit(EXIT_FAILURE);
             }
-            execvp(exec_command, (char *const *)arg_list); // arg_list);
+            if (handle->listen_count > 0) hand_over_listen_fds(handle, pid_slot);
+            execvpe(exec_command, (char *const *)arg_list, environment); // arg_list);
 
             int err = errno;
             printf("Failed to start a process. errno = %d\n", err);
@@ -122,84 +346,310 @@ int32_t start_process(const char *command, Process_Handle *handle, Logger *logge
 
         default:
         {
-            handle->child_pid = pid;
+            // child does the same, whichever runs first wins. kill(-pid) needs the group to be there.
+            setpgid(pid, pid);
+            track_started_process(handle, pid, logger);
             free(exec_command);
-            printf("running a process: pid = %d\n", pid);
-            watcher_log(logger, "started a new process: pid = %d", handle->child_pid);
-            // close(handle->reading_pipe[1]);
-            // handle->reading_pipe[1] = 0;
             return 1;
         } break;
     }
     assert(false && " shouldn't be here.");
 }
 
+int32_t start_process(const char *command, Process_Handle *handle, Logger *logger) {
+    if (handle->output && !create_pipe(handle)) {
+        watcher_log_ex(logger, LOG_SOURCE_SUPERVISOR, LOG_WARNING, handle->generation, "Failed to create a pipe for the output: %s", strerror(errno));
+    }
 
-void terminate_process(Process_Handle *handle) {
-    if (handle->child_pid == 0 || handle->child_pid == -1) return;
-    int kill_result = kill(-handle->child_pid, SIGTERM);
-    int err = errno;
-    if (kill_result == -1) {
-        fprintf(stderr, "Failed to kill a process. error: %d\n", err);
-        exit(EXIT_FAILURE);
+    // Create Argument list.
+    char *arg_list[32] = {0};
+    char *exec_command = separate_command_to_executable_and_args(command, arg_list, 32);
+
+    int ready_write_fd = -1;
+    if (handle->ready_gate) {
+        ready_write_fd = open_ready_pipe(handle, 3 + handle->listen_count);
+        if (ready_write_fd == -1) {
+            watcher_log_ex(logger, LOG_SOURCE_SUPERVISOR, LOG_WARNING, handle->generation, "Failed to create a readiness pipe: %s", strerror(errno));
+        }
     }
 
-    int status;
-    int wait_result = waitpid(-handle->child_pid, &status, 0);
-    int werr = errno;
+    char **environment = environ;
+    char *pid_slot = NULL;
+    if (ready_write_fd != -1 || handle->listen_count > 0) {
+        environment = build_child_environment(handle, ready_write_fd, &pid_slot);
+    }
 
-    if (wait_result == -1) {
-        fprintf(stderr, "Failed to wait a process. error: %d\n", werr);
-        exit(EXIT_FAILURE);
+    // LISTEN_PID has to be the child's own pid, which only code running in the child knows.
+    // posix_spawn doesn't run any of ours, so sockets mean fork.
+    int32_t use_spawn = handle->spawn_method == SPAWN_METHOD_SPAWN && handle->listen_count == 0;
+    int32_t started = use_spawn ?
+        spawn_process(exec_command, arg_list, environment, handle, logger) :
+        fork_process(exec_command, arg_list, environment, pid_slot, handle, logger);
+
+    // only the child gets to hold the write end, so it reads as EOF here once the child is gone.
+    if (ready_write_fd != -1) close(ready_write_fd);
+    if (environment != environ) free(environment);
+    if (!started) close_ready_pipe(handle);
+
+    // same for the output, and the read ends belong to the reader thread from here on.
+    if (handle->reading_pipe[1] != -1) {
+        close(handle->reading_pipe[1]);
+        close(handle->error_pipe[1]);
+        handle->reading_pipe[1] = -1;
+        handle->error_pipe[1]   = -1;
+        if (started) {
+            output_reader_add(handle->output, handle->reading_pipe[0], handle->error_pipe[0], handle->output_tag,
+                              handle->child_pid, handle->binding, handle->generation);
+            handle->reading_pipe[0] = -1;
+            handle->error_pipe[0]   = -1;
+        }
     }
+    close_pipe(handle);
+    return started;
+}
+
 
+// Fill in last_exit from what waitid told us and forget about the child. info NULL: waitid
+// couldn't tell, the child is gone but how it ended isn't known.
+void record_process_exit(Process_Handle *handle, siginfo_t *info) {
+    Process_Exit *exit = &handle->last_exit;
+    exit->pid        = handle->child_pid;
+    exit->unknown    = info == NULL;
+    exit->exit_code  = (info && info->si_code == CLD_EXITED) ? info->si_status : -1;
+    exit->signal     = (info && (info->si_code == CLD_KILLED || info->si_code == CLD_DUMPED)) ? info->si_status : 0;
+    exit->runtime_ms = platform_monotonic_ms() - handle->started_ms;
+    exit->stopped    = handle->stopping;
+
+    if (handle->pidfd != -1) close(handle->pidfd);
+    handle->pidfd     = -1;
     handle->child_pid = -1;
+    handle->stopping  = 0;
+    handle->kill_sent = 0;
+    close_ready_pipe(handle);
 }
 
-int32_t restart_process(const char *command, Process_Handle *handle, Logger *logger) {
-    terminate_process(handle);
-    return start_process(command, handle, logger);
+// ====================================
+// Listening sockets.
+//
+// Bound once by us and kept open across restarts, so connections wait in the backlog while the
+// child is being replaced instead of getting refused. every child gets them the systemd way:
+// fds 3, 4, ... with LISTEN_FDS and LISTEN_PID set (sd_listen_fds() works as is).
+
+// "8080", "127.0.0.1:8080", "[::1]:8080", ":8080" or "unix:/path/to.sock".
+int open_listen_socket(const char *address, Logger *logger) {
+    if (strncmp(address, "unix:", 5) == 0) {
+        const char *path = address + 5;
+        struct sockaddr_un local = {0};
+        local.sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(local.sun_path)) {
+            watcher_log(logger, "socket path too long: %s", path);
+            return -1;
+        }
+        strcpy(local.sun_path, path);
+
+        // left over from an earlier run, nobody can be listening on it without us.
+        struct stat status;
+        if (stat(path, &status) == 0 && S_ISSOCK(status.st_mode)) unlink(path);
+
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1 || bind(fd, (struct sockaddr *)&local, sizeof(local)) == -1 || listen(fd, SOMAXCONN) == -1) {
+            watcher_log(logger, "failed to listen on %s: %s", address, strerror(errno));
+            if (fd != -1) close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    char host[256] = {0};
+    const char *port = address;
+    const char *colon = strrchr(address, ':');
+    if (colon) {
+        const char *begin = address, *end = colon;
+        if (*begin == '[' && end > begin && end[-1] == ']') { begin++; end--; }
+        size_t length = (size_t)(end - begin);
+        if (length >= sizeof(host)) length = sizeof(host) - 1;
+        memcpy(host, begin, length);
+        port = colon + 1;
+    }
+
+    struct addrinfo hints = {0};
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags    = AI_PASSIVE | AI_NUMERICSERV;
+    struct addrinfo *found = NULL;
+    int error = getaddrinfo(host[0] ? host : NULL, port, &hints, &found);
+    if (error != 0) {
+        watcher_log(logger, "bad listen address %s: %s", address, gai_strerror(error));
+        return -1;
+    }
+
+    int fd = socket(found->ai_family, found->ai_socktype | SOCK_CLOEXEC, found->ai_protocol);
+    int on = 1;
+    if (fd != -1) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (fd == -1 || bind(fd, found->ai_addr, found->ai_addrlen) == -1 || listen(fd, SOMAXCONN) == -1) {
+        watcher_log(logger, "failed to listen on %s: %s", address, strerror(errno));
+        if (fd != -1) close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(found);
+    return fd;
 }
 
-int is_process_running(Process_Handle *handle) {
-    if (handle->child_pid == -1) return 0;
+int32_t open_listen_sockets(const char *addresses, int *fds, int32_t capacity, Logger *logger) {
+    char buffer[512];
+    snprintf(buffer, sizeof(buffer), "%s", addresses);
 
-    int status = 0;
-    int result = waitpid(-handle->child_pid, &status, WNOHANG);
-    int err = errno;
+    int32_t count = 0;
+    char *saved = NULL;
+    for (char *address = strtok_r(buffer, " \t,", &saved); address; address = strtok_r(NULL, " \t,", &saved)) {
+        if (count == capacity) {
+            watcher_log(logger, "only %d listening sockets supported, ignoring %s", capacity, address);
+            break;
+        }
+        int fd = open_listen_socket(address, logger);
+        if (fd == -1) {
+            close_listen_sockets(fds, count);
+            return -1;
+        }
+        fds[count] = fd;
+        watcher_log(logger, "listening on %s, children get it as fd %d", address, 3 + count);
+        count++;
+    }
+    return count;
+}
 
-    int32_t retry_count = 0;
-    int32_t retry_cap = 3;
-    while (result == -1) {
-        if (err == ECHILD) {
-            // This can happen if the parent process checks the status of child process
-            // immediately after the process has been created.
-            // wait a little bit and check again, re-try it for few more times,
-            // then bail out.
-            retry_count++;
-            if (retry_count > retry_cap) {
-                fprintf(stderr, "error occurred while checking the status of child process: %s\n, pid = %d\n", strerror(err), handle->child_pid);
-                exit(EXIT_FAILURE);
-            }
+void close_listen_sockets(int *fds, int32_t count) {
+    for (int32_t i = 0; i < count; ++i) close(fds[i]);
+}
+
+void process_set_listen_fds(Process_Handle *handle, const int *fds, int32_t count) {
+    if (count > LISTEN_MAX) count = LISTEN_MAX;
+    memcpy(handle->listen_fds, fds, sizeof(int) * count);
+    handle->listen_count = count;
+}
+
+// ====================================
+// Stopping.
+//
+// Nothing in here waits for the child, except terminate_process. request_process_stop sends
+// stop_signal, update_process_stop escalates to SIGKILL once stop_timeout_ms is over, and the pidfd
+// tells the event loop when it's actually gone (is_process_running reaps it).
+
+int32_t signal_from_name(const char *name) {
+    if (strncmp(name, "SIG", 3) == 0) name += 3;
+    const struct { const char *name; int32_t signal; } signals[] = {
+        { "TERM", SIGTERM }, { "INT",  SIGINT  }, { "HUP",  SIGHUP  }, { "QUIT", SIGQUIT },
+        { "KILL", SIGKILL }, { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 }, { "WINCH", SIGWINCH },
+    };
+    for (size_t i = 0; i < sizeof(signals) / sizeof(signals[0]); ++i) {
+        if (strcmp(name, signals[i].name) == 0) return signals[i].signal;
+    }
+    int32_t number = atoi(name);
+    return (number > 0 && number < NSIG) ? number : 0;
+}
+
+int32_t process_set_stop_signal(Process_Handle *handle, const char *signal_name, uint32_t timeout_ms) {
+    handle->stop_timeout_ms = timeout_ms;
+    if (!signal_name || !signal_name[0]) return 1;
+
+    int32_t signal = signal_from_name(signal_name);
+    if (!signal) return 0;
+    handle->stop_signal = signal;
+    return 1;
+}
+
+// whole group, so whatever the child started goes down with it.
+void signal_process_group(Process_Handle *handle, int signal) {
+    if (kill(-handle->child_pid, signal) == -1 && errno != ESRCH) {
+        fprintf(stderr, "Failed to send signal %d to process %d. error: %s\n", signal, handle->child_pid, strerror(errno));
+    }
+}
+
+void request_process_stop(Process_Handle *handle) {
+    if (handle->child_pid == 0 || handle->child_pid == -1) return;
+    if (handle->stopping) return;
+
+    handle->stopping          = 1;
+    handle->stop_requested_ms = platform_monotonic_ms();
+    signal_process_group(handle, handle->stop_signal);
+}
+
+int32_t process_is_stopping(Process_Handle *handle) {
+    return handle->stopping;
+}
+
+uint64_t process_stop_deadline(Process_Handle *handle) {
+    if (!handle->stopping || handle->kill_sent) return 0;
+    return handle->stop_requested_ms + handle->stop_timeout_ms;
+}
+
+void update_process_stop(Process_Handle *handle, uint64_t now_ms) {
+    uint64_t deadline = process_stop_deadline(handle);
+    if (!deadline || now_ms < deadline) return;
+
+    handle->kill_sent = 1;
+    signal_process_group(handle, SIGKILL);
+}
+
+// The blocking version, for when there's nothing else left to do (shutting down).
+// still escalates, so a child that ignores stop_signal holds us up for stop_timeout_ms at most.
+void terminate_process(Process_Handle *handle) {
+    if (handle->child_pid == 0 || handle->child_pid == -1) return;
+    request_process_stop(handle);
 
-            sleep_ms(50);
-            result = waitpid(-handle->child_pid, &status, WNOHANG);
+    while (!handle->kill_sent) {
+        if (!is_process_running(handle)) return;
+
+        uint64_t now_ms = platform_monotonic_ms();
+        update_process_stop(handle, now_ms);
+        if (handle->kill_sent) break;
+
+        int32_t remaining = (int32_t)(process_stop_deadline(handle) - now_ms);
+        if (handle->pidfd != -1) {
+            struct pollfd exit_poll = { handle->pidfd, POLLIN, 0 };
+            poll(&exit_poll, 1, remaining);
         } else {
-            fprintf(stderr, "error occurred while checking if the process is running: %s\n", strerror(err));
-            exit(EXIT_FAILURE);
+            sleep_ms(remaining < 10 ? remaining : 10);
         }
     }
 
-    if (result == 0) {
-        return 1;
+    siginfo_t info = {0};
+    int wait_result;
+    do {
+        wait_result = waitid(P_PID, handle->child_pid, &info, WEXITED);
+    } while (wait_result == -1 && errno == EINTR);
+
+    if (wait_result == -1) {
+        fprintf(stderr, "Failed to wait a process. error: %s\n", strerror(errno));
     }
+    record_process_exit(handle, (wait_result == -1) ? NULL : &info);
+}
+
+int32_t restart_process(const char *command, Process_Handle *handle, Logger *logger) {
+    terminate_process(handle);
+    return start_process(command, handle, logger);
+}
 
-    if (WIFEXITED(status) || WIFSIGNALED(status)) {
-        handle->child_pid = -1;
+// Never blocks. waiting on our own pid directly, so there's no window where the child isn't there yet.
+int is_process_running(Process_Handle *handle) {
+    if (handle->child_pid == -1) return 0;
+
+    siginfo_t info = {0};
+    if (waitid(P_PID, handle->child_pid, &info, WEXITED | WNOHANG) == -1) {
+        if (errno == EINTR) return 1; // nothing known yet, next time.
+        // ECHILD: reaped behind our back. it's gone, but there's no exit status to go by.
+        fprintf(stderr, "error occurred while checking the status of child process: %s, pid = %d\n", strerror(errno), handle->child_pid);
+        record_process_exit(handle, NULL);
         return 0;
     }
-    fprintf(stderr, "still alive for some reason.\n");
-    return 1;
+
+    if (info.si_pid == 0) return 1;
+    record_process_exit(handle, &info);
+    return 0;
+}
+
+int process_event_fd(Process_Handle *handle) {
+    return handle->pidfd;
 }
 
 
@@ -243,160 +693,570 @@ int32_t to_full_paths(char *paths_buffer, size_t paths_buffer_size) {
     return 1;
 }
 
+int32_t resolve_directory(char *path_buffer, size_t path_buffer_size) {
+    char resolved[PATH_MAX];
+    if (!realpath(path_buffer, resolved)) return 0;
+
+    struct stat status;
+    if (stat(resolved, &status) == -1 || !S_ISDIR(status.st_mode)) return 0;
+    if (strlen(resolved) >= path_buffer_size) return 0;
+    strcpy(path_buffer, resolved);
+    return 1;
+}
+
+// Create pipes for given handle, the child's stdout goes into reading_pipe[1], stderr into error_pipe[1].
+// crashes on invalid handle.
+int create_pipe(Process_Handle *handle) {
+    assert(handle->child_pid == -1 && "Cannot create pipe for alive handle.");
+
+    // close-on-exec on all of them: the child gets the [1]s as 1 and 2, and no other child should hold them open.
+    if (pipe2(handle->reading_pipe, O_CLOEXEC)) {
+        handle->reading_pipe[0] = -1;
+        handle->reading_pipe[1] = -1;
+        return 0;
+    }
+    if (pipe2(handle->error_pipe, O_CLOEXEC)) {
+        handle->error_pipe[0] = -1;
+        handle->error_pipe[1] = -1;
+        close_pipe(handle);
+        return 0;
+    }
+    return 1;
+}
 
-// repeatedly read stdout from process.
-// should be used within the thread.
+// Close given pipes completely.
+void close_pipe(Process_Handle *handle) {
+    int *ends[] = { &handle->reading_pipe[0], &handle->reading_pipe[1], &handle->error_pipe[0], &handle->error_pipe[1] };
+    for (size_t i = 0; i < sizeof(ends) / sizeof(ends[0]); ++i) {
+        if (*ends[i] != -1) {
+            close(*ends[i]);
+            *ends[i] = -1;
+        }
+    }
+}
 
-/*
+// ====================================
+// Child output.
+//
+// The thread sits in its own epoll on the read ends of every child's pipe. it reads in big
+// chunks and logs whole lines straight out of them, only the piece of a line that's still
+// missing its end gets copied. the pipes never fill up because the main loop is busy, and the
+// main loop never waits on a child.
+
+#define OUTPUT_READ_SIZE    (64 * 1024)
+#define OUTPUT_READS_IN_ROW 4 // per stream per wake up, so one chatty child can't starve the others.
+#define OUTPUT_SINK_MAX     64
+
+// Log file every byte of some children's output goes to (see output_reader_set_sink).
 typedef struct {
-    Process_Handle *handle;
-    Logger *logger;
-} stdout_task_thr_info;
+    char     name[64];
+    char     path[640];
+    int      fd;        // -1 once writing to it failed, the output keeps going to the view.
+    uint64_t size;
+    uint64_t opened_ms;
+} Output_Sink;
+
+typedef struct Output_Stream {
+    int    fd;
+    struct Output_Stream *next; // in Output_Reader::added, then Output_Reader::streams.
+    int32_t  source;     // LOG_SOURCE_STDOUT / LOG_SOURCE_STDERR.
+    int32_t  binding;
+    uint32_t generation;
+    int32_t  pid;
+    char   tag[64];
+    size_t pending_length;
+    char   pending[LOG_LINE_MAX / 2];
+
+    int32_t      wants_sink;   // find_output_sink once the output thread takes it in, the sinks are its alone.
+    Output_Sink *sink;         // NULL = no log file, fd gets read directly.
+    int          view_pipe[2]; // what tee copies out of fd for the lines, before fd goes to the file.
+    Archive_Run *run;          // NULL = no archive. begun once the output thread takes it in.
+} Output_Stream;
+
+struct Output_Reader {
+    Logger   *logger;
+    int       epoll_fd;
+    int       stop_fd;      // eventfd, written once on destroy.
+    int       added_fd;     // eventfd, written after every push to added.
+    int       wake_pipe[2]; // a byte in [0] after every batch of lines, see output_reader_wake_fd.
+    pthread_t thread;
+    int32_t   thread_started;
+    std::atomic<Output_Stream *> added; // pushed by output_reader_add, the output thread takes them all at once.
+    Output_Stream *streams;  // output thread's, every one it took in. for the last lines when we stop.
+    char      chunk[OUTPUT_READ_SIZE];
+
+    char        sink_directory[512]; // empty = output only goes to the view.
+    uint64_t    sink_max_bytes;
+    uint64_t    sink_max_age_ms;
+    int32_t     sink_keep;
+    Output_Sink sinks[OUTPUT_SINK_MAX];
+    int32_t     sink_count;
+    Log_Archive *archive;
+};
 
-void handle_stdout_for_process(void *ptr) {
-    stdout_task_thr_info info = *(stdout_task_thr_info *)ptr;
-    delete (stdout_task_thr_info *)(ptr);
+void log_output_line(Logger *logger, Output_Stream *stream, const char *line, size_t length) {
+    if (length > 0 && line[length - 1] == '\r') length--;
+    watcher_log_text(logger, stream->source, stream->generation, stream->tag, line, length);
+}
 
-    Process_Handle *handle = info.handle;
-    Logger *Logger = info.buffer;
-    handle->child_pid = -1;
+// Every complete line in data gets logged, the rest waits in pending for its end.
+void split_output_lines(Logger *logger, Output_Stream *stream, const char *data, size_t size) {
+    const char *end = data + size;
+    while (data < end) {
+        const char *newline = (const char *)memchr(data, '\n', end - data);
+        size_t length = (newline ? newline : end) - data;
+
+        if (!newline) {
+            // a line longer than pending gets split, it'd get cut when logged anyway.
+            while (length > 0) {
+                size_t room = sizeof(stream->pending) - stream->pending_length;
+                size_t take = (length < room) ? length : room;
+                memcpy(stream->pending + stream->pending_length, data, take);
+                stream->pending_length += take;
+                data   += take;
+                length -= take;
+                if (stream->pending_length == sizeof(stream->pending)) {
+                    log_output_line(logger, stream, stream->pending, stream->pending_length);
+                    stream->pending_length = 0;
+                }
+            }
+            return;
+        }
 
-    return;
+        if (stream->pending_length > 0) {
+            size_t room = sizeof(stream->pending) - stream->pending_length;
+            size_t take = (length < room) ? length : room;
+            memcpy(stream->pending + stream->pending_length, data, take);
+            log_output_line(logger, stream, stream->pending, stream->pending_length + take);
+            stream->pending_length = 0;
+        } else {
+            log_output_line(logger, stream, data, length);
+        }
+        data = newline + 1;
+    }
+}
 
-    char message[1024] = {0};
-    size_t read_amount = 0;
+void close_output_stream(Output_Reader *reader, Output_Stream *stream) {
+    if (stream->pending_length > 0) log_output_line(reader->logger, stream, stream->pending, stream->pending_length);
+    if (stream->run) archive_end_run(reader->archive, stream->run);
+    for (Output_Stream **link = &reader->streams; *link; link = &(*link)->next) {
+        if (*link == stream) {
+            *link = stream->next;
+            break;
+        }
+    }
+    epoll_ctl(reader->epoll_fd, EPOLL_CTL_DEL, stream->fd, NULL);
+    close(stream->fd);
+    if (stream->sink) {
+        close(stream->view_pipe[0]);
+        close(stream->view_pipe[1]);
+    }
+    free(stream);
+}
 
-    ssize_t read_amount_or_error = read(handle->reading_pipe[0], &message, sizeof(message)-1);
-    if (read_amount_or_error < 0) {
-        printf("Failed to read: %s\n", strerror(errno));
+// ====================================
+// Output log files.
+//
+// With a sink, tee copies what's in the child's pipe over to the stream's view pipe, then splice
+// moves the same bytes on into the file. they never come up to us on their way to disk, only the
+// copy does, for the lines in the log. rotating is a couple of renames and an open on this thread,
+// the pipe holds whatever the child writes meanwhile.
+
+// name.log -> name.log.1 -> ... -> name.log.keep, the oldest one goes.
+void shift_output_logs(Output_Reader *reader, Output_Sink *sink) {
+    char from[700], to[700];
+    if (reader->sink_keep <= 0) {
+        unlink(sink->path);
         return;
     }
+    for (int32_t i = reader->sink_keep - 1; i >= 1; --i) {
+        snprintf(from, sizeof(from), "%s.%d", sink->path, i);
+        snprintf(to,   sizeof(to),   "%s.%d", sink->path, i + 1);
+        rename(from, to);
+    }
+    snprintf(to, sizeof(to), "%s.1", sink->path);
+    rename(sink->path, to);
+}
+
+// no O_APPEND, splice won't write to those.
+int open_output_log(Output_Reader *reader, Output_Sink *sink) {
+    int fd = open(sink->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) watcher_log(reader->logger, "failed to open %s: %s", sink->path, strerror(errno));
+    sink->size      = 0;
+    sink->opened_ms = platform_monotonic_ms();
+    return fd;
+}
 
-    read_amount = (size_t) read_amount_or_error;
+void rotate_output_log(Output_Reader *reader, Output_Sink *sink) {
+    // the old fd keeps pointing at the renamed file, so nothing is lost in between.
+    shift_output_logs(reader, sink);
+    int fd = open_output_log(reader, sink);
+    if (sink->fd != -1) close(sink->fd);
+    sink->fd = fd;
+}
 
-    while (read_amount > 0) {
-        // Extend buffer accordingly.
-        while((Logger->used + read_amount) > Logger->capacity) {
-            char *new_ptr = (char *)realloc(Logger->buffer_ptr, Logger->capacity * 2);
-            assert(new_ptr && "Realloc failed, shouldn't continue.");
+// Streams with the same tag share one, so a command's restarts all go to the same file. output thread only.
+Output_Sink *find_output_sink(Output_Reader *reader, const char *tag) {
+    if (!reader->sink_directory[0]) return NULL;
+
+    // "[./server --port 80] " -> "server_--port_80", no tag -> "output".
+    char name[64] = {0};
+    size_t length = 0;
+    for (const char *c = tag; *c && length < sizeof(name) - 1; ++c) {
+        if (*c == '[' || *c == ']' || (*c == '.' && length == 0)) continue;
+        int32_t plain = isalnum((unsigned char)*c) || *c == '-' || *c == '.';
+        if (!plain && (length == 0 || name[length - 1] == '_')) continue;
+        name[length++] = plain ? *c : '_';
+    }
+    while (length > 0 && name[length - 1] == '_') name[--length] = 0;
+    if (length == 0) snprintf(name, sizeof(name), "output");
 
-            Logger->buffer_ptr = new_ptr;
-            Logger->capacity   = Logger->capacity * 2;
-        }
+    for (int32_t i = 0; i < reader->sink_count; ++i) {
+        if (strcmp(reader->sinks[i].name, name) == 0) return &reader->sinks[i];
+    }
+    if (reader->sink_count == OUTPUT_SINK_MAX) return NULL;
+
+    Output_Sink *sink = &reader->sinks[reader->sink_count];
+    snprintf(sink->name, sizeof(sink->name), "%s", name);
+    snprintf(sink->path, sizeof(sink->path), "%s/%s.log", reader->sink_directory, name);
+    // last run's output is the first one kept.
+    shift_output_logs(reader, sink);
+    sink->fd = open_output_log(reader, sink);
+    if (sink->fd == -1) return NULL;
+    reader->sink_count++;
+    return sink;
+}
 
-        // Finding a Newline.
-        size_t found_newline_index = 0;
+void attach_output_sink(Output_Reader *reader, Output_Stream *stream) {
+    stream->wants_sink = 0;
+    stream->sink = find_output_sink(reader, stream->tag);
+    if (stream->sink && pipe2(stream->view_pipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+        watcher_log(reader->logger, "failed to create a pipe, %s won't get this one's output: %s", stream->sink->path, strerror(errno));
+        stream->sink = NULL;
+    }
+}
 
-        for (size_t index = 0; index < read_amount; ++index) {
-            if (message[index] == '\n' || message[index] == 0) {
-                found_newline_index = index;
-                break;
+// Moves exactly size bytes from the stream's pipe to its log file, the view has its copy already.
+void splice_to_output_log(Output_Reader *reader, Output_Stream *stream, size_t size) {
+    Output_Sink *sink = stream->sink;
+    while (size > 0 && sink->fd != -1) {
+        ssize_t moved = splice(stream->fd, NULL, sink->fd, NULL, size, SPLICE_F_MOVE);
+        if (moved > 0) {
+            size       -= (size_t)moved;
+            sink->size += (uint64_t)moved;
+            continue;
+        }
+        if (moved == -1 && errno == EINTR) continue;
+        if (moved == -1 && errno == EINVAL) {
+            // file system that can't take a splice, the bytes come through us after all.
+            char *bounce = reader->chunk + OUTPUT_READ_SIZE / 2;
+            ssize_t got = read(stream->fd, bounce, (size < OUTPUT_READ_SIZE / 2) ? size : OUTPUT_READ_SIZE / 2);
+            if (got <= 0) return;
+            size -= (size_t)got;
+            if (write(sink->fd, bounce, (size_t)got) == got) {
+                sink->size += (uint64_t)got;
+                continue;
             }
         }
+        watcher_log(reader->logger, "failed to write %s: %s. not writing it anymore", sink->path, strerror(errno));
+        close(sink->fd);
+        sink->fd = -1;
+    }
+
+    // whatever couldn't go to the file still has to come out of the pipe.
+    while (size > 0) {
+        ssize_t got = read(stream->fd, reader->chunk + OUTPUT_READ_SIZE / 2, (size < OUTPUT_READ_SIZE / 2) ? size : OUTPUT_READ_SIZE / 2);
+        if (got <= 0) break;
+        size -= (size_t)got;
+    }
 
-        char *reading_ptr = message;
+    uint64_t age_ms = platform_monotonic_ms() - sink->opened_ms;
+    if (sink->fd != -1 && ((reader->sink_max_bytes && sink->size >= reader->sink_max_bytes) ||
+                           (reader->sink_max_age_ms && age_ms >= reader->sink_max_age_ms))) {
+        rotate_output_log(reader, sink);
+    }
+}
 
-        // Write into stdout if you've found a newline.
-        if (found_newline_index > 0) {
-            strncat(Logger->buffer_ptr, reading_ptr, found_newline_index + 1);
-            printf("[Logs] %s", Logger->buffer_ptr);
-            reading_ptr += found_newline_index;
-            read_amount -= found_newline_index;
+// read(), but through the sink: the bytes go to the file, what comes back is the view's copy.
+// -1 / EAGAIN and 0 on EOF like read. at most half a chunk, the other half is splice's bounce buffer.
+ssize_t read_output_through_sink(Output_Reader *reader, Output_Stream *stream) {
+    ssize_t size = tee(stream->fd, stream->view_pipe[1], OUTPUT_READ_SIZE / 2, SPLICE_F_NONBLOCK);
+    if (size <= 0) return size;
+
+    splice_to_output_log(reader, stream, (size_t)size);
+    ssize_t got = 0;
+    while (got < size) {
+        ssize_t more = read(stream->view_pipe[0], reader->chunk + got, (size_t)(size - got));
+        if (more <= 0) break;
+        got += more;
+    }
+    return got;
+}
 
-            memset(Logger->buffer_ptr, 0, Logger->capacity);
-            Logger->used = 0;
+// 0 once the stream is done (every writer is gone), it's closed and freed by then.
+int32_t drain_output_stream(Output_Reader *reader, Output_Stream *stream) {
+    size_t asked = stream->sink ? OUTPUT_READ_SIZE / 2 : OUTPUT_READ_SIZE;
+    for (int32_t i = 0; i < OUTPUT_READS_IN_ROW; ++i) {
+        ssize_t size = stream->sink ?
+            read_output_through_sink(reader, stream) :
+            read(stream->fd, reader->chunk, asked);
+        if (size > 0) {
+            if (stream->run) archive_append(reader->archive, stream->run, reader->chunk, (size_t)size, platform_monotonic_ms());
+            split_output_lines(reader->logger, stream, reader->chunk, (size_t)size);
+            // less than asked for, the pipe is empty. saves the read that says so.
+            if ((size_t)size < asked) return 1;
+            continue;
         }
+        if (size == -1 && errno == EINTR) continue;
+        if (size == -1 && errno == EAGAIN) return 1;
+
+        // EOF (or the pipe broke): whatever's left is the last line.
+        close_output_stream(reader, stream);
+        return 0;
+    }
+    // still more, epoll brings us back once the others had their turn.
+    return 1;
+}
 
-        // Concatenate the rest.
-        strcat(Logger->buffer_ptr, reading_ptr);
-        Logger->used += read_amount;
+// Streams added since last time go in the epoll and on the output thread's own list. only this
+// thread ever registers a stream's fd, so no event comes for one it can't find yet.
+void take_added_streams(Output_Reader *reader) {
+    uint64_t count;
+    read(reader->added_fd, &count, sizeof(count));
+
+    Output_Stream *stream = reader->added.exchange(NULL, std::memory_order_acquire);
+    Archive_Run *run = NULL;
+    while (stream) {
+        Output_Stream *next = stream->next;
+        if (stream->wants_sink) attach_output_sink(reader, stream);
+        // stdout comes right before its stderr, they write to one run.
+        if (reader->archive) {
+            if (stream->source == LOG_SOURCE_STDERR && run) stream->run = archive_share_run(run);
+            else stream->run = archive_begin_run(reader->archive, stream->binding, stream->generation, stream->pid);
+            run = stream->source == LOG_SOURCE_STDOUT ? stream->run : NULL;
+        }
 
-        memset(message, 0, sizeof(message));
-        read_amount_or_error = read(handle->reading_pipe[0], &message, sizeof(message)-1);
-        if (read_amount_or_error < 0) {
-            if (errno == EAGAIN) {
-                // expected when the result is empty.
-                return;
+        struct epoll_event event = {0};
+        event.events   = EPOLLIN;
+        event.data.ptr = stream;
+        if (epoll_ctl(reader->epoll_fd, EPOLL_CTL_ADD, stream->fd, &event) == -1) {
+            watcher_log(reader->logger, "failed to read child output: %s", strerror(errno));
+            // the run may be gone with this end, its stderr begins (or carries on with) it again.
+            if (stream->run) archive_end_run(reader->archive, stream->run);
+            run = NULL;
+            close(stream->fd);
+            if (stream->sink) {
+                close(stream->view_pipe[0]);
+                close(stream->view_pipe[1]);
             }
-            printf("Failed to read below: %s", strerror(errno));
-            return;
+            free(stream);
+        } else {
+            stream->next = reader->streams;
+            reader->streams = stream;
         }
-        read_amount = (size_t) read_amount_or_error;
+        stream = next;
     }
 }
-*/
 
-// Create pipe for given handle.
-// crashes on invalid handle.
-int create_pipe(Process_Handle *handle) {
-    assert(handle->child_pid == -1 && "Cannot create pipe for alive handle.");
-    const int PIPE_SUCCESS = 0;
+void *output_reader_task(void *arg) {
+    Output_Reader *reader = (Output_Reader *)arg;
+    struct epoll_event events[32];
 
-    if (pipe(handle->reading_pipe)) {
-        return 0;
+    for (;;) {
+        // with an archive, what a quiet run wrote last shouldn't wait for the next block to fill up forever.
+        int count = epoll_wait(reader->epoll_fd, events, 32, reader->archive ? ARCHIVE_IDLE_FLUSH_MS : -1);
+        if (count == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        // before any of the events, one of them may be for a stream that was just added.
+        take_added_streams(reader);
+        if (reader->archive) {
+            uint64_t now_ms = platform_monotonic_ms();
+            for (Output_Stream *stream = reader->streams; stream; stream = stream->next) {
+                archive_flush_idle_run(reader->archive, stream->run, now_ms);
+            }
+        }
+
+        int32_t logged = 0;
+        for (int i = 0; i < count; ++i) {
+            Output_Stream *stream = (Output_Stream *)events[i].data.ptr;
+            if (stream == (Output_Stream *)&reader->added_fd) continue; // taken in above already.
+            if (!stream) {
+                // stop_fd. what the children managed to write before they went still counts, for
+                // every stream still open, whether it had anything to say yet or not.
+                take_added_streams(reader);
+                while (reader->streams) {
+                    Output_Stream *first = reader->streams;
+                    if (drain_output_stream(reader, first)) close_output_stream(reader, first);
+                }
+                if (reader->logger->print_to_stdout) fflush(stdout);
+                return NULL;
+            }
+
+            drain_output_stream(reader, stream);
+            logged = 1;
+        }
+        if (logged) {
+            if (reader->logger->print_to_stdout) fflush(stdout);
+            char byte = 0;
+            write(reader->wake_pipe[1], &byte, 1); // full pipe is fine, there's a wake up pending already.
+        }
     }
+    return NULL;
+}
 
-    /*
-    Let's make it blocking and use mutex instead!
-    if (fcntl(handle->reading_pipe[0], F_SETFL, O_NONBLOCK)) {
-        handle->valid = 0;
-        close(handle->reading_pipe[0]);
-        close(handle->reading_pipe[1]);
-        return 0;
+Output_Reader *create_output_reader(Logger *logger, Log_Archive *archive) {
+    Output_Reader *reader = (Output_Reader *)malloc(sizeof(Output_Reader));
+    assert(reader && "malloc failed");
+    memset((void *)reader, 0, sizeof(*reader));
+    reader->added.store(NULL);
+    reader->logger  = logger;
+    reader->archive = archive;
+    reader->wake_pipe[0] = reader->wake_pipe[1] = -1;
+
+    reader->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    reader->stop_fd  = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    reader->added_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (reader->epoll_fd == -1 || reader->stop_fd == -1 || reader->added_fd == -1 ||
+        pipe2(reader->wake_pipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+        watcher_log(logger, "failed to set up reading child output: %s", strerror(errno));
+        destroy_output_reader(reader);
+        return NULL;
     }
-    */
 
-    return 1;
+    struct epoll_event event = {0};
+    event.events   = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl(reader->epoll_fd, EPOLL_CTL_ADD, reader->stop_fd, &event);
+    event.data.ptr = &reader->added_fd;
+    epoll_ctl(reader->epoll_fd, EPOLL_CTL_ADD, reader->added_fd, &event);
+
+    int result = pthread_create(&reader->thread, NULL, output_reader_task, reader);
+    if (result != 0) {
+        watcher_log(logger, "failed to start the output thread, child output goes to our stdout: %s", strerror(result));
+        destroy_output_reader(reader);
+        return NULL;
+    }
+    reader->thread_started = 1;
+    return reader;
 }
 
-// Close given pipe completely.
-void close_pipe(Process_Handle *handle) {
-    if (handle->reading_pipe[0] != 0) {
-        close(handle->reading_pipe[0]);
-        handle->reading_pipe[0] = 0;
+// Streams still open at this point just get dropped, their children are gone or about to be.
+void destroy_output_reader(Output_Reader *reader) {
+    if (!reader) return;
+    if (reader->thread_started) {
+        uint64_t one = 1;
+        write(reader->stop_fd, &one, sizeof(one));
+        pthread_join(reader->thread, NULL);
     }
-    if (handle->reading_pipe[1] != 0) {
-        close(handle->reading_pipe[1]);
-        handle->reading_pipe[1] = 0;
+    if (reader->epoll_fd != -1)     close(reader->epoll_fd);
+    if (reader->stop_fd != -1)      close(reader->stop_fd);
+    if (reader->added_fd != -1)     close(reader->added_fd);
+    if (reader->wake_pipe[0] != -1) close(reader->wake_pipe[0]);
+    if (reader->wake_pipe[1] != -1) close(reader->wake_pipe[1]);
+    for (int32_t i = 0; i < reader->sink_count; ++i) {
+        if (reader->sinks[i].fd != -1) close(reader->sinks[i].fd);
     }
+    free(reader);
 }
 
-// ====================================
-// Threading.
-
-
-/*
-void *stdout_task(void *arg) {
-    printf("begin\n");
-    // handle_stdout_for_process(arg);
-    printf("end\n");
-
-    pthread_exit(NULL);
-    return NULL;
+int32_t output_reader_set_sink(Output_Reader *reader, const char *directory, uint64_t max_bytes, uint32_t max_age_s, int32_t keep) {
+    if (!make_directory(directory)) {
+        watcher_log(reader->logger, "failed to create %s: %s", directory, strerror(errno));
+        return 0;
+    }
+    snprintf(reader->sink_directory, sizeof(reader->sink_directory), "%s", directory);
+    reader->sink_max_bytes  = max_bytes;
+    reader->sink_max_age_ms = (uint64_t)max_age_s * 1000;
+    reader->sink_keep       = keep;
+    return 1;
 }
 
-Thread_Handle start_stdout_thread(Process_Handle *handle, Logger *logger) {
-    Thread_Handle thread = {0};
+int output_reader_wake_fd(Output_Reader *reader) {
+    return reader ? reader->wake_pipe[0] : -1;
+}
 
-    stdout_task_thr_info *i = new stdout_task_thr_info;
-    i->handle = handle;
-    i->buffer = buffer;
+Output_Stream *create_output_stream(Output_Reader *reader, int fd, int32_t source, const char *tag, int32_t pid, int32_t binding, uint32_t generation) {
+    Output_Stream *stream = (Output_Stream *)malloc(sizeof(Output_Stream));
+    assert(stream && "malloc failed");
+    stream->fd = fd;
+    stream->next = NULL;
+    stream->source     = source;
+    stream->binding    = binding;
+    stream->generation = generation;
+    stream->pid        = pid;
+    stream->pending_length = 0;
+    snprintf(stream->tag, sizeof(stream->tag), "%s", tag);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    stream->run        = NULL;
+    stream->sink       = NULL;
+    stream->wants_sink = reader->sink_directory[0] != 0;
+    return stream;
+}
 
-    pthread_create(&thread.inner, NULL, stdout_task, (void *)i); // problem!
-    return thread;
+// Takes both fds over, each gets closed once every child holding its other end is gone.
+// stdout and stderr end up in the same log file, and in the archive run of binding's generation.
+void output_reader_add(Output_Reader *reader, int out_fd, int err_fd, const char *tag, int32_t pid, int32_t binding, uint32_t generation) {
+    Output_Stream *out = create_output_stream(reader, out_fd, LOG_SOURCE_STDOUT, tag, pid, binding, generation);
+    Output_Stream *err = create_output_stream(reader, err_fd, LOG_SOURCE_STDERR, tag, pid, binding, generation);
+    out->next = err;
+
+    // the output thread is the one that takes them off (and into its epoll), so only this end ever
+    // pushes. both in one go, take_added_streams finds stdout right before its stderr.
+    Output_Stream *first = reader->added.load(std::memory_order_relaxed);
+    do {
+        err->next = first;
+    } while (!reader->added.compare_exchange_weak(first, out, std::memory_order_release, std::memory_order_relaxed));
+    uint64_t one = 1;
+    write(reader->added_fd, &one, sizeof(one));
 }
-*/
 
 // ====================================
 // Files.
 
-// Check if given path is forbidden to process.
-bool is_forbidden_path(char *path) {
-    return (
-        strcmp(path, ".")  == 0 ||
-        strcmp(path, "..") == 0
-    );
-}
+void *map_file(const char *path, size_t *out_size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return NULL;
+
+    struct stat status;
+    void *data = NULL;
+    if (fstat(fd, &status) == 0 && status.st_size > 0) {
+        data = mmap(NULL, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) data = NULL;
+        *out_size = (size_t)status.st_size;
+    }
+    // the mapping stays without it.
+    close(fd);
+    return data;
+}
+
+void unmap_file(void *data, size_t size) {
+    munmap(data, size);
+}
+
+int32_t make_directory(const char *path) {
+    return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
+
+int32_t list_directory(const char *path, void (*visit)(void *context, const char *name), void *context) {
+    DIR *dir = opendir(path);
+    if (!dir) return 0;
+    for (struct dirent *entry = readdir(dir); entry; entry = readdir(dir)) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) visit(context, entry->d_name);
+    }
+    closedir(dir);
+    return 1;
+}
+
+// Check if given path is forbidden to process.
+bool is_forbidden_path(char *path) {
+    return (
+        strcmp(path, ".")  == 0 ||
+        strcmp(path, "..") == 0
+    );
+}
 
 uint64_t find_latest_modified_time(Logger *logger, char *filepath) {
     if (is_forbidden_path(filepath)) return 0;
@@ -443,6 +1303,2036 @@ uint64_t find_latest_modified_time(Logger *logger, char *filepath) {
     }
 }
 
-void sleep_ms(int ms) {
-    usleep(ms * 1000);
+// ====================================
+// Directory reading.
+//
+// Directories are read in bulk with getdents64 into a reusable arena and entries get stat'ed
+// relative to the directory fd, so the kernel never has to walk the full path again.
+
+struct linux_dirent64 {
+    uint64_t       d_ino;
+    int64_t        d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[];
+};
+
+typedef struct {
+    char  *data;
+    size_t used;
+    size_t capacity;
+} Dirent_Arena;
+
+#define DIRENT_READ_SIZE (32 * 1024)
+
+void free_dirent_arena(Dirent_Arena *arena) {
+    free(arena->data);
+    arena->data     = NULL;
+    arena->used     = 0;
+    arena->capacity = 0;
+}
+
+// Read every entry of given directory into the arena, right after whatever is there already.
+// entries live in [out_begin, out_end), release them by setting arena->used back to out_begin.
+int32_t read_directory_entries(int dir_fd, Dirent_Arena *arena, size_t *out_begin, size_t *out_end) {
+    *out_begin = arena->used;
+    for (;;) {
+        if (arena->capacity - arena->used < DIRENT_READ_SIZE) {
+            size_t new_capacity = arena->capacity ? arena->capacity * 2 : 4 * DIRENT_READ_SIZE;
+            char *new_data = (char *)realloc(arena->data, new_capacity);
+            assert(new_data && "Realloc failed, shouldn't continue.");
+            arena->data     = new_data;
+            arena->capacity = new_capacity;
+        }
+
+        long read_amount = syscall(SYS_getdents64, dir_fd, arena->data + arena->used, arena->capacity - arena->used);
+        if (read_amount == -1) {
+            if (errno == EINTR) continue;
+            arena->used = *out_begin;
+            return 0;
+        }
+        if (read_amount == 0) break;
+        arena->used += read_amount;
+    }
+    *out_end = arena->used;
+    return 1;
+}
+
+// stat an entry relative to its directory. follows symlinks like stat() does, and only asks for what we keep.
+int32_t stat_entry_at(int dir_fd, const char *name, struct stat *out_status) {
+#ifdef STATX_TYPE
+    static int32_t statx_unavailable = 0;
+    if (!statx_unavailable) {
+        struct statx extended;
+        if (statx(dir_fd, name, AT_NO_AUTOMOUNT, STATX_TYPE | STATX_MTIME | STATX_INO | STATX_SIZE, &extended) == 0) {
+            memset(out_status, 0, sizeof(*out_status));
+            out_status->st_mode         = extended.stx_mode;
+            out_status->st_ino          = extended.stx_ino;
+            out_status->st_size         = extended.stx_size;
+            out_status->st_mtim.tv_sec  = extended.stx_mtime.tv_sec;
+            out_status->st_mtim.tv_nsec = extended.stx_mtime.tv_nsec;
+            return 1;
+        }
+        if (errno != ENOSYS) return 0;
+        statx_unavailable = 1;
+    }
+#endif
+    return fstatat(dir_fd, name, out_status, AT_NO_AUTOMOUNT) == 0;
+}
+
+int open_directory_at(int dir_fd, const char *name) {
+    return openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+// ====================================
+// Content hashing.
+//
+// XXH64, so "changed" can mean the bytes changed and not just the mtime.
+// Four independent lanes over 32 byte stripes, the compiler keeps them in registers and runs them in parallel.
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87llu
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4Fllu
+#define XXH_PRIME64_3 0x165667B19E3779F9llu
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63llu
+#define XXH_PRIME64_5 0x27D4EB2F165667C5llu
+
+// files are read in chunks this big, so a file shrinking under us is a short read and not a SIGBUS.
+#define HASH_CHUNK (256 * 1024)
+
+inline uint64_t xxh_rotl(uint64_t value, int amount) {
+    return (value << amount) | (value >> (64 - amount));
+}
+
+inline uint64_t xxh_read64(const uint8_t *ptr) { uint64_t value; memcpy(&value, ptr, 8); return value; }
+inline uint32_t xxh_read32(const uint8_t *ptr) { uint32_t value; memcpy(&value, ptr, 4); return value; }
+
+inline uint64_t xxh_round(uint64_t accumulator, uint64_t input) {
+    accumulator += input * XXH_PRIME64_2;
+    accumulator  = xxh_rotl(accumulator, 31);
+    return accumulator * XXH_PRIME64_1;
+}
+
+inline uint64_t xxh_merge_round(uint64_t accumulator, uint64_t value) {
+    accumulator ^= xxh_round(0, value);
+    return accumulator * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+// Streaming form, fed a chunk at a time. gives the same digest as hashing everything in one go.
+struct Xxh64_State {
+    uint64_t total;
+    uint64_t v1, v2, v3, v4;
+    uint8_t  stripe[32];    // bytes that didn't fill a whole stripe yet.
+    uint32_t stripe_used;
+};
+
+void xxh64_reset(Xxh64_State *state, uint64_t seed) {
+    memset(state, 0, sizeof(*state));
+    state->v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+    state->v2 = seed + XXH_PRIME64_2;
+    state->v3 = seed;
+    state->v4 = seed - XXH_PRIME64_1;
+}
+
+inline void xxh64_stripe(Xxh64_State *state, const uint8_t *ptr) {
+    state->v1 = xxh_round(state->v1, xxh_read64(ptr));
+    state->v2 = xxh_round(state->v2, xxh_read64(ptr + 8));
+    state->v3 = xxh_round(state->v3, xxh_read64(ptr + 16));
+    state->v4 = xxh_round(state->v4, xxh_read64(ptr + 24));
+}
+
+void xxh64_update(Xxh64_State *state, const void *data, size_t length) {
+    const uint8_t *ptr = (const uint8_t *)data;
+    const uint8_t *end = ptr + length;
+    state->total += length;
+
+    if (state->stripe_used) {
+        size_t fill = 32 - state->stripe_used;
+        if (length < fill) {
+            memcpy(state->stripe + state->stripe_used, ptr, length);
+            state->stripe_used += (uint32_t)length;
+            return;
+        }
+        memcpy(state->stripe + state->stripe_used, ptr, fill);
+        xxh64_stripe(state, state->stripe);
+        state->stripe_used = 0;
+        ptr += fill;
+    }
+
+    for (; ptr + 32 <= end; ptr += 32) xxh64_stripe(state, ptr);
+
+    if (ptr < end) {
+        memcpy(state->stripe, ptr, end - ptr);
+        state->stripe_used = (uint32_t)(end - ptr);
+    }
+}
+
+uint64_t xxh64_digest(const Xxh64_State *state, uint64_t seed) {
+    const uint8_t *ptr = state->stripe;
+    const uint8_t *end = ptr + state->stripe_used;
+    uint64_t hash;
+
+    if (state->total >= 32) {
+        hash = xxh_rotl(state->v1, 1) + xxh_rotl(state->v2, 7) + xxh_rotl(state->v3, 12) + xxh_rotl(state->v4, 18);
+        hash = xxh_merge_round(hash, state->v1);
+        hash = xxh_merge_round(hash, state->v2);
+        hash = xxh_merge_round(hash, state->v3);
+        hash = xxh_merge_round(hash, state->v4);
+    } else {
+        hash = seed + XXH_PRIME64_5;
+    }
+    hash += state->total;
+
+    for (; ptr + 8 <= end; ptr += 8) {
+        hash ^= xxh_round(0, xxh_read64(ptr));
+        hash  = xxh_rotl(hash, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (ptr + 4 <= end) {
+        hash ^= (uint64_t)xxh_read32(ptr) * XXH_PRIME64_1;
+        hash  = xxh_rotl(hash, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        ptr  += 4;
+    }
+    for (; ptr < end; ++ptr) {
+        hash ^= (*ptr) * XXH_PRIME64_5;
+        hash  = xxh_rotl(hash, 11) * XXH_PRIME64_1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+uint64_t xxh64(const void *data, size_t length, uint64_t seed) {
+    Xxh64_State state;
+    xxh64_reset(&state, seed);
+    xxh64_update(&state, data, length);
+    return xxh64_digest(&state, seed);
+}
+
+// Hash whole content of a file, HASH_CHUNK bytes of buffer at a time.
+// returns 0 if it couldn't be read or its size changed while we were at it.
+int32_t hash_file(const char *path, uint8_t *buffer, uint64_t *out_digest) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_NONBLOCK);
+    if (fd == -1 && errno == ELOOP) fd = open(path, O_RDONLY | O_CLOEXEC | O_NONBLOCK); // symlink, hash what it points to.
+    if (fd == -1) return 0;
+
+    struct stat status;
+    if (fstat(fd, &status) == -1 || !S_ISREG(status.st_mode)) {
+        // fifos, sockets and devices have no content worth comparing.
+        close(fd);
+        return 0;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    Xxh64_State state;
+    xxh64_reset(&state, 0);
+    uint64_t size   = (uint64_t)status.st_size;
+    uint64_t offset = 0;
+    ssize_t read_amount;
+    while ((read_amount = pread(fd, buffer, HASH_CHUNK, (off_t)offset)) > 0) {
+        xxh64_update(&state, buffer, (size_t)read_amount);
+        offset += (uint64_t)read_amount;
+        if (offset > size) break; // grew, it's being written to.
+    }
+    close(fd);
+
+    // a file that's mid-write gets hashed again with the next change.
+    if (read_amount == -1 || offset != size) return 0;
+    *out_digest = xxh64_digest(&state, 0);
+    return 1;
+}
+
+// ====================================
+// Snapshot.
+
+#define SNAPSHOT_DIR  0x1
+#define SNAPSHOT_DEAD 0x2
+#define SNAPSHOT_HASHED 0x4 // digest holds the content hash.
+
+#define SNAPSHOT_MAX_DEPTH 255
+
+#define SCAN_THREADS_MAX 64
+
+// Whole watched tree kept between frames.
+// Flat arrays indexed by entry, so walking it doesn't chase pointers around.
+struct File_Snapshot {
+    size_t    count;
+    size_t    capacity;
+    uint64_t *inode;
+    uint64_t *mtime;
+    uint64_t *size;
+    int32_t  *parent;       // -1 for the root.
+    int32_t  *first_child;
+    int32_t  *next_sibling;
+    uint32_t *name;         // offset into names. root holds the full path.
+    uint32_t *seen;         // listing generation this entry was last seen in.
+    uint8_t  *flags;
+    uint64_t *digest;       // only filled when hash_contents is on.
+    size_t    dead_count;
+
+    char   *names;
+    size_t  names_used;
+    size_t  names_capacity;
+
+    // (parent, name) -> entry + 1. open addressing, 0 is empty.
+    int32_t *table;
+    size_t   table_capacity;
+
+    uint32_t generation;
+    uint64_t latest_modified_time;
+    int32_t  scan_threads; // full scans are spread over this many threads.
+    int32_t  scan_backend; // SCAN_BACKEND_*
+    Ignore_Rules *ignore;  // ignored entries never make it in, ignored directories are never opened.
+    int32_t  hash_contents; // files only count as changed when their content did.
+    int32_t  hash_pending;  // hashing was just turned on, the next refresh hashes every file.
+    uint8_t *hash_buffer;   // HASH_CHUNK bytes, reused for every file.
+    Ignore_Path *ignore_path;     // relative path of the directory entries get checked in, see snapshot_is_ignored.
+    int32_t      ignore_path_dir; // that directory's index + 1, 0 = none yet.
+    size_t   unchanged_content_count; // files last refresh dropped because only their metadata changed.
+
+    Dirent_Arena arena;
+
+    // entries that were added / modified / removed by the last refresh.
+    int32_t *changed;
+    size_t   changed_count;
+    size_t   changed_capacity;
+};
+
+File_Snapshot create_snapshot() {
+    File_Snapshot snapshot = {0};
+    return snapshot;
+}
+
+void destroy_snapshot(File_Snapshot *snapshot) {
+    free(snapshot->inode);
+    free(snapshot->mtime);
+    free(snapshot->size);
+    free(snapshot->parent);
+    free(snapshot->first_child);
+    free(snapshot->next_sibling);
+    free(snapshot->name);
+    free(snapshot->seen);
+    free(snapshot->flags);
+    free(snapshot->digest);
+    free(snapshot->names);
+    free(snapshot->table);
+    free(snapshot->changed);
+    free(snapshot->hash_buffer);
+    free(snapshot->ignore_path);
+    free_dirent_arena(&snapshot->arena);
+    *snapshot = create_snapshot();
+}
+
+#define SnapshotGrow(mArray, mCapacity) do {                                              \
+    void *new_ptr = realloc((mArray), (mCapacity) * sizeof(*(mArray)));                  \
+    assert(new_ptr && "Realloc failed, shouldn't continue.");                            \
+    (mArray) = (decltype(mArray))new_ptr;                                                \
+} while(0)
+
+uint64_t snapshot_hash(int32_t parent, const char *name) {
+    uint64_t hash = 14695981039346656037llu ^ (uint64_t)(uint32_t)parent;
+    for (const char *c = name; *c; ++c) {
+        hash = (hash ^ (uint8_t)*c) * 1099511628211llu;
+    }
+    return hash;
+}
+
+const char *snapshot_name(File_Snapshot *snapshot, int32_t index) {
+    return snapshot->names + snapshot->name[index];
+}
+
+void snapshot_table_insert(File_Snapshot *snapshot, int32_t index) {
+    size_t mask = snapshot->table_capacity - 1;
+    size_t slot = snapshot_hash(snapshot->parent[index], snapshot_name(snapshot, index)) & mask;
+    while (snapshot->table[slot] != 0) slot = (slot + 1) & mask;
+    snapshot->table[slot] = index + 1;
+}
+
+void snapshot_rebuild_table(File_Snapshot *snapshot, size_t capacity) {
+    free(snapshot->table);
+    snapshot->table          = (int32_t *)calloc(capacity, sizeof(int32_t));
+    snapshot->table_capacity = capacity;
+    assert(snapshot->table && "Calloc failed, shouldn't continue.");
+
+    for (size_t i = 0; i < snapshot->count; ++i) {
+        if (!(snapshot->flags[i] & SNAPSHOT_DEAD)) snapshot_table_insert(snapshot, (int32_t)i);
+    }
+}
+
+int32_t snapshot_find(File_Snapshot *snapshot, int32_t parent, const char *name) {
+    if (!snapshot->table_capacity) return -1;
+
+    size_t mask = snapshot->table_capacity - 1;
+    for (size_t slot = snapshot_hash(parent, name) & mask; snapshot->table[slot]; slot = (slot + 1) & mask) {
+        int32_t index = snapshot->table[slot] - 1;
+        if (snapshot->parent[index] == parent &&
+            !(snapshot->flags[index] & SNAPSHOT_DEAD) &&
+            strcmp(snapshot_name(snapshot, index), name) == 0)
+        {
+            return index;
+        }
+    }
+    return -1;
+}
+
+void snapshot_mark_changed(File_Snapshot *snapshot, int32_t index) {
+    if (snapshot->changed_count == snapshot->changed_capacity) {
+        snapshot->changed_capacity = snapshot->changed_capacity ? snapshot->changed_capacity * 2 : 64;
+        SnapshotGrow(snapshot->changed, snapshot->changed_capacity);
+    }
+    snapshot->changed[snapshot->changed_count++] = index;
+}
+
+// Make room for given amount of extra entries and name bytes.
+void snapshot_reserve(File_Snapshot *snapshot, size_t extra_entries, size_t extra_name_bytes) {
+    if (snapshot->count + extra_entries > snapshot->capacity) {
+        snapshot->capacity = snapshot->capacity ? snapshot->capacity * 2 : 1024;
+        while (snapshot->count + extra_entries > snapshot->capacity) snapshot->capacity *= 2;
+        SnapshotGrow(snapshot->inode,        snapshot->capacity);
+        SnapshotGrow(snapshot->mtime,        snapshot->capacity);
+        SnapshotGrow(snapshot->size,         snapshot->capacity);
+        SnapshotGrow(snapshot->parent,       snapshot->capacity);
+        SnapshotGrow(snapshot->first_child,  snapshot->capacity);
+        SnapshotGrow(snapshot->next_sibling, snapshot->capacity);
+        SnapshotGrow(snapshot->name,         snapshot->capacity);
+        SnapshotGrow(snapshot->seen,         snapshot->capacity);
+        SnapshotGrow(snapshot->flags,        snapshot->capacity);
+        SnapshotGrow(snapshot->digest,       snapshot->capacity);
+    }
+
+    if (snapshot->names_used + extra_name_bytes > snapshot->names_capacity) {
+        snapshot->names_capacity = snapshot->names_capacity ? snapshot->names_capacity * 2 : 16 * 1024;
+        while (snapshot->names_used + extra_name_bytes > snapshot->names_capacity) snapshot->names_capacity *= 2;
+        SnapshotGrow(snapshot->names, snapshot->names_capacity);
+    }
+}
+
+int32_t snapshot_add(File_Snapshot *snapshot, int32_t parent, const char *name, struct stat *status) {
+    size_t name_length = strlen(name) + 1;
+    snapshot_reserve(snapshot, 1, name_length);
+
+    int32_t index = (int32_t)snapshot->count++;
+    memcpy(snapshot->names + snapshot->names_used, name, name_length);
+    snapshot->name[index]  = (uint32_t)snapshot->names_used;
+    snapshot->names_used  += name_length;
+
+    snapshot->inode[index]        = status->st_ino;
+    snapshot->mtime[index]        = ModTime(*status);
+    snapshot->size[index]         = status->st_size;
+    snapshot->parent[index]       = parent;
+    snapshot->first_child[index]  = -1;
+    snapshot->next_sibling[index] = -1;
+    snapshot->seen[index]         = snapshot->generation;
+    snapshot->flags[index]        = S_ISDIR(status->st_mode) ? SNAPSHOT_DIR : 0;
+
+    if (parent >= 0) {
+        snapshot->next_sibling[index] = snapshot->first_child[parent];
+        snapshot->first_child[parent] = index;
+    }
+
+    // keep the load factor under a half.
+    if (snapshot->count * 2 > snapshot->table_capacity) {
+        snapshot_rebuild_table(snapshot, snapshot->table_capacity ? snapshot->table_capacity * 2 : 4096);
+    } else {
+        snapshot_table_insert(snapshot, index);
+    }
+    return index;
+}
+
+// symlinks pointing back up would make us recurse forever otherwise.
+int32_t snapshot_depth(File_Snapshot *snapshot, int32_t index) {
+    int32_t depth = 0;
+    for (int32_t i = snapshot->parent[index]; i >= 0; i = snapshot->parent[i]) depth++;
+    return depth;
+}
+
+// Write full path of given entry into the buffer. 0 if it doesn't fit, or it's more than
+// SNAPSHOT_MAX_DEPTH levels down (a cut off path would be some other entry's).
+int32_t snapshot_path(File_Snapshot *snapshot, int32_t index, char *buffer, size_t buffer_size) {
+    int32_t chain[SNAPSHOT_MAX_DEPTH + 1];
+    int32_t depth = 0;
+    int32_t i = index;
+    for (; i >= 0 && depth <= SNAPSHOT_MAX_DEPTH; i = snapshot->parent[i]) {
+        chain[depth++] = i;
+    }
+
+    size_t used = 0;
+    buffer[0] = 0;
+    if (i >= 0) return 0;
+    for (int32_t d = depth - 1; d >= 0; --d) {
+        // a root of "/" already ends in the separator.
+        int32_t no_separator = (d == depth - 1) || (used > 0 && buffer[used - 1] == '/');
+        int written = snprintf(buffer + used, buffer_size - used, no_separator ? "%s" : "/%s", snapshot_name(snapshot, chain[d]));
+        if (written < 0 || (size_t)written >= buffer_size - used) return 0;
+        used += written;
+    }
+    return 1;
+}
+
+// Whether an entry called name inside directory dir_index should be left out.
+// anchored patterns need the path below the root, which is only put together when there are some,
+// and then once per directory: entries come a directory at a time.
+int32_t snapshot_is_ignored(File_Snapshot *snapshot, int32_t dir_index, const char *name, int32_t is_dir) {
+    if (!snapshot->ignore) return 0;
+    if (!ignore_rules_need_paths(snapshot->ignore)) return ignore_rules_match(snapshot->ignore, NULL, name, is_dir);
+
+    if (snapshot->ignore_path_dir != dir_index + 1) {
+        if (!snapshot->ignore_path) {
+            snapshot->ignore_path = (Ignore_Path *)malloc(sizeof(Ignore_Path));
+            assert(snapshot->ignore_path && "Malloc failed, shouldn't continue.");
+        }
+        char dirpath[4096];
+        if (!snapshot_path(snapshot, dir_index, dirpath, sizeof(dirpath))) return 0;
+        const char *relative = dirpath + strlen(snapshot_name(snapshot, 0));
+        if (*relative == '/') relative++;
+        ignore_path_set_parent(snapshot->ignore_path, relative);
+        snapshot->ignore_path_dir = dir_index + 1;
+    }
+    return ignore_rules_match_in(snapshot->ignore, snapshot->ignore_path, name, is_dir);
+}
+
+void snapshot_remove(File_Snapshot *snapshot, int32_t index) {
+    for (int32_t child = snapshot->first_child[index]; child != -1; child = snapshot->next_sibling[child]) {
+        snapshot_remove(snapshot, child);
+    }
+    snapshot->flags[index] |= SNAPSHOT_DEAD;
+    snapshot->dead_count++;
+    snapshot_mark_changed(snapshot, index);
+}
+
+// Re-stat a single known entry, reports whether it changed.
+int32_t snapshot_update(File_Snapshot *snapshot, int32_t index, struct stat *status) {
+    uint64_t time = ModTime(*status);
+    int32_t is_dir = S_ISDIR(status->st_mode);
+
+    if (snapshot->inode[index] == status->st_ino && snapshot->mtime[index] == time &&
+        (is_dir || snapshot->size[index] == (uint64_t)status->st_size))
+    {
+        return 0;
+    }
+
+    snapshot->inode[index] = status->st_ino;
+    snapshot->mtime[index] = time;
+    snapshot->size[index]  = status->st_size;
+    return 1;
+}
+
+// Bring one directory up to date.
+// relist = 1 reads the directory again and picks up new / removed entries, new directories get scanned in full.
+// relist = 0 only re-stats entries we already know of.
+void snapshot_scan_directory(File_Snapshot *snapshot, Logger *logger, int32_t dir_index, int dir_fd, int32_t relist) {
+    if (!relist) {
+        for (int32_t child = snapshot->first_child[dir_index]; child != -1; child = snapshot->next_sibling[child]) {
+            if (snapshot->flags[child] & (SNAPSHOT_DIR | SNAPSHOT_DEAD)) continue;
+
+            struct stat status;
+            if (!stat_entry_at(dir_fd, snapshot_name(snapshot, child), &status)) {
+                // gone, next relist of the directory drops it for good.
+                snapshot_mark_changed(snapshot, child);
+                continue;
+            }
+            if (snapshot_update(snapshot, child, &status)) {
+                snapshot_mark_changed(snapshot, child);
+            }
+        }
+        return;
+    }
+
+    size_t begin, end;
+    if (!read_directory_entries(dir_fd, &snapshot->arena, &begin, &end)) return;
+
+    uint32_t generation = ++snapshot->generation;
+    for (size_t offset = begin; offset < end; ) {
+        // arena may move while we recurse, so always go through the offset.
+        struct linux_dirent64 *file_entry = (struct linux_dirent64 *)(snapshot->arena.data + offset);
+        offset += file_entry->d_reclen;
+
+        const char *name = file_entry->d_name;
+        if (is_forbidden_path((char *)name)) continue;
+
+        // d_type is enough to rule most entries out before touching them, symlinks and DT_UNKNOWN get stat'ed first.
+        int32_t type_is_known = (file_entry->d_type == DT_DIR || file_entry->d_type == DT_REG);
+        if (type_is_known && snapshot_is_ignored(snapshot, dir_index, name, file_entry->d_type == DT_DIR)) continue;
+
+        // new directories get opened anyway, stat them through the fd instead of by name.
+        int32_t index  = snapshot_find(snapshot, dir_index, name);
+        int     sub_fd = -1;
+        struct stat status;
+        if (index == -1 && file_entry->d_type == DT_DIR) {
+            sub_fd = open_directory_at(dir_fd, name);
+            if (sub_fd == -1 || fstat(sub_fd, &status) == -1) {
+                if (sub_fd != -1) close(sub_fd);
+                if (!stat_entry_at(dir_fd, name, &status)) continue;
+                sub_fd = -1;
+            }
+        } else if (!stat_entry_at(dir_fd, name, &status)) {
+            continue;
+        }
+        if (!type_is_known && snapshot_is_ignored(snapshot, dir_index, name, S_ISDIR(status.st_mode))) {
+            if (sub_fd != -1) close(sub_fd);
+            continue;
+        }
+
+        if (index != -1 && (snapshot->flags[index] & SNAPSHOT_DIR) != (S_ISDIR(status.st_mode) ? SNAPSHOT_DIR : 0)) {
+            // file turned into a directory or the other way around.
+            snapshot_remove(snapshot, index);
+            index = -1;
+        } else if (index != -1 && (snapshot->flags[index] & SNAPSHOT_DIR) && snapshot->inode[index] != status.st_ino) {
+            // directory got replaced by another one, whatever we knew about its content is stale.
+            snapshot_remove(snapshot, index);
+            index = -1;
+        }
+
+        if (index == -1) {
+            index = snapshot_add(snapshot, dir_index, name, &status);
+            snapshot_mark_changed(snapshot, index);
+            if (S_ISDIR(status.st_mode) && snapshot_depth(snapshot, index) < SNAPSHOT_MAX_DEPTH) {
+                if (sub_fd == -1) sub_fd = open_directory_at(dir_fd, name);
+                if (sub_fd != -1) snapshot_scan_directory(snapshot, logger, index, sub_fd, 1);
+            }
+        } else {
+            if (snapshot_update(snapshot, index, &status) && !(snapshot->flags[index] & SNAPSHOT_DIR)) {
+                snapshot_mark_changed(snapshot, index);
+            }
+        }
+        if (sub_fd != -1) close(sub_fd);
+        snapshot->seen[index] = generation;
+    }
+    snapshot->arena.used = begin;
+
+    // anything we didn't see in this listing is gone.
+    int32_t *link = &snapshot->first_child[dir_index];
+    while (*link != -1) {
+        int32_t child = *link;
+        if (!(snapshot->flags[child] & SNAPSHOT_DEAD) && snapshot->seen[child] != generation) {
+            snapshot_remove(snapshot, child);
+        }
+        if (snapshot->flags[child] & SNAPSHOT_DEAD) {
+            *link = snapshot->next_sibling[child];
+        } else {
+            link = &snapshot->next_sibling[child];
+        }
+    }
+}
+
+// Drop dead entries once they're no longer referenced by the changed list.
+void snapshot_compact(File_Snapshot *snapshot) {
+    if (snapshot->dead_count * 2 < snapshot->count) return;
+    snapshot->ignore_path_dir = 0; // indices move.
+
+    int32_t *remap = (int32_t *)malloc(snapshot->count * sizeof(int32_t));
+    assert(remap && "Malloc failed, shouldn't continue.");
+
+    size_t alive = 0;
+    for (size_t i = 0; i < snapshot->count; ++i) {
+        if (snapshot->flags[i] & SNAPSHOT_DEAD) {
+            remap[i] = -1;
+            continue;
+        }
+        remap[i] = (int32_t)alive;
+
+        snapshot->inode[alive] = snapshot->inode[i];
+        snapshot->mtime[alive] = snapshot->mtime[i];
+        snapshot->size[alive]  = snapshot->size[i];
+        snapshot->name[alive]  = snapshot->name[i];
+        snapshot->seen[alive]  = snapshot->seen[i];
+        snapshot->flags[alive] = snapshot->flags[i];
+        snapshot->digest[alive] = snapshot->digest[i];
+        snapshot->parent[alive]       = snapshot->parent[i];
+        snapshot->first_child[alive]  = snapshot->first_child[i];
+        snapshot->next_sibling[alive] = snapshot->next_sibling[i];
+        alive++;
+    }
+
+    for (size_t i = 0; i < alive; ++i) {
+        // dead siblings are unlinked already, so every link points to something alive.
+        if (snapshot->parent[i]       != -1) snapshot->parent[i]       = remap[snapshot->parent[i]];
+        if (snapshot->first_child[i]  != -1) snapshot->first_child[i]  = remap[snapshot->first_child[i]];
+        if (snapshot->next_sibling[i] != -1) snapshot->next_sibling[i] = remap[snapshot->next_sibling[i]];
+    }
+
+    free(remap);
+    snapshot->count      = alive;
+    snapshot->dead_count = 0;
+    snapshot_rebuild_table(snapshot, snapshot->table_capacity);
+}
+
+int32_t snapshot_hash_entry(File_Snapshot *snapshot, int32_t index) {
+    char path[1024];
+    if (!snapshot->hash_buffer) {
+        snapshot->hash_buffer = (uint8_t *)malloc(HASH_CHUNK);
+        assert(snapshot->hash_buffer && "Malloc failed, shouldn't continue.");
+    }
+    if (!snapshot_path(snapshot, index, path, sizeof(path)) || !hash_file(path, snapshot->hash_buffer, &snapshot->digest[index])) {
+        snapshot->flags[index] &= ~SNAPSHOT_HASHED;
+        return 0;
+    }
+    snapshot->flags[index] |= SNAPSHOT_HASHED;
+    return 1;
+}
+
+void snapshot_hash_all(File_Snapshot *snapshot) {
+    for (size_t i = 0; i < snapshot->count; ++i) {
+        if (!(snapshot->flags[i] & (SNAPSHOT_DIR | SNAPSHOT_DEAD))) snapshot_hash_entry(snapshot, (int32_t)i);
+    }
+}
+
+// Drop files from the changed list whose content is what it was before:
+// touch, checkout of identical content, editor saving without edits...
+// only files we had a digest for can be dropped, anything new / removed / unreadable stays.
+void snapshot_confirm_changes(File_Snapshot *snapshot) {
+    snapshot->unchanged_content_count = 0;
+    if (!snapshot->hash_contents) return;
+
+    size_t kept = 0;
+    for (size_t i = 0; i < snapshot->changed_count; ++i) {
+        int32_t index = snapshot->changed[i];
+        if (!(snapshot->flags[index] & (SNAPSHOT_DIR | SNAPSHOT_DEAD))) {
+            int32_t  had_digest = snapshot->flags[index] & SNAPSHOT_HASHED;
+            uint64_t old_digest = snapshot->digest[index];
+            if (snapshot_hash_entry(snapshot, index) && had_digest && snapshot->digest[index] == old_digest) {
+                snapshot->unchanged_content_count++;
+                continue;
+            }
+        }
+        snapshot->changed[kept++] = index;
+    }
+    snapshot->changed_count = kept;
+}
+
+void snapshot_begin_refresh(File_Snapshot *snapshot) {
+    snapshot->changed_count = 0;
+    snapshot_compact(snapshot);
+}
+
+void snapshot_end_refresh(File_Snapshot *snapshot) {
+    snapshot_confirm_changes(snapshot);
+    if (snapshot->hash_pending) {
+        // after the confirm, so changes made since the toggle still count.
+        snapshot_hash_all(snapshot);
+        snapshot->hash_pending = 0;
+    }
+    for (size_t i = 0; i < snapshot->changed_count; ++i) {
+        int32_t index = snapshot->changed[i];
+        if (!(snapshot->flags[index] & (SNAPSHOT_DIR | SNAPSHOT_DEAD)) && snapshot->mtime[index] > snapshot->latest_modified_time) {
+            snapshot->latest_modified_time = snapshot->mtime[index];
+        }
+    }
+}
+
+// ====================================
+// Parallel scanning.
+//
+// Full scans hand directories out to a pool of workers.
+// Each worker owns a deque: it pushes / pops subdirectories at the back, idle workers steal from the front.
+// Workers keep what they find in their own arrays, which get merged into the snapshot once everyone's done.
+
+#define SCAN_ROOT_REF (-1)
+
+typedef struct {
+    int64_t  parent;  // (worker << 32) | local index, or SCAN_ROOT_REF.
+    uint32_t name;    // offset into worker's names.
+    uint8_t  flags;
+    uint64_t inode;
+    uint64_t mtime;
+    uint64_t size;
+} Scan_Entry;
+
+typedef struct {
+    char   *path;
+    int64_t parent;  // ref of the directory this one lives in.
+    int32_t depth;
+    int32_t is_root; // root is in the snapshot already, only its content gets scanned.
+} Scan_Job;
+
+struct Parallel_Scan;
+
+typedef struct {
+    Parallel_Scan *scan;
+    int32_t        id;
+    pthread_t      thread;
+    int32_t        thread_started;
+    uint32_t       random;
+
+    pthread_mutex_t lock;
+    Scan_Job *jobs;
+    size_t    jobs_begin;
+    size_t    jobs_end;
+    size_t    jobs_capacity;
+
+    Scan_Entry *entries;
+    size_t      entry_count;
+    size_t      entry_capacity;
+    char       *names;
+    size_t      names_used;
+    size_t      names_capacity;
+
+    Dirent_Arena arena;
+} Scan_Worker;
+
+struct Parallel_Scan {
+    Logger      *logger;
+    Ignore_Rules *ignore;
+    size_t       root_length;
+    Scan_Worker *workers;
+    int32_t      worker_count;
+    std::atomic<int64_t> pending; // jobs pushed but not finished yet.
+
+    // workers with nothing to pop or steal sleep here until a push bumps work_epoch or pending hits 0.
+    pthread_mutex_t      idle_lock;
+    pthread_cond_t       work_ready;
+    uint64_t             work_epoch;
+    std::atomic<int32_t> sleeping;
+};
+
+void scan_wake_workers(Parallel_Scan *scan, int32_t all) {
+    pthread_mutex_lock(&scan->idle_lock);
+    scan->work_epoch++;
+    if (all) pthread_cond_broadcast(&scan->work_ready);
+    else     pthread_cond_signal(&scan->work_ready);
+    pthread_mutex_unlock(&scan->idle_lock);
+}
+
+void scan_push_job(Scan_Worker *worker, Scan_Job job) {
+    worker->scan->pending.fetch_add(1);
+
+    pthread_mutex_lock(&worker->lock);
+    if (worker->jobs_end == worker->jobs_capacity) {
+        if (worker->jobs_begin > 0) {
+            memmove(worker->jobs, worker->jobs + worker->jobs_begin, (worker->jobs_end - worker->jobs_begin) * sizeof(Scan_Job));
+            worker->jobs_end  -= worker->jobs_begin;
+            worker->jobs_begin = 0;
+        } else {
+            worker->jobs_capacity = worker->jobs_capacity ? worker->jobs_capacity * 2 : 256;
+            SnapshotGrow(worker->jobs, worker->jobs_capacity);
+        }
+    }
+    worker->jobs[worker->jobs_end++] = job;
+    pthread_mutex_unlock(&worker->lock);
+
+    // nobody asleep: whoever goes to sleep next checks the deques again first, and sees this one.
+    if (worker->scan->sleeping.load() > 0) scan_wake_workers(worker->scan, 0);
+}
+
+int32_t scan_pop_job(Scan_Worker *worker, Scan_Job *out_job) {
+    int32_t found = 0;
+    pthread_mutex_lock(&worker->lock);
+    if (worker->jobs_begin != worker->jobs_end) {
+        *out_job = worker->jobs[--worker->jobs_end];
+        found = 1;
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return found;
+}
+
+int32_t scan_steal_job(Scan_Worker *thief, Scan_Job *out_job) {
+    Parallel_Scan *scan = thief->scan;
+
+    // xorshift, just so every thief doesn't hammer worker 0 first.
+    thief->random ^= thief->random << 13;
+    thief->random ^= thief->random >> 17;
+    thief->random ^= thief->random << 5;
+
+    for (int32_t i = 0; i < scan->worker_count; ++i) {
+        Scan_Worker *victim = &scan->workers[(thief->random + i) % scan->worker_count];
+        if (victim == thief) continue;
+
+        pthread_mutex_lock(&victim->lock);
+        if (victim->jobs_begin != victim->jobs_end) {
+            *out_job = victim->jobs[victim->jobs_begin++];
+            pthread_mutex_unlock(&victim->lock);
+            return 1;
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+    return 0;
+}
+
+int64_t scan_add_entry(Scan_Worker *worker, int64_t parent, const char *name, struct stat *status) {
+    if (worker->entry_count == worker->entry_capacity) {
+        worker->entry_capacity = worker->entry_capacity ? worker->entry_capacity * 2 : 1024;
+        SnapshotGrow(worker->entries, worker->entry_capacity);
+    }
+
+    size_t name_length = strlen(name) + 1;
+    if (worker->names_used + name_length > worker->names_capacity) {
+        worker->names_capacity = worker->names_capacity ? worker->names_capacity * 2 : 16 * 1024;
+        while (worker->names_used + name_length > worker->names_capacity) worker->names_capacity *= 2;
+        SnapshotGrow(worker->names, worker->names_capacity);
+    }
+
+    Scan_Entry *entry = &worker->entries[worker->entry_count];
+    entry->parent = parent;
+    entry->name   = (uint32_t)worker->names_used;
+    entry->flags  = S_ISDIR(status->st_mode) ? SNAPSHOT_DIR : 0;
+    entry->inode  = status->st_ino;
+    entry->mtime  = ModTime(*status);
+    entry->size   = status->st_size;
+
+    memcpy(worker->names + worker->names_used, name, name_length);
+    worker->names_used += name_length;
+
+    return ((int64_t)worker->id << 32) | (int64_t)worker->entry_count++;
+}
+
+void scan_process_job(Scan_Worker *worker, Scan_Job *job) {
+    const char *name = strrchr(job->path, '/');
+    name = name ? name + 1 : job->path;
+
+    // directory's own metadata comes from the fd we need anyway, d_type already told us it's a directory.
+    struct stat status;
+    int dir_fd = open_directory_at(AT_FDCWD, job->path);
+    if (dir_fd == -1 || fstat(dir_fd, &status) == -1) {
+        if (dir_fd != -1) close(dir_fd);
+        if (!job->is_root && stat(job->path, &status) == 0) {
+            scan_add_entry(worker, job->parent, name, &status); // there, just can't look inside.
+        }
+        return;
+    }
+
+    int64_t ref = job->is_root ? SCAN_ROOT_REF : scan_add_entry(worker, job->parent, name, &status);
+
+    Ignore_Rules *ignore = worker->scan->ignore;
+    const char *relative = job->path + worker->scan->root_length;
+    if (*relative == '/') relative++;
+    Ignore_Path ignore_path;
+    if (ignore_rules_need_paths(ignore)) ignore_path_set_parent(&ignore_path, relative);
+
+    size_t begin, end;
+    if (job->depth < SNAPSHOT_MAX_DEPTH && read_directory_entries(dir_fd, &worker->arena, &begin, &end)) {
+        size_t path_length = strlen(job->path);
+        for (size_t offset = begin; offset < end; ) {
+            struct linux_dirent64 *file_entry = (struct linux_dirent64 *)(worker->arena.data + offset);
+            offset += file_entry->d_reclen;
+            if (is_forbidden_path(file_entry->d_name)) continue;
+
+            int32_t is_directory  = (file_entry->d_type == DT_DIR);
+            int32_t type_is_known = is_directory || file_entry->d_type == DT_REG;
+            if (type_is_known && ignore_rules_match_in(ignore, &ignore_path, file_entry->d_name, is_directory)) continue;
+
+            if (!is_directory) {
+                if (!stat_entry_at(dir_fd, file_entry->d_name, &status)) continue;
+                is_directory = S_ISDIR(status.st_mode);
+                if (!type_is_known && ignore_rules_match_in(ignore, &ignore_path, file_entry->d_name, is_directory)) continue;
+                if (!is_directory) {
+                    scan_add_entry(worker, ref, file_entry->d_name, &status);
+                    continue;
+                }
+            }
+
+            // whoever picks the directory up adds its entry.
+            size_t name_length = strlen(file_entry->d_name);
+            Scan_Job child = {0};
+            child.path   = (char *)malloc(path_length + name_length + 2);
+            child.parent = ref;
+            child.depth  = job->depth + 1;
+            assert(child.path && "Malloc failed, shouldn't continue.");
+            memcpy(child.path, job->path, path_length);
+            child.path[path_length] = '/';
+            memcpy(child.path + path_length + 1, file_entry->d_name, name_length + 1);
+            scan_push_job(worker, child);
+        }
+        worker->arena.used = begin;
+    }
+    close(dir_fd);
+}
+
+void *scan_worker_task(void *arg) {
+    Scan_Worker *worker = (Scan_Worker *)arg;
+    Parallel_Scan *scan = worker->scan;
+
+    for (;;) {
+        Scan_Job job;
+        if (scan_pop_job(worker, &job) || scan_steal_job(worker, &job)) {
+            scan_process_job(worker, &job);
+            free(job.path);
+            // the last one wakes everybody up to leave.
+            if (scan->pending.fetch_sub(1) == 1) scan_wake_workers(scan, 1);
+            continue;
+        }
+
+        // nothing to do. only done once nobody else can produce more work either.
+        if (scan->pending.load() == 0) break;
+
+        // counted as sleeping before the last look, so a push in between either shows up in it or wakes us.
+        pthread_mutex_lock(&scan->idle_lock);
+        scan->sleeping.fetch_add(1);
+        uint64_t epoch = scan->work_epoch;
+        pthread_mutex_unlock(&scan->idle_lock);
+
+        int32_t found = scan_pop_job(worker, &job) || scan_steal_job(worker, &job);
+        pthread_mutex_lock(&scan->idle_lock);
+        while (!found && scan->work_epoch == epoch && scan->pending.load() != 0) {
+            pthread_cond_wait(&scan->work_ready, &scan->idle_lock);
+        }
+        scan->sleeping.fetch_sub(1);
+        pthread_mutex_unlock(&scan->idle_lock);
+
+        if (found) {
+            scan_process_job(worker, &job);
+            free(job.path);
+            if (scan->pending.fetch_sub(1) == 1) scan_wake_workers(scan, 1);
+        }
+    }
+    return NULL;
+}
+
+// Move what every worker found into the snapshot. root has to be entry 0 already.
+void scan_merge_into_snapshot(Parallel_Scan *scan, File_Snapshot *snapshot) {
+    size_t total_entries = 0, total_names = 0;
+    size_t *offsets = (size_t *)malloc(scan->worker_count * sizeof(size_t));
+    assert(offsets && "Malloc failed, shouldn't continue.");
+
+    for (int32_t w = 0; w < scan->worker_count; ++w) {
+        offsets[w]     = snapshot->count + total_entries;
+        total_entries += scan->workers[w].entry_count;
+        total_names   += scan->workers[w].names_used;
+    }
+    snapshot_reserve(snapshot, total_entries, total_names);
+
+    for (int32_t w = 0; w < scan->worker_count; ++w) {
+        Scan_Worker *worker = &scan->workers[w];
+        size_t name_base = snapshot->names_used;
+        if (worker->names_used) memcpy(snapshot->names + name_base, worker->names, worker->names_used);
+        snapshot->names_used += worker->names_used;
+
+        for (size_t i = 0; i < worker->entry_count; ++i) {
+            Scan_Entry *entry = &worker->entries[i];
+            size_t index = offsets[w] + i;
+
+            snapshot->inode[index]        = entry->inode;
+            snapshot->mtime[index]        = entry->mtime;
+            snapshot->size[index]         = entry->size;
+            snapshot->name[index]         = (uint32_t)(name_base + entry->name);
+            snapshot->flags[index]        = entry->flags;
+            snapshot->seen[index]         = snapshot->generation;
+            snapshot->first_child[index]  = -1;
+            snapshot->next_sibling[index] = -1;
+            snapshot->parent[index]       = (entry->parent == SCAN_ROOT_REF) ? 0 :
+                                            (int32_t)(offsets[entry->parent >> 32] + (entry->parent & 0xffffffff));
+
+            if (!(entry->flags & SNAPSHOT_DIR) && entry->mtime > snapshot->latest_modified_time) {
+                snapshot->latest_modified_time = entry->mtime;
+            }
+        }
+    }
+    snapshot->count += total_entries;
+    free(offsets);
+
+    for (size_t index = 1; index < snapshot->count; ++index) {
+        int32_t parent = snapshot->parent[index];
+        snapshot->next_sibling[index] = snapshot->first_child[parent];
+        snapshot->first_child[parent] = (int32_t)index;
+    }
+
+    size_t table_capacity = 4096;
+    while (table_capacity < snapshot->count * 2) table_capacity *= 2;
+    snapshot_rebuild_table(snapshot, table_capacity);
+}
+
+void snapshot_scan_parallel(File_Snapshot *snapshot, Logger *logger, const char *root, int32_t thread_count) {
+    Parallel_Scan scan;
+    scan.logger       = logger;
+    scan.ignore       = snapshot->ignore;
+    scan.root_length  = strlen(root);
+    scan.worker_count = thread_count;
+    scan.pending.store(0);
+    scan.sleeping.store(0);
+    scan.work_epoch = 0;
+    pthread_mutex_init(&scan.idle_lock, NULL);
+    pthread_cond_init(&scan.work_ready, NULL);
+    scan.workers = (Scan_Worker *)calloc(thread_count, sizeof(Scan_Worker));
+    assert(scan.workers && "Calloc failed, shouldn't continue.");
+
+    for (int32_t w = 0; w < thread_count; ++w) {
+        scan.workers[w].scan   = &scan;
+        scan.workers[w].id     = w;
+        scan.workers[w].random = 2463534242u + w * 7919u;
+        pthread_mutex_init(&scan.workers[w].lock, NULL);
+    }
+
+    Scan_Job root_job = {0};
+    root_job.path    = strdup(root);
+    root_job.parent  = SCAN_ROOT_REF;
+    root_job.is_root = 1;
+    scan_push_job(&scan.workers[0], root_job);
+
+    // calling thread works as worker 0.
+    for (int32_t w = 1; w < thread_count; ++w) {
+        // the others steal its share, the scan just has one thread less.
+        int result = pthread_create(&scan.workers[w].thread, NULL, scan_worker_task, &scan.workers[w]);
+        if (result != 0) watcher_log(logger, "failed to start scan worker %d: %s", w, strerror(result));
+        scan.workers[w].thread_started = result == 0;
+    }
+    scan_worker_task(&scan.workers[0]);
+
+    for (int32_t w = 1; w < thread_count; ++w) {
+        if (scan.workers[w].thread_started) pthread_join(scan.workers[w].thread, NULL);
+    }
+
+    scan_merge_into_snapshot(&scan, snapshot);
+
+    for (int32_t w = 0; w < thread_count; ++w) {
+        pthread_mutex_destroy(&scan.workers[w].lock);
+        free(scan.workers[w].jobs);
+        free(scan.workers[w].entries);
+        free(scan.workers[w].names);
+        free_dirent_arena(&scan.workers[w].arena);
+    }
+    free(scan.workers);
+    pthread_cond_destroy(&scan.work_ready);
+    pthread_mutex_destroy(&scan.idle_lock);
+}
+
+// ====================================
+// io_uring scanning.
+//
+// Instead of one statx round trip per entry, every entry of every directory we know of gets queued
+// as IORING_OP_STATX and completions are reaped as they come. Directories found on the way are
+// opened and listed while the rest of the batch is still in flight.
+// Kernels without io_uring (or without STATX on it) go through snapshot_scan_directory as usual.
+
+#define URING_QUEUE_DEPTH 256
+
+typedef struct {
+    int fd;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void  *sq_ptr;
+    void  *cq_ptr;
+    size_t sq_size;
+    size_t cq_size;
+    size_t sqes_size;
+} Uring;
+
+void uring_destroy(Uring *ring) {
+    if (ring->sqes)                                 munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr) munmap(ring->cq_ptr, ring->cq_size);
+    if (ring->sq_ptr)                               munmap(ring->sq_ptr, ring->sq_size);
+    if (ring->fd != -1)                             close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+// returns 0 if io_uring (or STATX on it) isn't available here.
+int32_t uring_create(Uring *ring, unsigned entries) {
+    memset(ring, 0, sizeof(*ring));
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd == -1) return 0;
+
+    // STATX only showed up in 5.6, ask before relying on it.
+    size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = (struct io_uring_probe *)calloc(1, probe_size);
+    assert(probe && "Calloc failed, shouldn't continue.");
+    int32_t supported = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+                        probe->last_op >= IORING_OP_STATX &&
+                        (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    if (!supported) {
+        uring_destroy(ring);
+        return 0;
+    }
+
+    ring->sq_size   = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size   = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_size > ring->sq_size) ring->sq_size = ring->cq_size;
+        ring->cq_size = ring->sq_size;
+    }
+
+    ring->sq_ptr = mmap(0, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        ring->sq_ptr = NULL;
+        uring_destroy(ring);
+        return 0;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(0, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) {
+            ring->cq_ptr = NULL;
+            uring_destroy(ring);
+            return 0;
+        }
+    }
+
+    ring->sqes = (struct io_uring_sqe *)mmap(0, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        uring_destroy(ring);
+        return 0;
+    }
+
+    char *sq = (char *)ring->sq_ptr;
+    ring->sq_head  = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail  = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask  = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+
+    char *cq = (char *)ring->cq_ptr;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes    = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 1;
+}
+
+void uring_queue_statx(Uring *ring, int dir_fd, const char *name, struct statx *out, uint64_t user_data) {
+    unsigned tail  = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode      = IORING_OP_STATX;
+    sqe->fd          = dir_fd;
+    sqe->addr        = (uint64_t)(uintptr_t)name;
+    sqe->len         = STATX_TYPE | STATX_MTIME | STATX_INO | STATX_SIZE;
+    sqe->off         = (uint64_t)(uintptr_t)out;
+    sqe->statx_flags = AT_NO_AUTOMOUNT;
+    sqe->user_data   = user_data;
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Hand everything queued over to the kernel and wait for at least one completion.
+int32_t uring_submit_and_wait(Uring *ring, unsigned to_submit) {
+    for (;;) {
+        long result = syscall(__NR_io_uring_enter, ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (result >= 0) return 1;
+        if (errno != EINTR) return 0;
+    }
+}
+
+// One directory on its way through the ring.
+// stays around until its entries are all back and its subdirectories got opened.
+typedef struct Uring_Directory {
+    int      fd;
+    int32_t  index;            // snapshot entry of the directory.
+    int32_t  depth;
+    struct Uring_Directory *parent;
+    const char *name;          // points into parent's entries until we're opened.
+
+    char    *entries;          // getdents64 output, names we hand to the kernel point in here.
+    size_t   entries_size;
+    size_t   next_entry;
+    int32_t  queued_all;
+    int32_t  in_flight;        // statx still out.
+    int32_t  unopened_children;
+} Uring_Directory;
+
+typedef struct {
+    struct statx     result;
+    Uring_Directory *directory;
+    const char      *name;
+    int32_t          type_was_known; // ignore rules were checked by d_type already.
+} Uring_Slot;
+
+typedef struct {
+    Uring_Directory **items;
+    size_t begin;
+    size_t end;
+    size_t capacity;
+} Uring_Directory_Queue;
+
+void uring_directory_push(Uring_Directory_Queue *queue, Uring_Directory *directory) {
+    if (queue->end == queue->capacity) {
+        queue->capacity = queue->capacity ? queue->capacity * 2 : 64;
+        SnapshotGrow(queue->items, queue->capacity);
+    }
+    queue->items[queue->end++] = directory;
+}
+
+void uring_directory_release(Uring_Directory *directory) {
+    if (directory->queued_all && directory->in_flight == 0 && directory->unopened_children == 0) {
+        if (directory->fd != -1) close(directory->fd);
+        free(directory->entries);
+        free(directory);
+    }
+}
+
+// Open and read a directory so its entries can be queued. consumes it if there's nothing to queue.
+int32_t uring_directory_list(Uring_Directory *directory) {
+    Uring_Directory *parent = directory->parent;
+    if (parent) {
+        directory->fd = open_directory_at(parent->fd, directory->name);
+        directory->parent = NULL;
+        parent->unopened_children--;
+        uring_directory_release(parent);
+    }
+
+    Dirent_Arena arena = {0};
+    size_t begin = 0, end = 0;
+    if (directory->fd != -1 && read_directory_entries(directory->fd, &arena, &begin, &end) && end > begin) {
+        directory->entries      = arena.data;
+        directory->entries_size = end;
+        return 1;
+    }
+
+    free_dirent_arena(&arena);
+    directory->queued_all = 1;
+    uring_directory_release(directory);
+    return 0;
+}
+
+// Wait for everything the kernel still has, the statx buffers and names it writes to are about to be freed.
+// submits what an earlier failed enter left in the queue. returns 0 if the ring won't give them back.
+int32_t uring_drain(Uring *ring, Uring_Slot *slots, int32_t *in_flight) {
+    int32_t failures = 0;
+    for (;;) {
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) {
+            Uring_Directory *directory = slots[ring->cqes[head & *ring->cq_mask].user_data].directory;
+            directory->in_flight--;
+            (*in_flight)--;
+            uring_directory_release(directory);
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        if (*in_flight == 0) return 1;
+
+        unsigned unsubmitted = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        long result = syscall(__NR_io_uring_enter, ring->fd, unsubmitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (result == -1 && errno != EINTR && ++failures >= 16) return 0;
+    }
+}
+
+// Close and free every directory still waiting in the queues, and the parents only they kept alive.
+// nothing may be in flight anymore.
+void uring_directory_free_queues(Uring_Directory_Queue *found, Uring_Directory_Queue *listed) {
+    for (size_t i = found->begin; i < found->end; ++i) {
+        // never opened, their name points into the parent's entries.
+        Uring_Directory *directory = found->items[i];
+        Uring_Directory *parent    = directory->parent;
+        if (directory->fd != -1) close(directory->fd);
+        free(directory);
+        if (parent) {
+            parent->unopened_children--;
+            uring_directory_release(parent);
+        }
+    }
+    for (size_t i = listed->begin; i < listed->end; ++i) {
+        listed->items[i]->queued_all = 1;
+        uring_directory_release(listed->items[i]);
+    }
+    free(found->items);
+    free(listed->items);
+}
+
+int32_t snapshot_scan_uring(File_Snapshot *snapshot, Logger *logger, int root_fd) {
+    Uring ring;
+    if (!uring_create(&ring, URING_QUEUE_DEPTH)) return 0;
+
+    Uring_Slot *slots = (Uring_Slot *)calloc(URING_QUEUE_DEPTH, sizeof(Uring_Slot));
+    int32_t *free_slots = (int32_t *)malloc(URING_QUEUE_DEPTH * sizeof(int32_t));
+    assert(slots && free_slots && "Alloc failed, shouldn't continue.");
+    int32_t free_count = URING_QUEUE_DEPTH;
+    for (int32_t i = 0; i < URING_QUEUE_DEPTH; ++i) free_slots[i] = URING_QUEUE_DEPTH - 1 - i;
+
+    // found: subdirectories not opened yet, taken newest first so fewer directories are alive at once.
+    // listed: read directories with entries left to queue.
+    Uring_Directory_Queue found  = {0};
+    Uring_Directory_Queue listed = {0};
+
+    Uring_Directory *root = (Uring_Directory *)calloc(1, sizeof(Uring_Directory));
+    assert(root && "Calloc failed, shouldn't continue.");
+    root->fd = open_directory_at(root_fd, "."); // not dup(), that shares the read offset with the fallback scan.
+    uring_directory_push(&found, root);
+
+    int32_t in_flight = 0;
+    for (;;) {
+        unsigned queued = 0;
+        while (free_count > 0) {
+            if (listed.begin != listed.end) {
+                Uring_Directory *directory = listed.items[listed.begin];
+                if (directory->next_entry >= directory->entries_size) {
+                    listed.begin++;
+                    directory->queued_all = 1;
+                    uring_directory_release(directory);
+                    continue;
+                }
+
+                struct linux_dirent64 *file_entry = (struct linux_dirent64 *)(directory->entries + directory->next_entry);
+                directory->next_entry += file_entry->d_reclen;
+                if (is_forbidden_path(file_entry->d_name)) continue;
+
+                int32_t type_is_known = (file_entry->d_type == DT_DIR || file_entry->d_type == DT_REG);
+                if (type_is_known && snapshot_is_ignored(snapshot, directory->index, file_entry->d_name, file_entry->d_type == DT_DIR)) continue;
+
+                int32_t slot_index = free_slots[--free_count];
+                slots[slot_index].directory      = directory;
+                slots[slot_index].name           = file_entry->d_name;
+                slots[slot_index].type_was_known = type_is_known;
+                directory->in_flight++;
+                in_flight++;
+
+                uring_queue_statx(&ring, directory->fd, file_entry->d_name, &slots[slot_index].result, (uint64_t)slot_index);
+                queued++;
+            } else if (found.begin != found.end) {
+                Uring_Directory *directory = found.items[--found.end];
+                if (uring_directory_list(directory)) {
+                    if (listed.begin == listed.end) listed.begin = listed.end = 0;
+                    uring_directory_push(&listed, directory);
+                }
+            } else {
+                break;
+            }
+        }
+
+        if (in_flight == 0) break;
+
+        if (!uring_submit_and_wait(&ring, queued)) {
+            // entries queued so far are lost, caller starts over with the synchronous walk.
+            watcher_log(logger, "io_uring_enter failed: %s", strerror(errno));
+            break;
+        }
+
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            int32_t slot_index = (int32_t)cqe->user_data;
+            Uring_Slot *slot = &slots[slot_index];
+            Uring_Directory *directory = slot->directory;
+
+            int32_t keep = (cqe->res == 0);
+            if (keep && !slot->type_was_known) {
+                keep = !snapshot_is_ignored(snapshot, directory->index, slot->name, S_ISDIR(slot->result.stx_mode));
+            }
+
+            if (keep) {
+                struct stat status;
+                memset(&status, 0, sizeof(status));
+                status.st_mode         = slot->result.stx_mode;
+                status.st_ino          = slot->result.stx_ino;
+                status.st_size         = slot->result.stx_size;
+                status.st_mtim.tv_sec  = slot->result.stx_mtime.tv_sec;
+                status.st_mtim.tv_nsec = slot->result.stx_mtime.tv_nsec;
+
+                int32_t index = snapshot_add(snapshot, directory->index, slot->name, &status);
+                snapshot_mark_changed(snapshot, index);
+                if (S_ISDIR(status.st_mode) && directory->depth + 1 < SNAPSHOT_MAX_DEPTH) {
+                    Uring_Directory *child = (Uring_Directory *)calloc(1, sizeof(Uring_Directory));
+                    assert(child && "Calloc failed, shouldn't continue.");
+                    child->fd     = -1;
+                    child->index  = index;
+                    child->depth  = directory->depth + 1;
+                    child->parent = directory;
+                    child->name   = slot->name;
+                    directory->unopened_children++;
+                    uring_directory_push(&found, child);
+                }
+            }
+
+            free_slots[free_count++] = slot_index;
+            directory->in_flight--;
+            in_flight--;
+            uring_directory_release(directory);
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    int32_t finished = (in_flight == 0);
+    if (!finished && !uring_drain(&ring, slots, &in_flight)) {
+        // the kernel may still write into slots and directory entries, so they stay allocated.
+        watcher_log(logger, "io_uring requests never completed, leaking %d of them", in_flight);
+        uring_destroy(&ring);
+        free(free_slots);
+        return 0;
+    }
+
+    uring_directory_free_queues(&found, &listed);
+    free(slots);
+    free(free_slots);
+    uring_destroy(&ring);
+    return finished;
+}
+
+// Throw away everything but the root, for starting a scan over.
+void snapshot_truncate_to_root(File_Snapshot *snapshot) {
+    snapshot->count          = 1;
+    snapshot->names_used     = strlen(snapshot_name(snapshot, 0)) + 1;
+    snapshot->first_child[0] = -1;
+    snapshot->changed_count  = 0;
+    snapshot->dead_count     = 0;
+    snapshot_rebuild_table(snapshot, snapshot->table_capacity);
+}
+
+// Scan whole tree from scratch. returns 0 if the root isn't a readable directory.
+int32_t snapshot_build(File_Snapshot *snapshot, Logger *logger, const char *root) {
+    int32_t scan_threads = snapshot->scan_threads;
+    int32_t scan_backend = snapshot->scan_backend;
+    Ignore_Rules *ignore = snapshot->ignore;
+    int32_t hash_contents = snapshot->hash_contents;
+    destroy_snapshot(snapshot);
+    snapshot->scan_threads  = scan_threads;
+    snapshot->scan_backend  = scan_backend;
+    snapshot->ignore        = ignore;
+
+    int root_fd = open_directory_at(AT_FDCWD, root);
+    if (root_fd == -1) {
+        watcher_log(logger, "failed to open directory: %s, path: %s", strerror(errno), root);
+        return 0;
+    }
+
+    struct stat status;
+    if (fstat(root_fd, &status) == -1) {
+        watcher_log(logger, "failed to load path by stat: %s, path: %s", strerror(errno), root);
+        close(root_fd);
+        return 0;
+    }
+
+    snapshot_add(snapshot, -1, root, &status);
+    int32_t scanned = 0;
+    if (scan_backend == SCAN_BACKEND_URING) {
+        scanned = snapshot_scan_uring(snapshot, logger, root_fd);
+        if (scanned) {
+            snapshot_end_refresh(snapshot);
+            snapshot->changed_count = 0;
+        } else {
+            watcher_log(logger, "io_uring scan unavailable, falling back to the regular one.");
+            snapshot->scan_backend = SCAN_BACKEND_SYNC;
+            snapshot_truncate_to_root(snapshot);
+        }
+    }
+
+    if (scanned) {
+        // done already.
+    } else if (scan_threads > 1) {
+        snapshot_scan_parallel(snapshot, logger, root, scan_threads);
+    } else {
+        snapshot_scan_directory(snapshot, logger, 0, root_fd, 1);
+        snapshot_end_refresh(snapshot);
+        snapshot->changed_count = 0;
+    }
+    close(root_fd);
+
+    // every file needs a digest to compare against later on.
+    snapshot->hash_contents = hash_contents;
+    if (hash_contents) snapshot_hash_all(snapshot);
+    return 1;
+}
+
+int32_t snapshot_set_scan_backend(File_Snapshot *snapshot, int32_t backend) {
+    snapshot->scan_backend = backend;
+    return 1;
+}
+
+// Turning it on for a snapshot that's built already leaves the hashing to the next refresh,
+// so the caller (the ui, usually) doesn't sit through reading the whole tree.
+int32_t snapshot_set_content_hashing(File_Snapshot *snapshot, int32_t enabled) {
+    if (enabled && !snapshot->hash_contents && snapshot->count) snapshot->hash_pending = 1;
+    if (!enabled) snapshot->hash_pending = 0;
+    snapshot->hash_contents = enabled;
+    return 1;
+}
+
+void snapshot_set_ignore_rules(File_Snapshot *snapshot, Ignore_Rules *rules) {
+    snapshot->ignore = rules;
+}
+
+// 0 picks one thread per core.
+int32_t snapshot_set_scan_threads(File_Snapshot *snapshot, int32_t thread_count) {
+    if (thread_count <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = (cores > 0) ? (int32_t)cores : 1;
+    }
+    snapshot->scan_threads = (thread_count > SCAN_THREADS_MAX) ? SCAN_THREADS_MAX : thread_count;
+    return 1;
+}
+
+// Bring every directory up to date without help from the watcher.
+// directories whose own mtime didn't move are not read again, their files only get re-stat'ed.
+// returns 0 if the root itself is gone.
+int32_t snapshot_refresh(File_Snapshot *snapshot, Logger *logger) {
+    snapshot_begin_refresh(snapshot);
+    if (snapshot->count == 0) return 0;
+
+    size_t count = snapshot->count; // new directories get scanned in full while they're added.
+    for (size_t i = 0; i < count; ++i) {
+        if ((snapshot->flags[i] & (SNAPSHOT_DIR | SNAPSHOT_DEAD)) != SNAPSHOT_DIR) continue;
+
+        char dirpath[1024];
+        if (!snapshot_path(snapshot, (int32_t)i, dirpath, sizeof(dirpath))) continue;
+
+        struct stat status;
+        int dir_fd = open_directory_at(AT_FDCWD, dirpath);
+        if (dir_fd == -1 || fstat(dir_fd, &status) == -1) {
+            if (dir_fd != -1) close(dir_fd);
+            if (i == 0) return 0;
+            continue; // parent's relist will drop it.
+        }
+
+        int32_t relist = snapshot_update(snapshot, (int32_t)i, &status);
+        snapshot_scan_directory(snapshot, logger, (int32_t)i, dir_fd, relist);
+        close(dir_fd);
+    }
+
+    snapshot_end_refresh(snapshot);
+    return 1;
+}
+
+// Look up a directory by full path. returns -1 if it's not in the snapshot.
+int32_t snapshot_find_path(File_Snapshot *snapshot, const char *path) {
+    if (snapshot->count == 0) return -1;
+
+    const char *root = snapshot_name(snapshot, 0);
+    size_t root_length = strlen(root);
+    if (strncmp(path, root, root_length) != 0) return -1;
+
+    int32_t index = 0;
+    const char *cursor = path + root_length;
+    while (*cursor && index != -1) {
+        while (*cursor == '/') cursor++;
+        if (!*cursor) break;
+
+        const char *end = strchr(cursor, '/');
+        size_t length = end ? (size_t)(end - cursor) : strlen(cursor);
+
+        char name[256] = {0};
+        if (length >= sizeof(name)) return -1;
+        memcpy(name, cursor, length);
+
+        index = snapshot_find(snapshot, index, name);
+        cursor += length;
+    }
+    return index;
+}
+
+// Rescan only the directories watcher told us about.
+void snapshot_refresh_directories(File_Snapshot *snapshot, Logger *logger, const char **dirpaths, size_t dirpath_count) {
+    snapshot_begin_refresh(snapshot);
+
+    for (size_t i = 0; i < dirpath_count; ++i) {
+        int32_t index = snapshot_find_path(snapshot, dirpaths[i]);
+        if (index == -1 || (snapshot->flags[index] & SNAPSHOT_DEAD)) continue; // new or removed, parent takes care of it.
+
+        struct stat status;
+        int dir_fd = open_directory_at(AT_FDCWD, dirpaths[i]);
+        if (dir_fd == -1) continue;
+        if (fstat(dir_fd, &status) == 0) {
+            snapshot_update(snapshot, index, &status);
+            snapshot_scan_directory(snapshot, logger, index, dir_fd, 1);
+        }
+        close(dir_fd);
+    }
+
+    snapshot_end_refresh(snapshot);
+}
+
+// ====================================
+// Watching.
+
+// Events that count as "something changed" in the watched tree.
+#define WATCH_EVENT_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO)
+
+struct Watch_Handle {
+    int32_t valid;
+    int32_t fallback_to_scan; // inotify is unavailable or ran out of watches; caller has to stat-walk instead.
+    int32_t root_is_gone;     // watched root got deleted / moved away.
+    int     inotify_fd;
+    int     root_wd;
+    uint32_t start_count;   // bumped on every start_watching, inotify_fd may be a different file even if the number is the same.
+
+    Ignore_Rules *ignore;   // ignored directories don't get a watch, events about ignored names are dropped.
+    size_t        root_length;
+
+    // wd -> directory path. inotify hands out small increasing numbers, so flat array is enough.
+    char  **paths;
+    size_t  paths_capacity;
+
+    // directories that got events since last poll, each one only once.
+    int32_t  needs_full_refresh; // events got lost, every directory has to be checked.
+    int     *dirty;
+    size_t   dirty_count;
+    size_t   dirty_capacity;
+    uint8_t *is_dirty;           // indexed by wd.
+};
+
+Watch_Handle create_watch_handle() {
+    Watch_Handle watch = {0};
+    watch.inotify_fd = -1;
+    watch.root_wd    = -1;
+    return watch;
+}
+
+void forget_watch_paths(Watch_Handle *watch) {
+    for (size_t i = 0; i < watch->paths_capacity; ++i) {
+        free(watch->paths[i]);
+    }
+    free(watch->paths);
+    free(watch->is_dirty);
+    free(watch->dirty);
+    watch->paths          = NULL;
+    watch->is_dirty       = NULL;
+    watch->dirty          = NULL;
+    watch->paths_capacity = 0;
+    watch->dirty_count    = 0;
+    watch->dirty_capacity = 0;
+}
+
+void mark_watch_dirty(Watch_Handle *watch, int wd) {
+    if (watch->is_dirty[wd]) return;
+    watch->is_dirty[wd] = 1;
+
+    if (watch->dirty_count == watch->dirty_capacity) {
+        watch->dirty_capacity = watch->dirty_capacity ? watch->dirty_capacity * 2 : 64;
+        int *new_dirty = (int *)realloc(watch->dirty, watch->dirty_capacity * sizeof(int));
+        assert(new_dirty && "Realloc failed, shouldn't continue.");
+        watch->dirty = new_dirty;
+    }
+    watch->dirty[watch->dirty_count++] = wd;
+}
+
+// Collect paths of directories that got events since last call and forget about them.
+// directories that were removed in the meantime are skipped, their parent is dirty as well.
+size_t take_watch_dirty_paths(Watch_Handle *watch, const char **out_paths, size_t out_capacity) {
+    size_t count = 0;
+    for (size_t i = 0; i < watch->dirty_count; ++i) {
+        int wd = watch->dirty[i];
+        watch->is_dirty[wd] = 0;
+        if (watch->paths[wd] && count < out_capacity) {
+            out_paths[count++] = watch->paths[wd];
+        } else if (watch->paths[wd]) {
+            watch->needs_full_refresh = 1; // ran out of room, just look at everything.
+        }
+    }
+    watch->dirty_count = 0;
+    return count;
+}
+
+void stop_watching(Watch_Handle *watch) {
+    if (watch->inotify_fd != -1) {
+        close(watch->inotify_fd);
+        watch->inotify_fd = -1;
+    }
+    forget_watch_paths(watch);
+    watch->valid   = 0;
+    watch->root_wd = -1;
+}
+
+void watch_set_ignore_rules(Watch_Handle *watch, Ignore_Rules *rules) {
+    watch->ignore = rules;
+}
+
+// path has to be somewhere below the watched root.
+int32_t watch_is_ignored(Watch_Handle *watch, const char *path, int32_t is_dir) {
+    if (!watch->ignore) return 0;
+
+    const char *name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    const char *relative = path + watch->root_length;
+    if (*relative == '/') relative++;
+    return ignore_rules_match(watch->ignore, relative, name, is_dir);
+}
+
+void give_up_watching(Watch_Handle *watch, Logger *logger, const char *reason) {
+    watcher_log(logger, "inotify unavailable (%s). falling back to scanning the folder every frame.", reason);
+    stop_watching(watch);
+    watch->fallback_to_scan = 1;
+}
+
+// Add a watch for given directory and every directory below it.
+// returns 0 if inotify cannot take any more watches.
+int32_t add_watch_recursive(Watch_Handle *watch, Logger *logger, const char *dirpath) {
+    int wd = inotify_add_watch(watch->inotify_fd, dirpath, WATCH_EVENT_MASK | IN_ONLYDIR | IN_DELETE_SELF | IN_MOVE_SELF);
+    if (wd == -1) {
+        int err = errno;
+        if (err == ENOSPC || err == ENOMEM) {
+            return 0;
+        }
+
+        // directory disappeared between readdir and here, or we can't read it. not fatal.
+        if (err != ENOENT && err != ENOTDIR) {
+            watcher_log(logger, "failed to watch %s: %s", dirpath, strerror(err));
+        }
+        return 1;
+    }
+
+    if ((size_t)wd >= watch->paths_capacity) {
+        size_t new_capacity = watch->paths_capacity ? watch->paths_capacity : 256;
+        while ((size_t)wd >= new_capacity) new_capacity *= 2;
+
+        char **new_paths = (char **)realloc(watch->paths, new_capacity * sizeof(char *));
+        assert(new_paths && "Realloc failed, shouldn't continue.");
+        memset(new_paths + watch->paths_capacity, 0, (new_capacity - watch->paths_capacity) * sizeof(char *));
+
+        uint8_t *new_is_dirty = (uint8_t *)realloc(watch->is_dirty, new_capacity);
+        assert(new_is_dirty && "Realloc failed, shouldn't continue.");
+        memset(new_is_dirty + watch->paths_capacity, 0, new_capacity - watch->paths_capacity);
+
+        watch->paths          = new_paths;
+        watch->is_dirty       = new_is_dirty;
+        watch->paths_capacity = new_capacity;
+    }
+
+    // re-adding same directory returns the same wd.
+    free(watch->paths[wd]);
+    watch->paths[wd] = strdup(dirpath);
+
+    DIR *dir = opendir(dirpath);
+    if (!dir) return 1;
+
+    size_t path_length = strlen(dirpath);
+    int32_t result = 1;
+    for(struct dirent *file_entry = readdir(dir); file_entry && result; file_entry = readdir(dir))
+    {
+        if (is_forbidden_path(file_entry->d_name)) continue;
+        if (file_entry->d_type != DT_DIR && file_entry->d_type != DT_UNKNOWN) continue;
+
+        size_t total_length = strlen(file_entry->d_name) + path_length;
+        if (total_length < 1024) {
+            char new_filepath[1024] = {0};
+            snprintf(new_filepath, 1023, "%s/%s", dirpath, file_entry->d_name);
+            if (watch_is_ignored(watch, new_filepath, 1)) continue;
+
+            // DT_UNKNOWN ends up here too, IN_ONLYDIR rejects it with ENOTDIR if it's not a directory.
+            result = add_watch_recursive(watch, logger, new_filepath);
+        }
+    }
+
+    closedir(dir);
+    return result;
+}
+
+int32_t start_watching(Watch_Handle *watch, Logger *logger, const char *path) {
+    stop_watching(watch);
+    watch->fallback_to_scan = 0;
+    watch->root_is_gone     = 0;
+    watch->root_length      = strlen(path);
+    watch->start_count++;
+
+    watch->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch->inotify_fd == -1) {
+        give_up_watching(watch, logger, strerror(errno));
+        return 0;
+    }
+
+    if (!add_watch_recursive(watch, logger, path)) {
+        give_up_watching(watch, logger, "watch limit reached, see /proc/sys/fs/inotify/max_user_watches");
+        return 0;
+    }
+
+    // root is already watched by now, this just hands back its wd.
+    watch->root_wd = inotify_add_watch(watch->inotify_fd, path, WATCH_EVENT_MASK | IN_ONLYDIR | IN_DELETE_SELF | IN_MOVE_SELF);
+    if (watch->root_wd == -1) {
+        watcher_log(logger, "failed to watch %s: %s", path, strerror(errno));
+        stop_watching(watch);
+        return 0;
+    }
+
+    watch->valid = 1;
+    return 1;
+}
+
+// Drain every pending inotify event without blocking.
+// returns the number of events that count as a change in the watched tree.
+int32_t poll_watch_changes(Watch_Handle *watch, Logger *logger) {
+    if (!watch->valid) return 0;
+
+    char buffer[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int32_t changes = 0;
+
+    for (;;) {
+        ssize_t read_amount = read(watch->inotify_fd, buffer, sizeof(buffer));
+        if (read_amount <= 0) {
+            if (read_amount == -1 && errno != EAGAIN && errno != EINTR) {
+                watcher_log(logger, "failed to read inotify events: %s", strerror(errno));
+            }
+            break;
+        }
+
+        for (char *ptr = buffer; ptr < buffer + read_amount; ) {
+            struct inotify_event *event = (struct inotify_event *)ptr;
+            ptr += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                // Kernel dropped events, including possibly directory creations we didn't watch yet.
+                // Rebuild the whole set and have the caller look at every directory.
+                watcher_log(logger, "inotify queue overflowed. re-watching the folder.");
+                if (watch->root_wd >= 0 && watch->paths[watch->root_wd]) {
+                    char root[1024] = {0};
+                    snprintf(root, sizeof(root)-1, "%s", watch->paths[watch->root_wd]);
+                    start_watching(watch, logger, root);
+                }
+                watch->needs_full_refresh = 1;
+                return changes + 1;
+            }
+
+            if (event->wd < 0 || (size_t)event->wd >= watch->paths_capacity || !watch->paths[event->wd]) continue;
+
+            if (event->mask & IN_IGNORED) {
+                free(watch->paths[event->wd]);
+                watch->paths[event->wd] = NULL;
+                continue;
+            }
+
+            if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                if (event->wd == watch->root_wd) {
+                    watch->root_is_gone = 1;
+                    changes++;
+                }
+                continue;
+            }
+
+            char new_filepath[1024] = {0};
+            if (event->len > 0) {
+                snprintf(new_filepath, 1023, "%s/%s", watch->paths[event->wd], event->name);
+                if (watch_is_ignored(watch, new_filepath, (event->mask & IN_ISDIR) != 0)) continue;
+            }
+
+            // new directory showed up (or got moved in): start watching it too.
+            if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO)) && event->len > 0) {
+                if (!add_watch_recursive(watch, logger, new_filepath)) {
+                    give_up_watching(watch, logger, "watch limit reached, see /proc/sys/fs/inotify/max_user_watches");
+                    return changes + 1;
+                }
+            }
+
+            if (event->mask & WATCH_EVENT_MASK) {
+                mark_watch_dirty(watch, event->wd);
+                changes++;
+            }
+        }
+    }
+
+    return changes;
+}
+
+int watch_event_fd(Watch_Handle *watch) {
+    return watch->valid ? watch->inotify_fd : -1;
+}
+
+// ====================================
+// Event loop.
+
+#define EVENT_LOOP_MAX_EVENTS 16
+
+struct Event_Loop {
+    int epoll_fd;
+};
+
+// SIGCHLD handler writes here, so child exits wake epoll up like everything else.
+int child_exit_pipe[2] = { -1, -1 };
+
+void handle_child_signal(int signal) {
+    int saved_errno = errno;
+    char byte = 0;
+    write(child_exit_pipe[1], &byte, 1); // full pipe is fine, there's a wake up pending already.
+    errno = saved_errno;
+}
+
+Event_Loop create_event_loop(Logger *logger) {
+    Event_Loop loop = {0};
+    loop.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop.epoll_fd == -1) {
+        watcher_log(logger, "failed to create epoll: %s", strerror(errno));
+        return loop;
+    }
+
+    if (child_exit_pipe[0] == -1) {
+        if (pipe2(child_exit_pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+            watcher_log(logger, "failed to create child exit pipe: %s", strerror(errno));
+            return loop;
+        }
+
+        struct sigaction action = {0};
+        action.sa_handler = handle_child_signal;
+        action.sa_flags   = SA_RESTART | SA_NOCLDSTOP;
+        if (sigaction(SIGCHLD, &action, NULL) == -1) {
+            watcher_log(logger, "failed on sigaction(SIGCHLD...): %s", strerror(errno));
+        }
+    }
+    event_loop_watch_fd(&loop, child_exit_pipe[0], WAKE_CHILD);
+    return loop;
+}
+
+void destroy_event_loop(Event_Loop *loop) {
+    if (loop->epoll_fd != -1) close(loop->epoll_fd);
+    loop->epoll_fd = -1;
+}
+
+// Wake up whenever fd becomes readable. closing the fd unregisters it.
+int32_t event_loop_watch_fd(Event_Loop *loop, int fd, uint32_t wake_reason) {
+    if (loop->epoll_fd == -1 || fd == -1) return 0;
+
+    struct epoll_event event = {0};
+    event.events   = EPOLLIN;
+    event.data.u64 = ((uint64_t)wake_reason << 32) | (uint32_t)fd;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        if (errno != EEXIST || epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, fd, &event) == -1) return 0;
+    }
+    return 1;
+}
+
+uint32_t event_loop_wait(Event_Loop *loop, int32_t timeout_ms) {
+    if (loop->epoll_fd == -1) {
+        // no epoll, behave like the old frame loop.
+        sleep_ms((timeout_ms >= 0 && timeout_ms < 16) ? timeout_ms : 16);
+        return WAKE_TIMEOUT;
+    }
+
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+    int count = epoll_wait(loop->epoll_fd, events, EVENT_LOOP_MAX_EVENTS, timeout_ms);
+    if (count == -1 && errno == EINTR) {
+        // some signal handler ran. SIGCHLD's byte is in the pipe by now, pick it up right away.
+        if (platform_app_should_close()) return WAKE_SIGNAL;
+        count = epoll_wait(loop->epoll_fd, events, EVENT_LOOP_MAX_EVENTS, 0);
+    }
+    if (count == -1) return WAKE_TIMEOUT;
+
+    uint32_t reasons = 0;
+    for (int i = 0; i < count; ++i) {
+        uint32_t reason = (uint32_t)(events[i].data.u64 >> 32);
+        if (reason == WAKE_CHILD || reason == WAKE_OUTPUT) {
+            // only the wake up matters, waitpid finds out who it was. the lines are in the logger already.
+            char drain[64];
+            while (read((int)(uint32_t)events[i].data.u64, drain, sizeof(drain)) > 0) {}
+        }
+        reasons |= reason;
+    }
+    return reasons;
+}
+
+void sleep_ms(int ms) {
+    usleep(ms * 1000);
+}
+
+uint64_t platform_monotonic_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+uint64_t platform_monotonic_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000llu + now.tv_nsec;
+}
+
+uint32_t platform_process_id() {
+    return (uint32_t)getpid();
+}
+
+// EPERM: it's there, it just isn't ours.
+int32_t platform_process_alive(uint32_t pid) {
+    return kill((pid_t)pid, 0) == 0 || errno == EPERM;
 }
@@ -3,16 +3,16 @@
 #include <Windows.h>
 #include "main.h"
 
-struct Thread_Handle { // TODO: unused
-    HANDLE inner;
-};
-
 struct Process_Handle {
     int32_t valid; // TODO: unused
     PROCESS_INFORMATION procinfo;
 
     HANDLE read_pipe;
     HANDLE write_pipe;
+
+    int32_t      stopping;   // TerminateProcess went out, is_process_running notices once it's gone.
+    uint64_t     started_ms;
+    Process_Exit last_exit;
 };
 
 /*
@@ -97,6 +97,10 @@ Process_Handle create_process_handle() {
     return handle;
 }
 
+// CreateProcess doesn't fork to begin with.
+void process_set_spawn_method(Process_Handle *handle, int32_t method) {
+}
+
 void destroy_handle(Process_Handle *handle) {
     terminate_process(handle);
     close_pipe(handle);
@@ -118,24 +122,29 @@ char *strsep(char **stringp, const char *delim) {
     return not_found;
 }
 
+// Never blocks. once it's gone last_exit gets filled in and its handles closed, like on unix.
 int is_process_running(Process_Handle *handle) {
-    HANDLE empty = {0};
-    if(handle->procinfo.hProcess == empty) return 0;
-
-    DWORD exit_code;
-    GetExitCodeProcess(handle->procinfo.hProcess, &exit_code);
-
-    if (exit_code == STILL_ACTIVE) {
-        switch(WaitForSingleObject(handle->procinfo.hProcess, 0)) {
-            case WAIT_TIMEOUT:
-                return 1;
+    if (!handle->procinfo.hProcess) return 0;
+    if (WaitForSingleObject(handle->procinfo.hProcess, 0) == WAIT_TIMEOUT) return 1;
+
+    DWORD exit_code = 0;
+    Process_Exit *exit = &handle->last_exit;
+    exit->pid        = (int32_t)handle->procinfo.dwProcessId;
+    exit->unknown    = !GetExitCodeProcess(handle->procinfo.hProcess, &exit_code);
+    exit->exit_code  = exit->unknown ? -1 : (int32_t)exit_code;
+    exit->signal     = 0;
+    exit->runtime_ms = platform_monotonic_ms() - handle->started_ms;
+    exit->stopped    = handle->stopping;
+
+    CloseHandle(handle->procinfo.hProcess);
+    CloseHandle(handle->procinfo.hThread);
+    ZeroMemory(&handle->procinfo, sizeof(handle->procinfo));
+    handle->stopping = 0;
+    return 0;
+}
 
-            default:
-                return 0;
-        }
-    } else {
-        return 0;
-    }
+int process_event_fd(Process_Handle *handle) {
+    return -1; // TODO: hProcess is waitable, once there's an event loop to wait in.
 }
 
 char *separate_command_to_executable_and_args(const char *in, char *out_arg_list[], size_t arg_capacity) {
@@ -156,24 +165,88 @@ char *separate_command_to_executable_and_args(const char *in, char *out_arg_list
     return executable_command;
 }
 
-void terminate_process(Process_Handle *process) { // try to terminate the process whether it's alive or not.
-    TerminateProcess(process->procinfo.hProcess, 0);
-
+// The blocking version, for when there's nothing else left to do (shutting down).
+void terminate_process(Process_Handle *process) {
+    if (!process->procinfo.hProcess) return;
+    request_process_stop(process);
     WaitForSingleObject(process->procinfo.hProcess, INFINITE);
-    WaitForSingleObject(process->procinfo.hThread,  INFINITE);
+    is_process_running(process);
+}
+
+// Unsupported: there are no stop signals here, a stop is TerminateProcess right away, so any
+// --stop-signal gets turned down. ctrl-break (GenerateConsoleCtrlEvent) to a CREATE_NEW_PROCESS_GROUP
+// child would be the graceful one.
+int32_t process_set_stop_signal(Process_Handle *handle, const char *signal_name, uint32_t timeout_ms) {
+    return !signal_name || !signal_name[0];
+}
+
+// Doesn't wait, is_process_running reaps it once it's gone.
+void request_process_stop(Process_Handle *handle) {
+    if (!handle->procinfo.hProcess || handle->stopping) return;
+    handle->stopping = 1;
+    TerminateProcess(handle->procinfo.hProcess, 1);
+}
+
+int32_t process_is_stopping(Process_Handle *handle) {
+    return handle->stopping;
+}
 
-    CloseHandle(process->procinfo.hProcess);
-    CloseHandle(process->procinfo.hThread);
+// nothing to escalate to.
+uint64_t process_stop_deadline(Process_Handle *handle) {
+    return 0;
 }
 
-void restart_process(const char *command, Process_Handle *handle, Logger *logger) {
+void update_process_stop(Process_Handle *handle, uint64_t now_ms) {
+}
+
+// Unsupported, --listen refuses to start. WSADuplicateSocket + the protocol info over a pipe is the windows way.
+int32_t open_listen_sockets(const char *addresses, int *fds, int32_t capacity, Logger *logger) {
+    watcher_log(logger, "listening sockets aren't supported on windows yet");
+    return -1;
+}
+
+void close_listen_sockets(int *fds, int32_t count) {
+}
+
+void process_set_listen_fds(Process_Handle *handle, const int *fds, int32_t count) {
+}
+
+// Unsupported, --warm-standby restarts the old way. could hand the child an inheritable pipe HANDLE the same way.
+int32_t process_set_readiness_gate(Process_Handle *handle, int32_t enabled) {
+    return !enabled;
+}
+
+int process_ready_fd(Process_Handle *handle) {
+    return -1;
+}
+
+int32_t process_check_ready(Process_Handle *handle) {
+    return -1;
+}
+
+// Unsupported, --capture-output (and --output-log, --archive with it) leave the output on the console.
+// read_pipe / write_pipe are there for it, the reader would be a thread blocking in ReadFile per
+// child (anonymous pipes can't do overlapped io).
+Output_Reader *create_output_reader(Logger *logger, Log_Archive *archive) {
+    watcher_log(logger, "capturing child output isn't supported on windows yet, it stays on the console");
+    return NULL;
+}
+
+void destroy_output_reader(Output_Reader *reader) {}
+int  output_reader_wake_fd(Output_Reader *reader) { return -1; }
+int32_t output_reader_set_sink(Output_Reader *reader, const char *directory, uint64_t max_bytes, uint32_t max_age_s, int32_t keep) { return 0; }
+void output_reader_add(Output_Reader *reader, int out_fd, int err_fd, const char *tag, int32_t pid, int32_t binding, uint32_t generation) {}
+void process_set_output_reader(Process_Handle *handle, Output_Reader *reader, const char *tag) {}
+void process_set_generation(Process_Handle *handle, int32_t binding, uint32_t generation) {}
+
+int32_t restart_process(const char *command, Process_Handle *handle, Logger *logger) {
     assert(is_process_running(handle) && "Process is not running");
     terminate_process(handle);
 
     assert(!is_process_running(handle) && "Process is still runnning despite of terminate process");
     ZeroMemory(&handle->procinfo, sizeof(handle->procinfo));
 
-    start_process(command, handle, logger);
+    return start_process(command, handle, logger);
 }
 
 int32_t start_process(const char *command, Process_Handle *handle, Logger *logger) {
@@ -202,10 +275,12 @@ int32_t start_process(const char *command, Process_Handle *handle, Logger *logge
                                  &handle->procinfo);
 
     if (created == 0) {
-        watcher_log(logger, "Failed to run process: GetLastError() = %d", GetLastError());
+        watcher_log_ex(logger, LOG_SOURCE_SUPERVISOR, LOG_ERROR, 0, "Failed to run process: GetLastError() = %d", GetLastError());
         ZeroMemory(&handle->procinfo, sizeof(handle->procinfo));
         return 0;
     }   
+    handle->stopping   = 0;
+    handle->started_ms = platform_monotonic_ms();
 
     // CloseHandle(handle->write_pipe);
     return 1;
@@ -364,7 +439,58 @@ int32_t to_full_paths(char *path_buffer, size_t path_buffer_size) {
 }
 
 
-uint64_t find_latest_modified_time(Logger *logger, char *filepath) {
+int32_t resolve_directory(char *path_buffer, size_t path_buffer_size) {
+    char full[MAX_PATH];
+    DWORD length = GetFullPathName(path_buffer, sizeof(full), full, NULL);
+    if (length == 0 || length >= sizeof(full) || length >= path_buffer_size) return 0;
+
+    DWORD attributes = GetFileAttributes(full);
+    if (attributes == INVALID_FILE_ATTRIBUTES || !(attributes & FILE_ATTRIBUTE_DIRECTORY)) return 0;
+    strcpy(path_buffer, full);
+    return 1;
+}
+
+void *map_file(const char *path, size_t *out_size) {
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return NULL;
+
+    LARGE_INTEGER size;
+    void *data = NULL;
+    if (GetFileSizeEx(file, &size) && size.QuadPart > 0) {
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping) {
+            data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping); // the view keeps it alive.
+            *out_size = (size_t)size.QuadPart;
+        }
+    }
+    CloseHandle(file);
+    return data;
+}
+
+void unmap_file(void *data, size_t size) {
+    UnmapViewOfFile(data);
+}
+
+int32_t make_directory(const char *path) {
+    return CreateDirectoryA(path, NULL) || GetLastError() == ERROR_ALREADY_EXISTS;
+}
+
+int32_t list_directory(const char *path, void (*visit)(void *context, const char *name), void *context) {
+    char pattern[MAX_PATH];
+    snprintf(pattern, sizeof(pattern), "%s\\*", path);
+    WIN32_FIND_DATAA data = {0};
+    HANDLE handle = FindFirstFileA(pattern, &data);
+    if (handle == INVALID_HANDLE_VALUE) return 0;
+    do {
+        if (strcmp(data.cFileName, ".") != 0 && strcmp(data.cFileName, "..") != 0) visit(context, data.cFileName);
+    } while (FindNextFileA(handle, &data));
+    FindClose(handle);
+    return 1;
+}
+
+// relative: filepath below the root, '/' separated ("" for the root itself), for the ignore rules.
+uint64_t latest_modified_time_below(Logger *logger, char *filepath, Ignore_Rules *ignore, const char *relative) {
     if (is_forbidden_path(filepath)) return 0;
     WIN32_FIND_DATA data = {0};
     HANDLE handle = FindFirstFile(filepath, &data);
@@ -383,11 +509,14 @@ uint64_t find_latest_modified_time(Logger *logger, char *filepath) {
         HANDLE directory_handle = FindFirstFile(dir_search_term, &dir_data);
 
         do {
-            if (!is_forbidden_path(dir_data.cFileName)) {
+            int32_t is_dir = (dir_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+            if (!is_forbidden_path(dir_data.cFileName) && !ignore_rules_match_child(ignore, relative, dir_data.cFileName, is_dir)) {
                 memset(dir_search_term, 0, sizeof(dir_search_term));
                 snprintf(dir_search_term, sizeof(dir_search_term)-1, "%s\\%s", filepath, dir_data.cFileName);
+                char child_relative[1024];
+                snprintf(child_relative, sizeof(child_relative), relative[0] ? "%s/%s" : "%s%s", relative, dir_data.cFileName);
 
-                uint64_t write_time_for_given_file = find_latest_modified_time(logger, dir_search_term);
+                uint64_t write_time_for_given_file = latest_modified_time_below(logger, dir_search_term, ignore, child_relative);
 
                 if (write_time_for_given_file > result) {
                     result = write_time_for_given_file;
@@ -407,6 +536,162 @@ uint64_t find_latest_modified_time(Logger *logger, char *filepath) {
     return result;
 }
 
+uint64_t find_latest_modified_time(Logger *logger, char *filepath) {
+    return latest_modified_time_below(logger, filepath, NULL, "");
+}
+
+// ====================================
+// Snapshot.
+
+/*
+ * TODO: keep the tree around like unix does.
+ * for now this only remembers the latest timestamp, changed files are reported as the root itself.
+ */
+struct File_Snapshot {
+    char     root[MAX_PATH];
+    Ignore_Rules *ignore;
+    uint64_t latest_modified_time;
+    int32_t  changed[1];
+    size_t   changed_count;
+    size_t   unchanged_content_count;
+};
+
+File_Snapshot create_snapshot() {
+    File_Snapshot snapshot = {0};
+    return snapshot;
+}
+
+void destroy_snapshot(File_Snapshot *snapshot) {
+    *snapshot = create_snapshot();
+}
+
+// Unsupported: the scan is FindFirstFile on one thread, and there's no per-file state to keep digests in.
+int32_t snapshot_set_scan_threads(File_Snapshot *snapshot, int32_t thread_count)  { return thread_count == 1; }
+int32_t snapshot_set_scan_backend(File_Snapshot *snapshot, int32_t backend)       { return backend == SCAN_BACKEND_SYNC; }
+int32_t snapshot_set_content_hashing(File_Snapshot *snapshot, int32_t enabled)    { return !enabled; }
+
+void snapshot_set_ignore_rules(File_Snapshot *snapshot, Ignore_Rules *rules) {
+    snapshot->ignore = rules;
+}
+
+int32_t snapshot_build(File_Snapshot *snapshot, Logger *logger, const char *root) {
+    Ignore_Rules *ignore = snapshot->ignore;
+    *snapshot = create_snapshot();
+    snapshot->ignore = ignore;
+    strncpy(snapshot->root, root, MAX_PATH-1);
+    snapshot->latest_modified_time = latest_modified_time_below(logger, snapshot->root, snapshot->ignore, "");
+    return snapshot->latest_modified_time != 0;
+}
+
+int32_t snapshot_refresh(File_Snapshot *snapshot, Logger *logger) {
+    uint64_t latest = latest_modified_time_below(logger, snapshot->root, snapshot->ignore, "");
+    snapshot->changed_count = 0;
+    if (latest > snapshot->latest_modified_time) {
+        snapshot->latest_modified_time = latest;
+        snapshot->changed_count = 1;
+    }
+    return latest != 0;
+}
+
+void snapshot_refresh_directories(File_Snapshot *snapshot, Logger *logger, const char **dirpaths, size_t dirpath_count) {
+    snapshot_refresh(snapshot, logger);
+}
+
+int32_t snapshot_path(File_Snapshot *snapshot, int32_t index, char *buffer, size_t buffer_size) {
+    snprintf(buffer, buffer_size, "%s", snapshot->root);
+    return 1;
+}
+
+// ====================================
+// Watching.
+
+/*
+ * TODO: ReadDirectoryChangesW.
+ * until then every watch falls back to scanning the folder.
+ */
+struct Watch_Handle {
+    int32_t  valid;
+    int32_t  fallback_to_scan;
+    int32_t  root_is_gone;
+    int32_t  needs_full_refresh;
+    uint32_t start_count;
+};
+
+Watch_Handle create_watch_handle() {
+    Watch_Handle watch = {0};
+    return watch;
+}
+
+void watch_set_ignore_rules(Watch_Handle *watch, Ignore_Rules *rules) {}
+
+int32_t start_watching(Watch_Handle *watch, Logger *logger, const char *path) {
+    watch->valid            = 0;
+    watch->fallback_to_scan = 1;
+    watch->root_is_gone     = 0;
+    return 0;
+}
+
+int32_t poll_watch_changes(Watch_Handle *watch, Logger *logger) {
+    return 0;
+}
+
+size_t take_watch_dirty_paths(Watch_Handle *watch, const char **out_paths, size_t out_capacity) {
+    return 0;
+}
+
+void stop_watching(Watch_Handle *watch) {
+    watch->valid = 0;
+}
+
 void sleep_ms(int ms) {
     Sleep(ms);
 }
+
+// off the same counter as platform_monotonic_ns, GetTickCount64 is its own clock.
+uint64_t platform_monotonic_ms() {
+    return platform_monotonic_ns() / 1000000;
+}
+
+uint32_t platform_process_id() {
+    return (uint32_t)GetCurrentProcessId();
+}
+
+// access denied: it's there, it just isn't ours.
+int32_t platform_process_alive(uint32_t pid) {
+    HANDLE process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, pid);
+    if (!process) return GetLastError() == ERROR_ACCESS_DENIED;
+    DWORD code = 0;
+    int32_t alive = GetExitCodeProcess(process, &code) && code == STILL_ACTIVE;
+    CloseHandle(process);
+    return alive;
+}
+
+// GetTickCount64 is only good to ~15 ms.
+uint64_t platform_monotonic_ns() {
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000000llu +
+           (uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000000llu / frequency.QuadPart;
+}
+
+// ====================================
+// Event loop.
+// BIG TODO: nothing to wait on yet, the loop keeps being paced by vsync like before.
+
+struct Event_Loop {
+    int32_t valid;
+};
+
+Event_Loop create_event_loop(Logger *logger) {
+    Event_Loop loop = {0};
+    return loop;
+}
+
+void destroy_event_loop(Event_Loop *loop) {}
+int32_t event_loop_watch_fd(Event_Loop *loop, int fd, uint32_t wake_reason) { return 0; }
+int watch_event_fd(Watch_Handle *watch) { return -1; }
+
+uint32_t event_loop_wait(Event_Loop *loop, int32_t timeout_ms) {
+    return WAKE_TIMEOUT;
+}